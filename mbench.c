@@ -0,0 +1,563 @@
+/*
+ * mbench.c - Multithreaded benchmarks for the thread-safe build of mm.c
+ *
+ * Each benchmark runs the same workload under a few allocator
+ * configurations (set through mm_mallopt) and prints one line per
+ * configuration, so the effect of a feature can be read off directly.
+ * The heap is reset with mm_init before every run, and checked with
+ * mm_checkheap after it.
+ *
+ * usage: mbench [-h] [-b <name>] [-t <threads>] [-n <ops>]
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memlib.h"
+#include "mm.h"
+
+/* Slots of the ring buffer between a producer and its consumer */
+#define RING_SIZE 1024
+
+/* Blocks each thread of the latency benchmark keeps live at most */
+#define LATENCY_SLOTS 512
+
+/* Blocks the batch benchmark allocates and frees at once */
+#define BATCH_SIZE 256
+
+/* An allocator configuration a benchmark is run under */
+typedef struct
+{
+    const char *label; /* shown in the results table */
+    int param;         /* MM_OPT_* parameter, or 0 for none */
+    long value;
+} config_t;
+
+/* A benchmark */
+typedef struct
+{
+    const char *name;
+    const char *desc;
+    const char *counter; /* mm_counters_t member shown in the last column */
+    size_t offset;       /* and its offset */
+    void (*run)(void);
+} bench_t;
+
+/* Ring buffer handing blocks from one producer thread to one consumer */
+typedef struct
+{
+    void *slot[RING_SIZE];
+    size_t head; /* next slot the consumer takes */
+    size_t tail; /* next slot the producer fills */
+} ring_t;
+
+/* Per-operation latencies recorded by one latency benchmark thread */
+typedef struct
+{
+    unsigned int seed;
+    long *nsecs; /* nops entries */
+} latency_t;
+
+/* Parameters of one batch benchmark thread */
+typedef struct
+{
+    unsigned int seed;
+    bool batched; /* use mm_malloc_batch and mm_free_batch */
+} batch_t;
+
+/* Command line parameters */
+static int nthreads = 2;    /* threads, or producer/consumer pairs */
+static long nops = 1000000; /* operations per thread */
+
+static void bench_prodcons(void);
+static void bench_latency(void);
+static void bench_batch(void);
+static void bench_prof(void);
+
+static const bench_t benches[] = {
+    {"prodcons", "producers malloc, consumers on other threads free",
+     "remote_frees", offsetof(mm_counters_t, remote_frees), bench_prodcons},
+    {"latency", "worst-case malloc/free latency over a wide size range",
+     "fit_scanned", offsetof(mm_counters_t, fit_scanned), bench_latency},
+    {"batch", "same-sized blocks allocated and freed one by one or at once",
+     "batch_carved", offsetof(mm_counters_t, batch_carved), bench_batch},
+    {"prof", "producers and consumers with the heap profiler sampling",
+     "allocs", offsetof(mm_counters_t, allocs), bench_prof},
+    {NULL, NULL, NULL, 0, NULL}
+};
+
+/* The benchmark being run */
+static const bench_t *bench;
+
+static void app_error(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2), noreturn));
+static void usage(char *prog);
+
+/*
+ * now - Returns a monotonic time stamp, in seconds
+ */
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/*
+ * reset_heap - Applies a configuration and starts from an empty heap
+ */
+static void reset_heap(const config_t *config)
+{
+    if (config->param != 0 && !mm_mallopt(config->param, config->value))
+        app_error("mm_mallopt(%d, %ld) failed\n", config->param,
+                  config->value);
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed\n");
+}
+
+/*
+ * report - Checks the heap after a run and prints its line of the table.
+ *     Returns the value of the benchmark's counter
+ */
+static size_t report(const config_t *config, double ops, double secs)
+{
+    mm_counters_t counters;
+    size_t count;
+
+    if (!mm_checkheap(__LINE__))
+        app_error("mm_checkheap failed after run '%s'\n", config->label);
+    mm_get_counters(&counters);
+    count = *(size_t *)((char *)&counters + bench->offset);
+    printf("  %-24s %10.0f %10.3f %12.0f %12zu\n", config->label, ops,
+           secs * 1000.0, ops / secs / 1000.0, count);
+    return count;
+}
+
+/*
+ * run_threads - Runs nthreads copies of each thread function, and returns
+ *     the time it took for all of them to finish
+ */
+static double run_threads(void *(*fn[])(void *), void *args[], int nfn)
+{
+    pthread_t *tids = calloc((size_t)(nthreads * nfn), sizeof(pthread_t));
+    double start;
+    int i, j;
+
+    if (tids == NULL)
+        app_error("Out of memory\n");
+
+    start = now();
+    for (i = 0; i < nthreads; i++)
+    {
+        for (j = 0; j < nfn; j++)
+        {
+            int err = pthread_create(&tids[i * nfn + j], NULL, fn[j],
+                                     args[i * nfn + j]);
+            if (err != 0)
+                app_error("pthread_create: %s\n", strerror(err));
+        }
+    }
+    for (i = 0; i < nthreads * nfn; i++)
+        pthread_join(tids[i], NULL);
+
+    free(tids);
+    return now() - start;
+}
+
+/*
+ * producer - Allocates nops blocks of 16 to 512 bytes into a ring
+ */
+static void *producer(void *arg)
+{
+    ring_t *ring = arg;
+    unsigned int seed = (unsigned int)(size_t)arg;
+    long i;
+
+    for (i = 0; i < nops; i++)
+    {
+        size_t size = 16 + (size_t)(rand_r(&seed) % 497);
+        char *p = mm_malloc(size);
+
+        if (p == NULL)
+            app_error("mm_malloc failed in producer\n");
+        p[0] = (char)i;
+
+        while (ring->tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+               RING_SIZE)
+            sched_yield();
+        ring->slot[ring->tail % RING_SIZE] = p;
+        __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/*
+ * consumer - Frees the nops blocks its producer puts into a ring
+ */
+static void *consumer(void *arg)
+{
+    ring_t *ring = arg;
+    long i;
+
+    for (i = 0; i < nops; i++)
+    {
+        char *p;
+
+        while (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ring->head)
+            sched_yield();
+        p = ring->slot[ring->head % RING_SIZE];
+        if (p[0] != (char)i)
+            app_error("Block handed to consumer was overwritten\n");
+        mm_free(p);
+        __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/*
+ * run_prodcons - Runs producer/consumer pairs, each thread on its own
+ *     arena, under each of a list of configurations
+ */
+static void run_prodcons(const config_t configs[])
+{
+    void *(*fn[])(void *) = {producer, consumer};
+    ring_t *rings = calloc((size_t)nthreads, sizeof(ring_t));
+    void **args = calloc((size_t)(2 * nthreads), sizeof(void *));
+    int i;
+
+    if (rings == NULL || args == NULL)
+        app_error("Out of memory\n");
+    for (i = 0; i < nthreads; i++)
+        args[2 * i] = args[2 * i + 1] = &rings[i];
+
+    /* One arena per thread, as far as they go */
+    if (!mm_mallopt(MM_OPT_ARENAS, 2 * nthreads) &&
+        !mm_mallopt(MM_OPT_ARENAS, 0))
+        app_error("Cannot set the number of arenas\n");
+
+    for (i = 0; configs[i].label != NULL; i++)
+    {
+        double secs;
+
+        memset(rings, 0, (size_t)nthreads * sizeof(ring_t));
+        reset_heap(&configs[i]);
+        secs = run_threads(fn, args, 2);
+        report(&configs[i], 2.0 * (double)nthreads * (double)nops, secs);
+    }
+
+    free(args);
+    free(rings);
+}
+
+/*
+ * bench_prodcons - Producer/consumer pairs with and without the remote free
+ *     stacks
+ */
+static void bench_prodcons(void)
+{
+    static const config_t configs[] = {
+        {"locked remote frees", MM_OPT_REMOTE_FREE, 0},
+        {"remote free stacks", MM_OPT_REMOTE_FREE, 1},
+        {NULL, 0, 0}
+    };
+
+    run_prodcons(configs);
+}
+
+/*
+ * bench_prof - Producer/consumer pairs with the heap profiler off and
+ *     sampling at two rates; consumers free sampled blocks of other threads
+ */
+static void bench_prof(void)
+{
+    static const config_t configs[] = {
+        {"profiler off", MM_OPT_PROF_RATE, 0},
+        {"1 sample per 512KB", MM_OPT_PROF_RATE, 512 * 1024},
+        {"1 sample per 64KB", MM_OPT_PROF_RATE, 64 * 1024},
+        {NULL, 0, 0}
+    };
+
+    run_prodcons(configs);
+    if (!mm_mallopt(MM_OPT_PROF_RATE, 0))
+        app_error("Cannot turn the heap profiler off\n");
+}
+
+/*
+ * latency_worker - Frees or allocates a random slot nops times, timing each
+ *     call. Sizes are mostly small, with a tail up to 32KB
+ */
+static void *latency_worker(void *arg)
+{
+    latency_t *lat = arg;
+    char *slot[LATENCY_SLOTS] = {NULL};
+    long i;
+    int j;
+
+    for (i = 0; i < nops; i++)
+    {
+        int r = rand_r(&lat->seed);
+        char **p = &slot[r % LATENCY_SLOTS];
+        size_t size;
+        double start;
+
+        if ((r >> 10) % 20 == 0)
+            size = 8192 + (size_t)(r >> 15) % 24577;
+        else if ((r >> 10) % 5 == 0)
+            size = 512 + (size_t)(r >> 15) % 7681;
+        else
+            size = 1 + (size_t)(r >> 15) % 512;
+
+        start = now();
+        if (*p != NULL)
+        {
+            mm_free(*p);
+            *p = NULL;
+        }
+        else if ((*p = mm_malloc(size)) == NULL)
+            app_error("mm_malloc failed in latency worker\n");
+        lat->nsecs[i] = (long)((now() - start) * 1e9);
+        if (*p != NULL)
+            (*p)[0] = 1;
+    }
+
+    for (j = 0; j < LATENCY_SLOTS; j++)
+        mm_free(slot[j]);
+    return NULL;
+}
+
+/*
+ * compare_long - qsort comparator for longs
+ */
+static int compare_long(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * bench_latency - Latency distribution of malloc and free, seglists against
+ *     TLSF. TLSF never passes over a free block, which is what bounds its
+ *     worst case; the run fails if it does
+ */
+static void bench_latency(void)
+{
+    static const config_t configs[] = {
+        {"seglist 4-fit", MM_OPT_FIT, MM_FIT_SEGLIST},
+        {"tlsf", MM_OPT_FIT, MM_FIT_TLSF},
+        {NULL, 0, 0}
+    };
+    void *(*fn[])(void *) = {latency_worker};
+    size_t total = (size_t)nthreads * (size_t)nops;
+    latency_t *lats = calloc((size_t)nthreads, sizeof(latency_t));
+    void **args = calloc((size_t)nthreads, sizeof(void *));
+    long *nsecs = calloc(total, sizeof(long));
+    int i, t;
+
+    if (lats == NULL || args == NULL || nsecs == NULL)
+        app_error("Out of memory\n");
+
+    for (i = 0; configs[i].label != NULL; i++)
+    {
+        double secs;
+        size_t scanned;
+
+        for (t = 0; t < nthreads; t++)
+        {
+            lats[t].seed = (unsigned int)t + 1;
+            lats[t].nsecs = nsecs + (size_t)t * (size_t)nops;
+            args[t] = &lats[t];
+        }
+        reset_heap(&configs[i]);
+        secs = run_threads(fn, args, 1);
+        scanned = report(&configs[i], (double)total, secs);
+
+        qsort(nsecs, total, sizeof(long), compare_long);
+        printf("  %-24s p50 %ld ns, p99.9 %ld ns, max %ld ns\n", "",
+               nsecs[total / 2], nsecs[total - 1 - total / 1000],
+               nsecs[total - 1]);
+        if (configs[i].value == MM_FIT_TLSF && scanned != 0)
+            app_error("TLSF passed over %zu free blocks\n", scanned);
+    }
+
+    free(nsecs);
+    free(args);
+    free(lats);
+}
+
+/*
+ * batch_worker - Allocates nops blocks, BATCH_SIZE of one size at a time,
+ *     and frees each group once it is filled in. Sizes alternate between
+ *     slab objects and regular blocks of up to 1KB
+ */
+static void *batch_worker(void *arg)
+{
+    batch_t *batch = arg;
+    void *p[BATCH_SIZE];
+    long round;
+    int j;
+
+    for (round = 0; round < nops / BATCH_SIZE; round++)
+    {
+        int r = rand_r(&batch->seed);
+        size_t size = round % 2 == 0 ? 16 + (size_t)r % 241
+                                     : 257 + (size_t)r % 768;
+
+        if (batch->batched)
+        {
+            if (mm_malloc_batch(size, BATCH_SIZE, p) != BATCH_SIZE)
+                app_error("mm_malloc_batch failed in batch worker\n");
+        }
+        else
+        {
+            for (j = 0; j < BATCH_SIZE; j++)
+                if ((p[j] = mm_malloc(size)) == NULL)
+                    app_error("mm_malloc failed in batch worker\n");
+        }
+        for (j = 0; j < BATCH_SIZE; j++)
+            *(long *)p[j] = round;
+        for (j = 0; j < BATCH_SIZE; j++)
+            if (*(long *)p[j] != round)
+                app_error("Batch block was overwritten\n");
+
+        if (batch->batched)
+            mm_free_batch(p, BATCH_SIZE);
+        else
+            for (j = 0; j < BATCH_SIZE; j++)
+                mm_free(p[j]);
+    }
+    return NULL;
+}
+
+/*
+ * bench_batch - Groups of same-sized blocks, allocated and freed with a
+ *     call per block against a call per group
+ */
+static void bench_batch(void)
+{
+    static const config_t configs[] = {
+        {"malloc/free", 0, 0},
+        {"malloc_batch/free_batch", 0, 1},
+        {NULL, 0, 0}
+    };
+    void *(*fn[])(void *) = {batch_worker};
+    batch_t *batches = calloc((size_t)nthreads, sizeof(batch_t));
+    void **args = calloc((size_t)nthreads, sizeof(void *));
+    long ops = nops / BATCH_SIZE * BATCH_SIZE;
+    int i, t;
+
+    if (batches == NULL || args == NULL)
+        app_error("Out of memory\n");
+
+    for (i = 0; configs[i].label != NULL; i++)
+    {
+        double secs;
+
+        for (t = 0; t < nthreads; t++)
+        {
+            batches[t].seed = (unsigned int)t + 1;
+            batches[t].batched = configs[i].value != 0;
+            args[t] = &batches[t];
+        }
+        reset_heap(&configs[i]);
+        secs = run_threads(fn, args, 1);
+        report(&configs[i], 2.0 * (double)nthreads * (double)ops, secs);
+    }
+
+    free(args);
+    free(batches);
+}
+
+int main(int argc, char **argv)
+{
+    const char *name = NULL;
+    int c, i;
+    bool found = false;
+
+    while ((c = getopt(argc, argv, "b:t:n:h")) != EOF)
+    {
+        switch (c)
+        {
+        case 'b':
+            name = optarg;
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            if (nthreads < 1)
+                app_error("Bad thread count '%s'\n", optarg);
+            break;
+        case 'n':
+            nops = atol(optarg);
+            if (nops < 1)
+                app_error("Bad operation count '%s'\n", optarg);
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    mem_init(false);
+
+    for (i = 0; benches[i].name != NULL; i++)
+    {
+        if (name != NULL && strcmp(name, benches[i].name) != 0)
+            continue;
+        found = true;
+        bench = &benches[i];
+        printf("%s: %s (%d threads, %ld ops each)\n", benches[i].name,
+               benches[i].desc, nthreads, nops);
+        printf("  %-24s %10s %10s %12s %12s\n", "config", "ops", "msecs",
+               "Kops/s", bench->counter);
+        benches[i].run();
+        printf("\n");
+    }
+    if (!found)
+        app_error("Unknown benchmark '%s'\n", name);
+
+    mem_deinit();
+    return 0;
+}
+
+/*
+ * app_error - Report an arbitrary application error
+ */
+static void app_error(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    fflush(NULL);
+    exit(1);
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(char *prog)
+{
+    int i;
+
+    fprintf(stderr, "Usage: %s [-h] [-b <name>] [-t <n>] [-n <ops>]\n",
+            prog);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-b <name>  Only run benchmark <name>.\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-n <ops>   Operations per thread.\n");
+    fprintf(stderr, "\t-t <n>     Threads (or pairs of threads) to run.\n");
+    fprintf(stderr, "Benchmarks\n");
+    for (i = 0; benches[i].name != NULL; i++)
+        fprintf(stderr, "\t%-10s %s\n", benches[i].name, benches[i].desc);
+}
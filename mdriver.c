@@ -9,6 +9,7 @@
  */
 #include <assert.h>
 #include <errno.h>
+#include <stddef.h>
 #include <float.h>
 #include <math.h>
 #include <setjmp.h>
@@ -18,9 +19,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifndef MT_REPLAY
+#define MT_REPLAY 0
+#endif
+
+/* mdriver-mt links the thread-safe mm and can replay traces on threads */
+#if MT_REPLAY
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 #ifdef USE_MSAN
 #include <sanitizer/msan_interface.h>
 #endif
@@ -30,6 +43,7 @@
 #include "memlib.h"
 #include "mm.h"
 #include "stree.h"
+#include "tracefmt.h"
 
 /**********************
  * Constants and macros
@@ -98,12 +112,25 @@ typedef struct
     {
         ALLOC,
         FREE,
-        REALLOC
-    } type;      /* type of request */
-    int index;   /* index for free() to use later */
-    size_t size; /* byte size of alloc/realloc request */
+        REALLOC,
+        MEMALIGN
+    } type;       /* type of request */
+    int index;    /* index for free() to use later */
+    size_t size;  /* byte size of alloc/realloc request */
+    size_t align; /* alignment of memalign request */
+    int thread;   /* trace thread making the request (see "t" lines) */
 } traceop_t;
 
+/* Walks the requests of a trace in order */
+typedef struct
+{
+    const traceop_t *next;  /* next request of a text trace... */
+    tf_reader_t reader;     /* ... or the decoder of a binary trace */
+    traceop_t op;           /* the request last decoded */
+    const char *filename;
+    int num_ids;
+} trace_cursor_t;
+
 /* Holds the information for one trace file */
 typedef struct
 {
@@ -111,8 +138,12 @@ typedef struct
     size_t data_bytes;    /* Peak number of data bytes allocated during trace */
     int num_ids;          /* number of alloc/realloc ids */
     int num_ops;          /* number of distinct requests */
+    int num_threads;      /* number of trace threads (1 + highest number) */
     weight_t weight;      /* weight for this trace */
-    traceop_t *ops;       /* array of requests */
+    traceop_t *ops;       /* array of requests, NULL for binary traces */
+    void *map;            /* binary trace file, mapped (see tracefmt.h) */
+    size_t map_len;
+    trace_cursor_t cursor; /* requests, for the sequential evaluations */
     char **blocks;        /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes;  /* ... and a corresponding array of payload sizes */
     size_t *block_rand_base; /* index into random_data, if debug is on */
@@ -144,6 +175,8 @@ typedef struct
 
     /* defined only for the student malloc package */
     double util; /* space utilization for this trace (always 0 for libc) */
+    size_t heap_peak; /* largest heap size during the trace (0 for libc) */
+    size_t heap_end;  /* heap size once the trace is done (0 for libc) */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -199,6 +232,86 @@ size_t queryGlobalSpaceUsage(void);
 /* by default, no timeouts */
 static int set_timeout = 0;
 
+#if !REF_ONLY
+/* If set, print the allocator's counters and stats after each trace (-S) */
+static bool show_counters = false;
+
+/* If set, free blocks with mm_free_sized (-z) */
+static bool sized_free = false;
+
+/* If nonzero, time each trace again with the heap profiler sampling (-P) */
+static long prof_rate = 0;
+
+#if MT_REPLAY
+/* If nonzero, replay each trace on 1, 2, 4 ... max_threads threads (-n) */
+static int max_threads = 0;
+#endif
+
+/* Names accepted by -o for the allocator's tuning parameters */
+static const struct
+{
+    const char *name;
+    int param;
+} mm_options[] = {
+    {"tcache_count", MM_OPT_TCACHE_COUNT},
+    {"arenas", MM_OPT_ARENAS},
+    {"arena_policy", MM_OPT_ARENA_POLICY},
+    {"remote_free", MM_OPT_REMOTE_FREE},
+    {"slab", MM_OPT_SLAB},
+    {"fit", MM_OPT_FIT},
+    {"fit_candidates", MM_OPT_FIT_CANDIDATES},
+    {"defer", MM_OPT_DEFER},
+    {"trim_threshold", MM_OPT_TRIM_THRESHOLD},
+    {"mmap_threshold", MM_OPT_MMAP_THRESHOLD},
+    {"grow_max", MM_OPT_GROW_MAX},
+    {"prof_rate", MM_OPT_PROF_RATE},
+    {NULL, 0}
+};
+
+/* Names of the fields of mm_counters_t, in the order printed by -S */
+static const struct
+{
+    const char *name;
+    size_t offset;
+} mm_counter_fields[] = {
+    {"tcache_hits", offsetof(mm_counters_t, tcache_hits)},
+    {"tcache_misses", offsetof(mm_counters_t, tcache_misses)},
+    {"tcache_flushes", offsetof(mm_counters_t, tcache_flushes)},
+    {"tcache_flushed", offsetof(mm_counters_t, tcache_flushed)},
+    {"remote_frees", offsetof(mm_counters_t, remote_frees)},
+    {"remote_drains", offsetof(mm_counters_t, remote_drains)},
+    {"remote_drained", offsetof(mm_counters_t, remote_drained)},
+    {"slab_runs", offsetof(mm_counters_t, slab_runs)},
+    {"slab_releases", offsetof(mm_counters_t, slab_releases)},
+    {"fit_searches", offsetof(mm_counters_t, fit_searches)},
+    {"fit_scanned", offsetof(mm_counters_t, fit_scanned)},
+    {"fit_skipped", offsetof(mm_counters_t, fit_skipped)},
+    {"realloc_shrinks", offsetof(mm_counters_t, realloc_shrinks)},
+    {"realloc_grows", offsetof(mm_counters_t, realloc_grows)},
+    {"realloc_copies", offsetof(mm_counters_t, realloc_copies)},
+    {"calloc_cleared", offsetof(mm_counters_t, calloc_cleared)},
+    {"calloc_skipped", offsetof(mm_counters_t, calloc_skipped)},
+    {"defer_frees", offsetof(mm_counters_t, defer_frees)},
+    {"defer_hits", offsetof(mm_counters_t, defer_hits)},
+    {"defer_merges", offsetof(mm_counters_t, defer_merges)},
+    {"defer_merged", offsetof(mm_counters_t, defer_merged)},
+    {"heap_trims", offsetof(mm_counters_t, heap_trims)},
+    {"heap_trimmed", offsetof(mm_counters_t, heap_trimmed)},
+    {"mmap_allocs", offsetof(mm_counters_t, mmap_allocs)},
+    {"mmap_reuses", offsetof(mm_counters_t, mmap_reuses)},
+    {"mmap_remaps", offsetof(mm_counters_t, mmap_remaps)},
+    {"heap_extends", offsetof(mm_counters_t, heap_extends)},
+    {"heap_extended", offsetof(mm_counters_t, heap_extended)},
+    {"batch_carved", offsetof(mm_counters_t, batch_carved)},
+    {"batch_merged", offsetof(mm_counters_t, batch_merged)},
+    {"allocs", offsetof(mm_counters_t, allocs)},
+    {"alloc_bytes", offsetof(mm_counters_t, alloc_bytes)},
+    {"frees", offsetof(mm_counters_t, frees)},
+    {"freed_bytes", offsetof(mm_counters_t, freed_bytes)},
+    {NULL, 0}
+};
+#endif
+
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
 
@@ -245,9 +358,17 @@ static void randomize_block(trace_t *trace, int index);
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(stats_t *stats, const char *tracedir,
                            const char *filename);
+static void parse_trace(trace_t *trace, FILE *tracefile);
+static void map_trace(trace_t *trace, FILE *tracefile);
 static void reinit_trace(trace_t *trace);
 static void free_trace(trace_t *trace);
 
+/* These functions walk the requests of a trace */
+static void cursor_init(const trace_t *trace, trace_cursor_t *cursor);
+static void cursor_rewind(const trace_t *trace, trace_cursor_t *cursor);
+static const traceop_t *cursor_next(trace_cursor_t *cursor);
+static void cursor_free(trace_cursor_t *cursor);
+
 /* Routines for evaluating the correctness and speed of libc malloc */
 static bool eval_libc_valid(trace_t *trace);
 static void eval_libc_speed(void *ptr);
@@ -260,6 +381,15 @@ static void eval_mm_speed(void *ptr);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats, sum_stats_t *sumstats);
+#if !REF_ONLY
+static void set_mm_option(const char *arg);
+static void print_counters(const char *filename);
+static void measure_prof_overhead(const char *filename, speed_t *speed_params,
+                                  double secs);
+#if MT_REPLAY
+static void eval_mm_threads(trace_t *trace);
+#endif
+#endif
 static void usage(char *prog);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
     __attribute__((format(printf, 3, 4)));
@@ -337,6 +467,12 @@ static void run_tests(int num_tracefiles, const char *tracedir,
             if (verbose > 1)
                 printf("efficiency, ");
             mm_stats[i].util = eval_mm_util(trace, i);
+            mm_stats[i].heap_peak = mem_heap_peak();
+            mm_stats[i].heap_end = mem_heapsize() + mem_mapsize();
+#if !REF_ONLY
+            if (show_counters)
+                print_counters(trace->filename);
+#endif
             speed_params->trace = trace;
             speed_params->ranges = ranges;
             if (verbose > 1)
@@ -344,6 +480,15 @@ static void run_tests(int num_tracefiles, const char *tracedir,
             mm_stats[i].secs =
                 sparse_mode ? 1.0 : fsec(eval_mm_speed, speed_params);
             mm_stats[i].tput = mm_stats[i].ops / (mm_stats[i].secs * 1000.0);
+#if !REF_ONLY
+            if (prof_rate > 0 && !sparse_mode)
+                measure_prof_overhead(trace->filename, speed_params,
+                                      mm_stats[i].secs);
+#endif
+#if MT_REPLAY
+            if (max_threads > 0 && !sparse_mode)
+                eval_mm_threads(trace);
+#endif
         }
 
 #if 0
@@ -388,7 +533,7 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hpCOVAlDT")) != EOF)
+    while ((c = getopt(argc, argv, "d:f:c:n:o:s:t:v:P:hpCOVAlDSTz")) != EOF)
     {
         switch (c)
         {
@@ -445,10 +590,37 @@ int main(int argc, char **argv)
             set_timeout = atoi(optarg);
             break;
 
+        case 'o': /* Set an allocator tuning parameter */
+            set_mm_option(optarg);
+            break;
+
+        case 'P': /* Measure the heap profiler's overhead */
+            prof_rate = atol(optarg);
+            break;
+
+        case 'n': /* Replay on up to n threads */
+#if MT_REPLAY
+            max_threads = atoi(optarg);
+            if (max_threads < 1)
+                app_error("-n expects a positive thread count\n");
+            break;
+#else
+            app_error("-n needs mdriver-mt, which links the thread-safe "
+                      "mm\n");
+#endif
+
+        case 'S': /* Print allocator event counters */
+            show_counters = true;
+            break;
+
         case 'T':
             tab_mode = true;
             break;
 
+        case 'z': /* Free with sizes */
+            sized_free = true;
+            break;
+
         case 'h': /* Print this message */
             usage(argv[0]);
             exit(0);
@@ -806,15 +978,28 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
         return false;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi()))
+    /* The payload must lie within the extent of the heap, or within a
+       mapping of its own */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+         (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+        !mem_in_mapping(lo, size))
     {
         malloc_error(trace, opnum, "Payload (%p:%p) lies outside heap (%p:%p)",
                      lo, hi, mem_heap_lo(), mem_heap_hi());
         return false;
     }
 
+#if !REF_ONLY
+    /* The allocator must count the whole request as usable */
+    if (mm_usable_size(lo) < size)
+    {
+        malloc_error(trace, opnum,
+                     "Payload (%p) has %zu usable bytes, %zu requested", lo,
+                     mm_usable_size(lo), size);
+        return false;
+    }
+#endif
+
     /* If we can't afford the linear-time loop, we check less thoroughly and
        just assume the overlap will be caught by writing random bits. */
     if (debug_mode == DBG_NONE)
@@ -1006,18 +1191,15 @@ static bool check_index(const trace_t *trace, int opnum, int index)
  *********************************************/
 
 /*
- * read_trace - read a trace file and store it in memory
+ * read_trace - read a trace file and store it in memory. Binary traces
+ *     (see tracefmt.h) are mapped instead, and decoded as they are replayed.
  */
 static trace_t *read_trace(stats_t *stats, const char *tracedir,
                            const char *filename)
 {
     FILE *tracefile;
     trace_t *trace;
-    char type[MAXLINE];
-    int index;
-    size_t size;
-    int max_index = 0;
-    int op_index;
+    char magic[TF_MAGIC_LEN];
     int ignore = 0;
 
     if (verbose > 1)
@@ -1034,23 +1216,32 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     {
         unix_error("Could not open %s in read_trace", trace->filename);
     }
-    int iweight;
-    ignore += fscanf(tracefile, "%d", &iweight);
-    trace->weight = iweight;
-    ignore += fscanf(tracefile, "%d", &trace->num_ids);
-    ignore += fscanf(tracefile, "%d", &trace->num_ops);
-    ignore += fscanf(tracefile, "%zd", &trace->data_bytes);
+    trace->ops = NULL;
+    trace->map = NULL;
+    trace->num_threads = 1;
+    if (fread(magic, 1, TF_MAGIC_LEN, tracefile) == TF_MAGIC_LEN &&
+        memcmp(magic, TF_MAGIC, TF_MAGIC_LEN) == 0)
+    {
+        map_trace(trace, tracefile);
+        fclose(tracefile);
+        tracefile = NULL;
+    }
+    else
+    {
+        rewind(tracefile);
+        int iweight;
+        ignore += fscanf(tracefile, "%d", &iweight);
+        trace->weight = iweight;
+        ignore += fscanf(tracefile, "%d", &trace->num_ids);
+        ignore += fscanf(tracefile, "%d", &trace->num_ops);
+        ignore += fscanf(tracefile, "%zd", &trace->data_bytes);
+    }
 
     if (trace->weight > 3)
     {
         app_error("%s: weight can only be in {0, 1, 2 3}", trace->filename);
     }
 
-    /* We'll store each request line in the trace in this array */
-    if ((trace->ops =
-             (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
-        unix_error("malloc 2 failed in read_trace");
-
     /* We'll keep an array of pointers to the allocated blocks here... */
     if ((trace->blocks = (char **)calloc(trace->num_ids, sizeof(char *))) ==
         NULL)
@@ -1066,6 +1257,39 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
              calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
         unix_error("malloc 5 failed in read_trace");
 
+    if (tracefile != NULL)
+    {
+        parse_trace(trace, tracefile);
+        fclose(tracefile);
+    }
+    cursor_init(trace, &trace->cursor);
+
+    /* fill in the stats */
+    strcpy(stats->filename, trace->filename);
+    stats->weight = trace->weight;
+    stats->ops = trace->num_ops;
+
+    return trace;
+}
+
+/*
+ * parse_trace - Read the request lines of a text trace into trace->ops
+ */
+static void parse_trace(trace_t *trace, FILE *tracefile)
+{
+    char type[MAXLINE];
+    int index;
+    size_t size, align;
+    int max_index = 0;
+    int op_index;
+    int thread = 0;
+    int ignore = 0;
+
+    /* We'll store each request line in the trace in this array */
+    if ((trace->ops =
+             (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
+        unix_error("malloc 2 failed in read_trace");
+
     /* read every request line in the trace file */
     index = 0;
     op_index = 0;
@@ -1073,6 +1297,13 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     {
         switch (type[0])
         {
+        case 't': /* the requests that follow are made by another thread */
+            ignore += fscanf(tracefile, "%d", &thread);
+            if (thread < 0)
+                app_error("%s: bad thread number %d", trace->filename, thread);
+            if (thread >= trace->num_threads)
+                trace->num_threads = thread + 1;
+            continue;
         case 'a':
             ignore += fscanf(tracefile, "%u %lu", &index, &size);
             trace->ops[op_index].type = ALLOC;
@@ -1092,24 +1323,57 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
             trace->ops[op_index].type = FREE;
             trace->ops[op_index].index = index;
             break;
+        case 'm':
+            ignore += fscanf(tracefile, "%u %lu %lu", &index, &size, &align);
+            if (align == 0 || (align & (align - 1)) != 0)
+            {
+                app_error("%s: alignment %lu is not a power of two",
+                          trace->filename, align);
+            }
+            trace->ops[op_index].type = MEMALIGN;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].size = size;
+            trace->ops[op_index].align = align;
+            max_index = (index > max_index) ? index : max_index;
+            break;
         default:
             app_error("Bogus type character (%c) in tracefile %s\n", type[0],
                       trace->filename);
         }
+        trace->ops[op_index].thread = thread;
         op_index++;
         if (op_index == trace->num_ops)
             break;
     }
-    fclose(tracefile);
     assert(max_index == trace->num_ids - 1);
     assert(trace->num_ops == op_index);
+}
 
-    /* fill in the stats */
-    strcpy(stats->filename, trace->filename);
-    stats->weight = trace->weight;
-    stats->ops = trace->num_ops;
-
-    return trace;
+/*
+ * map_trace - Map a binary trace and take its header. Its requests stay in
+ *     the file, and are decoded by the trace's cursors.
+ */
+static void map_trace(trace_t *trace, FILE *tracefile)
+{
+    struct stat st;
+    const tf_header_t *header;
+
+    if (fstat(fileno(tracefile), &st) < 0)
+        unix_error("Could not stat %s in read_trace", trace->filename);
+    trace->map_len = (size_t)st.st_size;
+    trace->map = mmap(NULL, trace->map_len, PROT_READ, MAP_PRIVATE,
+                      fileno(tracefile), 0);
+    if (trace->map == MAP_FAILED)
+        unix_error("Could not map %s in read_trace", trace->filename);
+
+    if ((header = tf_check(trace->map, trace->map_len)) == NULL)
+        app_error("%s: bad binary trace header\n", trace->filename);
+    trace->weight = header->weight;
+    trace->num_ids = (int)header->num_ids;
+    trace->num_ops = (int)header->num_ops;
+    trace->data_bytes = header->data_bytes;
+    if (header->num_threads > 1)
+        trace->num_threads = (int)header->num_threads;
 }
 
 /*
@@ -1120,6 +1384,7 @@ static void reinit_trace(trace_t *trace)
     memset(trace->blocks, 0, trace->num_ids * sizeof(*trace->blocks));
     memset(trace->block_sizes, 0, trace->num_ids * sizeof(*trace->block_sizes));
     /* block_rand_base is unused if size is zero */
+    cursor_rewind(trace, &trace->cursor);
 }
 
 /*
@@ -1132,14 +1397,105 @@ static void free_trace(trace_t *trace)
     free(trace->blocks);
     free(trace->block_sizes);
     free(trace->block_rand_base);
+    cursor_free(&trace->cursor);
+    if (trace->map != NULL)
+        munmap(trace->map, trace->map_len);
     free(trace); /* and the trace record itself... */
 }
 
+/*
+ * cursor_init - Start a cursor at the first request of the trace
+ */
+static void cursor_init(const trace_t *trace, trace_cursor_t *cursor)
+{
+    memset(cursor, 0, sizeof(*cursor));
+    cursor->filename = trace->filename;
+    cursor->num_ids = trace->num_ids;
+    cursor->next = trace->ops;
+    if (trace->map != NULL)
+        tf_reader_init(&cursor->reader, trace->map, trace->map_len);
+}
+
+/*
+ * cursor_rewind - Take the cursor back to the first request
+ */
+static void cursor_rewind(const trace_t *trace, trace_cursor_t *cursor)
+{
+    cursor->next = trace->ops;
+    if (trace->map != NULL)
+        tf_reader_rewind(&cursor->reader);
+}
+
+/*
+ * cursor_next - Return the next request. Text traces are walked in place;
+ *     binary ones are decoded into the cursor, one request at a time.
+ */
+static const traceop_t *cursor_next(trace_cursor_t *cursor)
+{
+    tf_op_t op;
+
+    if (cursor->next != NULL)
+        return cursor->next++;
+
+    if (!tf_read_op(&cursor->reader, &op) || op.index >= cursor->num_ids)
+        app_error("%s: corrupt binary trace\n", cursor->filename);
+#ifdef USE_MSAN
+    /* tracefmt.o is not instrumented, so MemorySanitizer missed the writes */
+    __msan_unpoison(&op, sizeof(op));
+#endif
+    cursor->op.type = op.type;
+    cursor->op.index = op.index;
+    cursor->op.size = op.size;
+    cursor->op.align = op.align;
+    cursor->op.thread = op.thread;
+    return &cursor->op;
+}
+
+/*
+ * cursor_free - Free the cursor's decoding buffer, if it has one
+ */
+static void cursor_free(trace_cursor_t *cursor)
+{
+    tf_reader_free(&cursor->reader);
+}
+
 /**********************************************************************
  * The following functions evaluate the correctness, space utilization,
  * and throughput of the libc and mm malloc packages.
  **********************************************************************/
 
+/*
+ * call_mm_memalign - Call the student's mm_memalign. The reference
+ *     allocators have none, so the reference driver cannot run "m" requests.
+ */
+static void *call_mm_memalign(size_t align, size_t size)
+{
+#if REF_ONLY
+    (void)align;
+    (void)size;
+    app_error("mm_memalign is not supported by the reference driver");
+#else
+    return mm_memalign(align, size);
+#endif
+}
+
+/*
+ * call_mm_free - Call the student's mm_free, or mm_free_sized with the
+ *     block's size if -z was given
+ */
+static void call_mm_free(char *p, size_t size)
+{
+#if !REF_ONLY
+    if (sized_free && p != NULL)
+    {
+        mm_free_sized(p, size);
+        return;
+    }
+#endif
+    (void)size;
+    mm_free(p);
+}
+
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
@@ -1167,8 +1523,9 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
     /* Interpret each operation in the trace in order */
     for (i = 0; i < trace->num_ops; i++)
     {
-        index = trace->ops[i].index;
-        size = trace->ops[i].size;
+        const traceop_t *op = cursor_next(&trace->cursor);
+        index = op->index;
+        size = op->size;
 
         if (debug_mode == DBG_EXPENSIVE)
         {
@@ -1193,15 +1550,31 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
             }
         }
 
-        switch (trace->ops[i].type)
+        switch (op->type)
         {
 
-        case ALLOC: /* mm_malloc */
+        case ALLOC:    /* mm_malloc */
+        case MEMALIGN: /* mm_memalign */
 
             /* Call the student's malloc */
-            if ((p = mm_malloc(size)) == NULL)
+            if (op->type == ALLOC)
             {
-                malloc_error(trace, i, "mm_malloc failed.");
+                if ((p = mm_malloc(size)) == NULL)
+                {
+                    malloc_error(trace, i, "mm_malloc failed.");
+                    return false;
+                }
+            }
+            else if ((p = call_mm_memalign(op->align, size)) == NULL)
+            {
+                malloc_error(trace, i, "mm_memalign failed.");
+                return false;
+            }
+            else if ((uintptr_t)p % op->align != 0)
+            {
+                malloc_error(trace, i,
+                             "Payload address (%p) not aligned to %zu bytes",
+                             p, op->align);
                 return false;
             }
 
@@ -1285,13 +1658,15 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
             if (index == -1)
             {
                 p = 0;
+                size = 0;
             }
             else
             {
                 p = trace->blocks[index];
+                size = trace->block_sizes[index];
                 remove_range(ranges, p);
             }
-            mm_free(p);
+            call_mm_free(p, size);
             break;
 
         default:
@@ -1307,10 +1682,9 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   peak size of the heap in bytes while running the student's malloc
+ *   package on the trace. The package may give memory back by
+ *   decrementing the brk pointer, so the final brk is not used.
  *
  *   A higher number is better: 1 is optimal.
  */
@@ -1333,12 +1707,13 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 
     for (i = 0; i < trace->num_ops; i++)
     {
-        switch (trace->ops[i].type)
+        const traceop_t *op = cursor_next(&trace->cursor);
+        switch (op->type)
         {
 
         case ALLOC: /* mm_alloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
+            index = op->index;
+            size = op->size;
 
             if ((p = mm_malloc(size)) == NULL)
             {
@@ -1353,9 +1728,26 @@ static double eval_mm_util(trace_t *trace, int tracenum)
             total_size += size;
             break;
 
+        case MEMALIGN: /* mm_memalign */
+            index = op->index;
+            size = op->size;
+
+            if ((p = call_mm_memalign(op->align, size)) == NULL)
+            {
+                app_error("trace %d: mm_memalign failed in eval_mm_util",
+                          tracenum);
+            }
+
+            /* Remember region and size */
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+
+            total_size += size;
+            break;
+
         case REALLOC: /* mm_realloc */
-            index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
+            index = op->index;
+            newsize = op->size;
             oldsize = trace->block_sizes[index];
 
             oldp = trace->blocks[index];
@@ -1375,7 +1767,7 @@ static double eval_mm_util(trace_t *trace, int tracenum)
             break;
 
         case FREE: /* mm_free */
-            index = trace->ops[i].index;
+            index = op->index;
             if (index < 0)
             {
                 size = 0;
@@ -1387,7 +1779,7 @@ static double eval_mm_util(trace_t *trace, int tracenum)
                 p = trace->blocks[index];
             }
 
-            mm_free(p);
+            call_mm_free(p, size);
 
             total_size -= size;
             break;
@@ -1406,7 +1798,7 @@ static double eval_mm_util(trace_t *trace, int tracenum)
     printf(".");
 #endif
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    return ((double)max_total_size / (double)mem_heap_peak());
 }
 
 /*
@@ -1428,44 +1820,60 @@ static void eval_mm_speed(void *ptr)
 
     /* Interpret each trace request */
     for (i = 0; i < trace->num_ops; i++)
-        switch (trace->ops[i].type)
+    {
+        const traceop_t *op = cursor_next(&trace->cursor);
+        switch (op->type)
         {
 
         case ALLOC: /* mm_malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
+            index = op->index;
+            size = op->size;
             if ((p = mm_malloc(size)) == NULL)
                 app_error("mm_malloc error in eval_mm_speed");
             trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+            break;
+
+        case MEMALIGN: /* mm_memalign */
+            index = op->index;
+            size = op->size;
+            if ((p = call_mm_memalign(op->align, size)) == NULL)
+                app_error("mm_memalign error in eval_mm_speed");
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
             break;
 
         case REALLOC: /* mm_realloc */
-            index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
+            index = op->index;
+            newsize = op->size;
             oldp = trace->blocks[index];
             setUBCheck(false);
             if ((newp = mm_realloc(oldp, newsize)) == NULL && newsize != 0)
                 app_error("mm_realloc error in eval_mm_speed");
             setUBCheck(true);
             trace->blocks[index] = newp;
+            trace->block_sizes[index] = newsize;
             break;
 
         case FREE: /* mm_free */
-            index = trace->ops[i].index;
+            index = op->index;
             if (index < 0)
             {
                 block = 0;
+                size = 0;
             }
             else
             {
                 block = trace->blocks[index];
+                size = trace->block_sizes[index];
             }
-            mm_free(block);
+            call_mm_free(block, size);
             break;
 
         default:
             app_error("Nonexistent request type in eval_mm_speed");
         }
+    }
 }
 
 /*
@@ -1484,33 +1892,44 @@ static bool eval_libc_valid(trace_t *trace)
 
     for (i = 0; i < trace->num_ops; i++)
     {
-        switch (trace->ops[i].type)
+        const traceop_t *op = cursor_next(&trace->cursor);
+        switch (op->type)
         {
 
         case ALLOC: /* malloc */
-            if ((p = malloc(trace->ops[i].size)) == NULL)
+            if ((p = malloc(op->size)) == NULL)
             {
                 malloc_error(trace, i, "libc malloc failed");
                 unix_error("System message");
             }
-            trace->blocks[trace->ops[i].index] = p;
+            trace->blocks[op->index] = p;
+            break;
+
+        case MEMALIGN: /* aligned_alloc */
+            if ((p = aligned_alloc(op->align,
+                                   op->size)) == NULL)
+            {
+                malloc_error(trace, i, "libc aligned_alloc failed");
+                unix_error("System message");
+            }
+            trace->blocks[op->index] = p;
             break;
 
         case REALLOC: /* realloc */
-            newsize = trace->ops[i].size;
-            oldp = trace->blocks[trace->ops[i].index];
+            newsize = op->size;
+            oldp = trace->blocks[op->index];
             if ((newp = realloc(oldp, newsize)) == NULL && newsize != 0)
             {
                 malloc_error(trace, i, "libc realloc failed");
                 unix_error("System message");
             }
-            trace->blocks[trace->ops[i].index] = newp;
+            trace->blocks[op->index] = newp;
             break;
 
         case FREE: /* free */
-            if (trace->ops[i].index >= 0)
+            if (op->index >= 0)
             {
-                free(trace->blocks[trace->ops[i].index]);
+                free(trace->blocks[op->index]);
             }
             else
             {
@@ -1543,19 +1962,28 @@ static void eval_libc_speed(void *ptr)
 
     for (i = 0; i < trace->num_ops; i++)
     {
-        switch (trace->ops[i].type)
+        const traceop_t *op = cursor_next(&trace->cursor);
+        switch (op->type)
         {
         case ALLOC: /* malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
+            index = op->index;
+            size = op->size;
             if ((p = malloc(size)) == NULL)
                 unix_error("malloc failed in eval_libc_speed");
             trace->blocks[index] = p;
             break;
 
+        case MEMALIGN: /* aligned_alloc */
+            index = op->index;
+            size = op->size;
+            if ((p = aligned_alloc(op->align, size)) == NULL)
+                unix_error("aligned_alloc failed in eval_libc_speed");
+            trace->blocks[index] = p;
+            break;
+
         case REALLOC: /* realloc */
-            index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
+            index = op->index;
+            newsize = op->size;
             oldp = trace->blocks[index];
             if ((newp = realloc(oldp, newsize)) == NULL && newsize != 0)
                 unix_error("realloc failed in eval_libc_speed\n");
@@ -1564,7 +1992,7 @@ static void eval_libc_speed(void *ptr)
             break;
 
         case FREE: /* free */
-            index = trace->ops[i].index;
+            index = op->index;
             if (index >= 0)
             {
                 block = trace->blocks[index];
@@ -1605,12 +2033,13 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
     /* Print the individual results for each trace */
     if (tab_mode)
     {
-        printf("valid\tthru?\tutil?\tutil\tops\tmsecs\tKops/s\ttrace\n");
+        printf("valid\tthru?\tutil?\tutil\tops\tmsecs\tKops/s\tpeakKB\t"
+               "endKB\ttrace\n");
     }
     else
     {
-        printf("  %5s  %6s %7s%8s%8s  %s\n", "valid", "util", "ops", "msecs",
-               "Kops/s", "trace");
+        printf("  %5s  %6s %7s%8s%8s%8s%7s  %s\n", "valid", "util", "ops",
+               "msecs", "Kops/s", "peakKB", "endKB", "trace");
     }
     for (i = 0; i < n; i++)
     {
@@ -1683,6 +2112,22 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
                     printf("%8s%10s%7s ", "--", "--", "--");
             }
 
+            /* Peak and final heap size */
+            if (tab_mode)
+            {
+                printf("%zu\t%zu\t", stats[i].heap_peak / 1024,
+                       stats[i].heap_end / 1024);
+            }
+            else if (stats[i].heap_peak == 0)
+            {
+                printf("%7s%7s ", "--", "--");
+            }
+            else
+            {
+                printf("%7zu%7zu ", stats[i].heap_peak / 1024,
+                       stats[i].heap_end / 1024);
+            }
+
             printf("%s\n", stats[i].filename);
 
             if (stats[i].weight == WALL || stats[i].weight == WPERF)
@@ -1702,13 +2147,13 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
         {
             if (tab_mode)
             {
-                printf("no\t\t\t\t\t\t\t%s\n", stats[i].filename);
+                printf("no\t\t\t\t\t\t\t\t\t%s\n", stats[i].filename);
             }
             else
             {
-                printf("%2s%4s%7s%10s%7s%10s %s\n",
+                printf("%2s%4s%7s%10s%7s%10s%7s%7s %s\n",
                        stats[i].weight != 0 ? "*" : "", "no", "-", "-", "-",
-                       "-", stats[i].filename);
+                       "-", "-", "-", stats[i].filename);
             }
         }
     }
@@ -1761,6 +2206,360 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
     }
 }
 
+#if !REF_ONLY
+/*
+ * set_mm_option - Parse a "name=value" argument of -o and pass it on to
+ *     mm_mallopt
+ */
+static void set_mm_option(const char *arg)
+{
+    const char *eq = strchr(arg, '=');
+    int i;
+
+    if (eq == NULL)
+        app_error("-o expects <name>=<value>, got '%s'\n", arg);
+
+    for (i = 0; mm_options[i].name != NULL; i++)
+    {
+        if (strlen(mm_options[i].name) == (size_t)(eq - arg) &&
+            strncmp(mm_options[i].name, arg, eq - arg) == 0)
+            break;
+    }
+    if (mm_options[i].name == NULL)
+        app_error("Unknown allocator option '%.*s'\n", (int)(eq - arg), arg);
+
+    if (!mm_mallopt(mm_options[i].param, strtol(eq + 1, NULL, 0)))
+        app_error("Bad value for allocator option '%s'\n", arg);
+}
+
+/*
+ * print_counters - Print the allocator's event counters and heap snapshot
+ *     for the last run
+ */
+static void print_counters(const char *filename)
+{
+    mm_counters_t counters;
+    mm_stats_t stats;
+    int i;
+
+    mm_get_counters(&counters);
+    printf("\nCounters for %s:\n", filename);
+    for (i = 0; mm_counter_fields[i].name != NULL; i++)
+    {
+        size_t value =
+            *(size_t *)((char *)&counters + mm_counter_fields[i].offset);
+        printf("  %-24s %zu\n", mm_counter_fields[i].name, value);
+    }
+
+    mm_get_stats(&stats);
+    printf("Heap after %s:\n", filename);
+    printf("  %-24s %zu\n", "heap_bytes", stats.heap_bytes);
+    printf("  %-24s %zu\n", "allocated_bytes", stats.allocated_bytes);
+    printf("  %-24s %zu\n", "allocated_blocks", stats.allocated_blocks);
+    printf("  %-24s %zu\n", "free_bytes", stats.free_bytes);
+    printf("  %-24s %zu\n", "largest_free", stats.largest_free);
+    printf("  %-24s %zu\n", "sbrk_calls", stats.sbrk_calls);
+    printf("  %-24s %.3f\n", "fragmentation", stats.fragmentation);
+    printf("  free_blocks by class   ");
+    for (i = 0; i < MM_STATS_CLASSES; i++)
+        printf(" %zu", stats.free_blocks[i]);
+    printf("\n");
+}
+
+/*
+ * measure_prof_overhead - Time the last trace again with the heap profiler
+ *     sampling, report the slowdown and print the profile of the last run
+ */
+static void measure_prof_overhead(const char *filename, speed_t *speed_params,
+                                  double secs)
+{
+    double prof_secs;
+
+    if (!mm_mallopt(MM_OPT_PROF_RATE, prof_rate))
+        app_error("Cannot sample every %ld bytes\n", prof_rate);
+    prof_secs = fsec(eval_mm_speed, speed_params);
+
+    printf("\nProfiler overhead for %s at 1 sample per %ld bytes: %.1f%%\n",
+           filename, prof_rate, 100.0 * (prof_secs - secs) / secs);
+    mm_prof_dump(stdout);
+    mm_mallopt(MM_OPT_PROF_RATE, 0);
+}
+
+#if MT_REPLAY
+/* Replays per thread count, of which the fastest is reported */
+#define REPLAY_RUNS 3
+
+/* One thread of a multithreaded replay */
+typedef struct
+{
+    trace_t *trace;
+    int id;              /* replays trace threads t with t % nthreads == id */
+    int nthreads;        /* number of replay threads */
+    bool copy;           /* replay the whole trace into blocks of its own */
+    char **blocks;       /* block pointers and sizes, shared unless copy */
+    size_t *block_sizes;
+    long ops;            /* number of requests replayed */
+    double start;        /* time it left the start barrier */
+    double stop;         /* time it was done with its last request */
+} replay_t;
+
+/* Line up the start and the end of the replay threads */
+static pthread_barrier_t replay_start;
+static pthread_barrier_t replay_stop;
+
+/* For each request: the trace thread of the previous request on the same
+   block (or -1), and how many requests on that block come before it */
+static int *replay_after;
+static int *replay_seq;
+
+/* For each block: how many requests on it have been replayed */
+static int *replay_done;
+
+/* Set when a request fails, which stops every replay thread */
+static bool replay_failed;
+
+/*
+ * replay_now - Read the time in seconds
+ */
+static double replay_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * replay_thread - Replay this thread's share of the trace between the two
+ *     barriers. A request on a block last used by another replay thread
+ *     first waits for that thread to get done with it.
+ */
+static void *replay_thread(void *arg)
+{
+    replay_t *r = (replay_t *)arg;
+    trace_t *trace = r->trace;
+    trace_cursor_t cursor;
+    int i, index, after;
+    char *p;
+
+    r->ops = 0;
+    cursor_init(trace, &cursor);
+    pthread_barrier_wait(&replay_start);
+    r->start = replay_now();
+
+    for (i = 0; i < trace->num_ops; i++)
+    {
+        const traceop_t *op = cursor_next(&cursor);
+        if (!r->copy && op->thread % r->nthreads != r->id)
+            continue;
+        index = op->index;
+        after = r->copy || index < 0 ? -1 : replay_after[i];
+        if (after >= 0 && after % r->nthreads != r->id)
+        {
+            while (__atomic_load_n(&replay_done[index], __ATOMIC_ACQUIRE) <
+                       replay_seq[i] &&
+                   !__atomic_load_n(&replay_failed, __ATOMIC_RELAXED))
+                sched_yield();
+        }
+        if (__atomic_load_n(&replay_failed, __ATOMIC_RELAXED))
+            break;
+
+        p = NULL;
+        switch (op->type)
+        {
+        case ALLOC:
+            p = mm_malloc(op->size);
+            break;
+        case MEMALIGN:
+            p = call_mm_memalign(op->align, op->size);
+            break;
+        case REALLOC:
+            p = mm_realloc(r->blocks[index], op->size);
+            break;
+        case FREE:
+            if (index < 0)
+                call_mm_free(NULL, 0);
+            else
+                call_mm_free(r->blocks[index], r->block_sizes[index]);
+            break;
+        }
+        if (op->type != FREE)
+        {
+            if (p == NULL && (op->type != REALLOC || op->size != 0))
+            {
+                __atomic_store_n(&replay_failed, true, __ATOMIC_RELAXED);
+                break;
+            }
+            r->blocks[index] = p;
+            r->block_sizes[index] = op->size;
+        }
+        if (!r->copy && index >= 0)
+            __atomic_store_n(&replay_done[index], replay_seq[i] + 1,
+                             __ATOMIC_RELEASE);
+        r->ops++;
+    }
+
+    r->stop = replay_now();
+    pthread_barrier_wait(&replay_stop);
+    cursor_free(&cursor);
+    return NULL;
+}
+
+/*
+ * eval_mm_threads - Replay the trace on 1, 2, 4 ... max_threads threads
+ *     and print the throughput of each run and of each of its threads.
+ *     Trace thread t is replayed by thread t mod n; a trace without "t"
+ *     lines is replayed in full by every thread, each on blocks of its own.
+ */
+static void eval_mm_threads(trace_t *trace)
+{
+    bool copy = trace->num_threads == 1;
+    replay_t *replay, *best;
+    pthread_t *tids;
+    trace_cursor_t cursor;
+    int *last;
+    int i, n, run, cross = 0;
+
+    replay = calloc(max_threads, sizeof(replay_t));
+    best = calloc(max_threads, sizeof(replay_t));
+    tids = calloc(max_threads, sizeof(pthread_t));
+    replay_after = malloc(trace->num_ops * sizeof(int));
+    replay_seq = malloc(trace->num_ops * sizeof(int));
+    replay_done = calloc(trace->num_ids, sizeof(int));
+    last = malloc(trace->num_ids * sizeof(int));
+    if (replay == NULL || best == NULL || tids == NULL ||
+        replay_after == NULL || replay_seq == NULL || replay_done == NULL ||
+        last == NULL)
+        unix_error("malloc failed in eval_mm_threads");
+
+    /* Chain the requests on each block, counting handovers between trace
+       threads; replay_done counts the requests on each block so far */
+    for (i = 0; i < trace->num_ids; i++)
+        last[i] = -1;
+    cursor_init(trace, &cursor);
+    for (i = 0; i < trace->num_ops; i++)
+    {
+        const traceop_t *op = cursor_next(&cursor);
+        int index = op->index;
+        replay_after[i] = index < 0 ? -1 : last[index];
+        replay_seq[i] = index < 0 ? 0 : replay_done[index]++;
+        if (replay_after[i] >= 0 && replay_after[i] != op->thread)
+            cross++;
+        if (index >= 0)
+            last[index] = op->thread;
+    }
+    cursor_free(&cursor);
+
+    for (i = 0; i < max_threads; i++)
+    {
+        replay[i].trace = trace;
+        replay[i].id = i;
+        replay[i].copy = copy;
+        replay[i].blocks = trace->blocks;
+        replay[i].block_sizes = trace->block_sizes;
+        if (copy && i > 0)
+        {
+            replay[i].blocks = calloc(trace->num_ids, sizeof(char *));
+            replay[i].block_sizes = calloc(trace->num_ids, sizeof(size_t));
+            if (replay[i].blocks == NULL || replay[i].block_sizes == NULL)
+                unix_error("malloc failed in eval_mm_threads");
+        }
+    }
+
+    if (copy)
+        printf("\nThread scaling for %s (a copy of the trace per thread):\n",
+               trace->filename);
+    else
+        printf("\nThread scaling for %s (%d trace threads, %d requests on "
+               "blocks of another thread):\n",
+               trace->filename, trace->num_threads, cross);
+    printf("%8s%10s%9s  %s\n", "threads", "Kops/s", "speedup",
+           "Kops/s per thread");
+
+    double base = 0;
+    for (n = 1; n <= max_threads;
+         n = (n < max_threads && 2 * n > max_threads) ? max_threads : 2 * n)
+    {
+        double best_secs = DBL_MAX;
+
+        for (run = 0; run < REPLAY_RUNS && !replay_failed; run++)
+        {
+            double start = DBL_MAX, stop = 0;
+
+            reinit_trace(trace);
+            memset(replay_done, 0, trace->num_ids * sizeof(int));
+            mem_reset_brk();
+            if (!mm_init())
+                app_error("mm_init failed in eval_mm_threads");
+
+            pthread_barrier_init(&replay_start, NULL, n + 1);
+            pthread_barrier_init(&replay_stop, NULL, n + 1);
+            for (i = 0; i < n; i++)
+            {
+                replay[i].nthreads = n;
+                if (pthread_create(&tids[i], NULL, replay_thread,
+                                   &replay[i]) != 0)
+                    unix_error("pthread_create failed in eval_mm_threads");
+            }
+            pthread_barrier_wait(&replay_start);
+            pthread_barrier_wait(&replay_stop);
+            for (i = 0; i < n; i++)
+            {
+                pthread_join(tids[i], NULL);
+                start = replay[i].start < start ? replay[i].start : start;
+                stop = replay[i].stop > stop ? replay[i].stop : stop;
+            }
+            pthread_barrier_destroy(&replay_start);
+            pthread_barrier_destroy(&replay_stop);
+
+            /* The run lasts from the first thread's start to the last
+               thread's end */
+            if (stop - start < best_secs)
+            {
+                best_secs = stop - start;
+                memcpy(best, replay, n * sizeof(replay_t));
+            }
+        }
+        if (replay_failed)
+        {
+            printf("%8d  out of memory\n", n);
+            break;
+        }
+
+        long ops = 0;
+        for (i = 0; i < n; i++)
+            ops += best[i].ops;
+        double tput = ops / (best_secs * 1000.0);
+        if (n == 1)
+            base = tput;
+        printf("%8d%10.0f%9.2f ", n, tput, tput / base);
+        for (i = 0; i < n; i++)
+        {
+            if (best[i].ops == 0)
+                printf(" -");
+            else
+                printf(" %.0f", best[i].ops /
+                                    ((best[i].stop - best[i].start) * 1000.0));
+        }
+        printf("\n");
+    }
+
+    replay_failed = false;
+    for (i = 1; copy && i < max_threads; i++)
+    {
+        free(replay[i].blocks);
+        free(replay[i].block_sizes);
+    }
+    free(replay);
+    free(best);
+    free(tids);
+    free(replay_after);
+    free(replay_seq);
+    free(replay_done);
+    free(last);
+}
+#endif
+#endif
+
 /*
  * app_error - Report an arbitrary application error
  */
@@ -2013,7 +2812,10 @@ static double measure_ref_throughput(bool checkpoint)
  */
 static void usage(char *prog)
 {
-    fprintf(stderr, "Usage: %s [-hlVCdD] [-f <file>]\n", prog);
+    fprintf(stderr,
+            "Usage: %s [-hlVCdDSz] [-o <name>=<value>] [-P <n>] [-n <n>] "
+            "[-f <file>]\n",
+            prog);
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-C         Calculate Checkpoint Score.\n");
     fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
@@ -2025,7 +2827,13 @@ static void usage(char *prog)
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
     fprintf(stderr, "\t-V         Print diagnostics as each trace is run.\n");
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
+    fprintf(stderr, "\t-n <n>     Replay traces on 1, 2, 4 ... <n> threads "
+                    "(mdriver-mt).\n");
+    fprintf(stderr, "\t-o <n>=<v> Set allocator tuning parameter <n> to <v>.\n");
+    fprintf(stderr, "\t-P <n>     Time traces again sampling every <n> bytes.\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
+    fprintf(stderr, "\t-S         Print allocator counters and heap stats per trace.\n");
     fprintf(stderr, "\t-T         Print diagnostics in tab mode\n");
+    fprintf(stderr, "\t-z         Free blocks with mm_free_sized.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file\n");
 }
@@ -5,8 +5,12 @@
  * This file allows compiling student malloc implementations so that they can
  * be used as an interpositioning library, and thereby run actual programs.
  */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for mremap */
+#endif
 #include <assert.h>
 #include <stdint.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "config.h"
@@ -16,10 +20,11 @@
 static bool init = false;
 static unsigned char *heap;         /* Starting address of heap */
 static unsigned char *mem_brk;      /* Current position of break */
+static unsigned char *mem_max_brk;  /* Highest position of break */
 
 static void ensure_init(void) {
     if (!init) {
-        mem_brk = heap = sbrk(0);
+        mem_brk = mem_max_brk = heap = sbrk(0);
         assert(mem_brk != (void *)-1);
         init = true;
     }
@@ -35,6 +40,9 @@ void *mem_sbrk(intptr_t incr) {
 
     assert(res == mem_brk);
     mem_brk += incr;
+    if (mem_brk > mem_max_brk) {
+        mem_max_brk = mem_brk;
+    }
     return (void *) res;
 }
 
@@ -53,6 +61,26 @@ size_t mem_heapsize(void) {
     return (size_t)(mem_brk - heap);
 }
 
+size_t mem_heap_peak(void) {
+    ensure_init();
+    return (size_t)(mem_max_brk - heap);
+}
+
+void *mem_mmap(size_t len) {
+    void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return addr == MAP_FAILED ? NULL : addr;
+}
+
+int mem_munmap(void *addr, size_t len) {
+    return munmap(addr, len);
+}
+
+void *mem_mremap(void *addr, size_t old_len, size_t new_len) {
+    void *new_addr = mremap(addr, old_len, new_len, MREMAP_MAYMOVE);
+    return new_addr == MAP_FAILED ? NULL : new_addr;
+}
+
 size_t mem_pagesize(void) {
     return (size_t)getpagesize();
 }
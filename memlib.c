@@ -32,6 +32,9 @@
  *  sparse emulation has tighter checks.  Commonly, the CPU reports a
  *  BUS ERROR on these accesses, and should be debugged as segmentation faults.
  */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for mremap */
+#endif
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -63,11 +66,23 @@ typedef struct MBLK
     unsigned char bytes[SPARSE_PAGE_SIZE]; /* Page contents */
 } mem_block_t;
 
+/* Mapping handed out by mem_mmap */
+typedef struct MMAP
+{
+    unsigned char *start; /* First byte of the mapping */
+    size_t length;        /* Length of the mapping, in whole pages */
+    struct MMAP *next;    /* Link in the list of live mappings */
+} mem_map_t;
+
 /* private global variables */
 static bool sparse = false;         /* Use sparse memory emulation */
 static unsigned char *heap;         /* Starting address of heap */
 static unsigned char *mem_brk;      /* Current position of break */
+static unsigned char *mem_max_brk;  /* Highest break since the last reset */
 static unsigned char *mem_max_addr; /* Maximum allowable heap address */
+static mem_map_t *mappings = NULL;  /* Live mappings made by mem_mmap */
+static size_t mem_mapped = 0;       /* Total length of the live mappings */
+static size_t mem_peak = 0;         /* Peak heap plus mapped size */
 static size_t mmap_length =
     MAX_DENSE_HEAP; /* Number of bytes allocated by mmap */
 static bool show_stats =
@@ -113,6 +128,10 @@ const char *__msan_default_options()
 static size_t page_id(const void *addr);
 static void *page_start(size_t id);
 static void *get_mem(const void *addr, size_t, bool);
+static void clear_mem(unsigned char *lo, unsigned char *hi);
+static mem_map_t **find_mapping(const void *addr);
+static void unmap_all(void);
+static void update_peak(void);
 static void print_stats();
 
 /*
@@ -172,7 +191,8 @@ void mem_init(bool do_sparse)
         mem_max_addr = heap + MAX_DENSE_HEAP;
     }
     stats_printed = false;
-    mem_brk = heap;
+    mem_brk = mem_max_brk = heap;
+    mem_peak = 0;
 }
 
 /*
@@ -181,6 +201,7 @@ void mem_init(bool do_sparse)
 void mem_deinit(void)
 {
     print_stats();
+    unmap_all();
     munmap(heap, mmap_length);
     next_free_page = NULL;
     num_free_pages = 0;
@@ -205,6 +226,9 @@ void mem_reset_brk()
     }
     else
     {
+        /* Memory handed out by mem_sbrk must read as zero, like fresh
+         * pages from the kernel */
+        memset(heap, 0, (size_t)(mem_max_brk - heap));
 #ifdef USE_ASAN
         /* Mark the entire heap as unaddressable */
         __asan_poison_memory_region(heap, MAX_DENSE_HEAP);
@@ -217,26 +241,29 @@ void mem_reset_brk()
         __msan_allocated_memory(heap, MAX_DENSE_HEAP);
 #endif
     }
-    mem_brk = heap;
+    unmap_all();
+    mem_brk = mem_max_brk = heap;
+    mem_peak = 0;
 }
 
 /*
  * mem_sbrk - simple model of the sbrk function. Extends the heap
  *                by incr bytes and returns the start address of the new area.
- * In this model, the heap cannot be shrunk.
+ * A negative incr shrinks the heap; the bytes given back are cleared, so
+ *  that they read as zero when the heap grows over them again.
  */
 void *mem_sbrk(intptr_t incr)
 {
     unsigned char *old_brk = mem_brk;
 
     bool ok = true;
-    if (incr < 0)
+    if (incr < 0 && (size_t)(mem_brk - heap) < (size_t)-incr)
     {
         ok = false;
         fprintf(stderr,
-                "ERROR: mem_sbrk failed.  Attempt to expand heap by negative "
-                "value %ld\n",
-                (long)incr);
+                "ERROR: mem_sbrk failed.  Attempt to shrink heap of %zu bytes "
+                "by %ld bytes\n",
+                (size_t)(mem_brk - heap), -(long)incr);
     }
     else if (mem_brk + incr > mem_max_addr)
     {
@@ -247,8 +274,10 @@ void *mem_sbrk(intptr_t incr)
                 "heap size of %zd (0x%zx) bytes\n",
                 alloc, alloc);
     }
-    else if (!sparse && sbrk(incr) == (void *)-1)
+    else if (!sparse && mem_brk + incr > mem_max_brk &&
+             sbrk(mem_brk + incr - mem_max_brk) == (void *)-1)
     {
+        /* The process break follows the high water mark of the heap */
         ok = false;
         fprintf(
             stderr,
@@ -257,11 +286,25 @@ void *mem_sbrk(intptr_t incr)
 
     if (ok)
     {
+        if (incr < 0)
+        {
+            clear_mem(mem_brk + incr, mem_brk);
+#ifdef USE_ASAN
+            /* Mark the released section of the heap as unaddressable */
+            __asan_poison_memory_region(mem_brk + incr, -incr);
+#endif
+        }
 #ifdef USE_ASAN
-        /* Mark the extended section of the heap as addressable */
-        __asan_unpoison_memory_region(mem_brk, incr);
+        else
+        {
+            /* Mark the extended section of the heap as addressable */
+            __asan_unpoison_memory_region(mem_brk, incr);
+        }
 #endif
         mem_brk += incr;
+        if (mem_brk > mem_max_brk)
+            mem_max_brk = mem_brk;
+        update_peak();
         return (void *)old_brk;
     }
     else
@@ -295,6 +338,118 @@ size_t mem_heapsize()
     return (size_t)(mem_brk - heap);
 }
 
+/*
+ * mem_heap_peak() - returns the largest heap size in bytes since the last
+ *  reset, counting the live mappings made by mem_mmap as part of the heap
+ */
+size_t mem_heap_peak()
+{
+    return mem_peak;
+}
+
+/*
+ * mem_mmap - simple model of an anonymous mmap.  Returns a new mapping of
+ *  len bytes (rounded up to whole pages) that reads as zero, or NULL
+ */
+void *mem_mmap(size_t len)
+{
+    mem_map_t *map = malloc(sizeof(mem_map_t));
+    if (map == NULL)
+        return NULL;
+    map->length = (len + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+    void *addr = mmap(NULL, map->length, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED)
+    {
+        fprintf(stderr,
+                "ERROR: mem_mmap failed.  Could not map %zu bytes\n", len);
+        free(map);
+        return NULL;
+    }
+    map->start = addr;
+    map->next = mappings;
+    mappings = map;
+    mem_mapped += map->length;
+    update_peak();
+    return addr;
+}
+
+/*
+ * mem_munmap - removes a mapping made by mem_mmap.  Only whole mappings can
+ *  be removed.  Returns 0, or -1 if addr and len do not match a mapping
+ */
+int mem_munmap(void *addr, size_t len)
+{
+    mem_map_t **link = find_mapping(addr);
+    size_t length = (len + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+    if (*link == NULL || (*link)->start != addr || (*link)->length != length)
+    {
+        fprintf(stderr,
+                "ERROR: mem_munmap failed.  (%p, %zu) is not a mapping\n",
+                addr, len);
+        return -1;
+    }
+    mem_map_t *map = *link;
+    *link = map->next;
+    mem_mapped -= map->length;
+    munmap(map->start, map->length);
+    free(map);
+    return 0;
+}
+
+/*
+ * mem_mremap - simple model of mremap.  Resizes a mapping made by mem_mmap
+ *  to new_len bytes, moving it if it cannot grow in place, and returns its
+ *  new address, or NULL (leaving the mapping as it was)
+ */
+void *mem_mremap(void *addr, size_t old_len, size_t new_len)
+{
+    mem_map_t **link = find_mapping(addr);
+    size_t length = (old_len + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+    if (*link == NULL || (*link)->start != addr || (*link)->length != length)
+    {
+        fprintf(stderr,
+                "ERROR: mem_mremap failed.  (%p, %zu) is not a mapping\n",
+                addr, old_len);
+        return NULL;
+    }
+    mem_map_t *map = *link;
+    length = (new_len + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+    void *new_addr = mremap(map->start, map->length, length, MREMAP_MAYMOVE);
+    if (new_addr == MAP_FAILED)
+    {
+        fprintf(stderr,
+                "ERROR: mem_mremap failed.  Could not resize mapping to %zu "
+                "bytes\n",
+                new_len);
+        return NULL;
+    }
+    mem_mapped = mem_mapped - map->length + length;
+    map->start = new_addr;
+    map->length = length;
+    update_peak();
+    return new_addr;
+}
+
+/*
+ * mem_in_mapping - returns whether the len bytes at addr all lie within
+ *  one mapping made by mem_mmap
+ */
+bool mem_in_mapping(const void *addr, size_t len)
+{
+    mem_map_t *map = *find_mapping(addr);
+    return map != NULL && (unsigned char *)addr >= map->start &&
+           (unsigned char *)addr + len <= map->start + map->length;
+}
+
+/*
+ * mem_mapsize() - returns the total size in bytes of the live mappings
+ */
+size_t mem_mapsize()
+{
+    return mem_mapped;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
@@ -523,6 +678,65 @@ static void *page_start(size_t id)
     return (void *)((unsigned char *)SPARSE_HEAP_START + offset);
 }
 
+/* Find the link to the mapping holding addr, or to NULL if there is none */
+static mem_map_t **find_mapping(const void *addr)
+{
+    mem_map_t **link = &mappings;
+    while (*link != NULL &&
+           ((unsigned char *)addr < (*link)->start ||
+            (unsigned char *)addr >= (*link)->start + (*link)->length))
+        link = &(*link)->next;
+    return link;
+}
+
+/* Remove every mapping made by mem_mmap */
+static void unmap_all(void)
+{
+    while (mappings != NULL)
+    {
+        mem_map_t *map = mappings;
+        mappings = map->next;
+        munmap(map->start, map->length);
+        free(map);
+    }
+    mem_mapped = 0;
+}
+
+/* Record the current heap plus mapped size if it is a new peak */
+static void update_peak(void)
+{
+    size_t size = (size_t)(mem_brk - heap) + mem_mapped;
+    if (size > mem_peak)
+        mem_peak = size;
+}
+
+/*
+ * Clear the heap bytes in [lo, hi).  In sparse mode, pages that were never
+ *  written to are already clear and are not allocated.
+ */
+static void clear_mem(unsigned char *lo, unsigned char *hi)
+{
+    if (!sparse)
+    {
+        memset(lo, 0, (size_t)(hi - lo));
+        return;
+    }
+    while (lo < hi)
+    {
+        size_t id = page_id(lo);
+        unsigned char *start = (unsigned char *)page_start(id);
+        unsigned char *end = start + SPARSE_PAGE_SIZE;
+        if (end > hi)
+            end = hi;
+        mem_block_t *block = page_table[id % num_buckets];
+        while (block && block->id != id)
+            block = block->next;
+        if (block)
+            memset(block->bytes + (lo - start), 0, (size_t)(end - lo));
+        lo = end;
+    }
+}
+
 /* Get memory to store value.  Allocate page if necessary */
 static void *get_mem(const void *addr, size_t size, bool isWrite)
 {
@@ -553,6 +767,7 @@ static void *get_mem(const void *addr, size_t size, bool isWrite)
         block->next = page_table[b];
         for (i = 0; i < (SPARSE_PAGE_SIZE / 8); i++)
             block->initSet[i] = 0;
+        memset(block->bytes, 0, SPARSE_PAGE_SIZE);
         page_table[b] = block;
     }
 
@@ -22,15 +22,16 @@ void mem_init(bool sparse);
 void mem_deinit(void);
 
 /**
- * @brief Extends the heap by incr bytes.
+ * @brief Extends the heap by incr bytes, or shrinks it if incr is negative.
  *
- * This function is a simple model of the sbrk() function, except for that
- * with this implementation, the heap cannot be shrunk.
+ * This function is a simple model of the sbrk() function. Like fresh pages
+ * from sbrk(), the new area always reads as zero, also after mem_reset_brk
+ * or after the heap shrank over it.
  *
  * @param[in] incr The amount of bytes by which to extend the heap
  * @return The start address of the new heap area (i.e. the previous
  *         breakpoint)
- * @pre `incr > 0`
+ * @pre `mem_heapsize() + incr >= 0`
  */
 void *mem_sbrk(intptr_t incr);
 
@@ -61,6 +62,57 @@ void *mem_heap_hi(void);
  */
 size_t mem_heapsize(void);
 
+/**
+ * @brief Returns the largest size the heap has had since the last reset,
+ *        counting the live mappings made by mem_mmap as part of the heap.
+ * @return The peak size of the heap, in bytes
+ */
+size_t mem_heap_peak(void);
+
+/**
+ * @brief Maps `len` bytes of fresh memory outside the heap.
+ *
+ * This function is a simple model of an anonymous, private mmap(). The
+ * mapping is rounded up to whole pages and reads as zero. mem_reset_brk
+ * removes every mapping.
+ *
+ * @param[in] len The length of the mapping, in bytes
+ * @return The page-aligned start of the mapping, or NULL on failure
+ */
+void *mem_mmap(size_t len);
+
+/**
+ * @brief Removes a mapping made by mem_mmap.
+ * @param[in] addr The start of the mapping
+ * @param[in] len The length the mapping was made or last resized with
+ * @return 0 on success, -1 if there is no such mapping
+ */
+int mem_munmap(void *addr, size_t len);
+
+/**
+ * @brief Resizes a mapping made by mem_mmap, moving it if it cannot grow
+ *        in place. Like mremap(), the contents are kept.
+ * @param[in] addr The start of the mapping
+ * @param[in] old_len The length the mapping was made or last resized with
+ * @param[in] new_len The new length, in bytes
+ * @return The new start of the mapping, or NULL if it was left unchanged
+ */
+void *mem_mremap(void *addr, size_t old_len, size_t new_len);
+
+/**
+ * @brief Checks whether a range lies within a single mapping.
+ * @param[in] addr The first byte of the range
+ * @param[in] len The length of the range, in bytes
+ * @return True if every byte of the range is in the same live mapping
+ */
+bool mem_in_mapping(const void *addr, size_t len);
+
+/**
+ * @brief Returns the number of bytes in the live mappings.
+ * @return The total length of the mappings made by mem_mmap, in bytes
+ */
+size_t mem_mapsize(void);
+
 /**
  * @brief Returns the system page size.
  * @return The page size of the system, in bytes
@@ -19,7 +19,13 @@
  * @author Peizhao Li <peizhaol@andrew.cmu.edu>
  */
 
+/* sched_getcpu, used to bind threads to arenas by CPU */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <assert.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -28,6 +34,83 @@
 #include <string.h>
 #include <unistd.h>
 
+/*
+ * MM_THREADS selects the thread-safe build (used for the interpositioning
+ * library and the multithreaded drivers). The regular drivers only ever call
+ * into the allocator from one thread and leave it off.
+ */
+#ifndef MM_THREADS
+#define MM_THREADS 0
+#endif
+
+/*
+ * FIT_CANDIDATES is the number of fitting blocks of a size class the seglist
+ * search compares before taking the smallest (1 is first fit). It can also
+ * be changed at run time with MM_OPT_FIT_CANDIDATES.
+ */
+#ifndef FIT_CANDIDATES
+#define FIT_CANDIDATES 4
+#endif
+
+/*
+ * MM_STATS=1 keeps the figures mm_get_stats reports up to date on every
+ * call. With MM_STATS=0 the bookkeeping compiles away and mm_get_stats
+ * reports zeros.
+ */
+#ifndef MM_STATS
+#define MM_STATS 1
+#endif
+
+/*
+ * MM_PROF=1 builds in the sampling heap profiler, which stays idle until
+ * MM_OPT_PROF_RATE is set. MM_PROF=0 leaves it out altogether.
+ */
+#ifndef MM_PROF
+#define MM_PROF 1
+#endif
+
+/*
+ * CHECK_WORKERS is the number of threads mm_checkheap splits a large heap
+ * between. Above 1, write_block also keeps up the boundary index the
+ * threads start their walks from, so only debug builds default to it, and
+ * only driver builds, where creating a thread cannot call back into malloc.
+ */
+#ifndef CHECK_WORKERS
+#if defined(DEBUG) && defined(DRIVER)
+#define CHECK_WORKERS 4
+#else
+#define CHECK_WORKERS 1
+#endif
+#endif
+
+/*
+ * CHECK_FULL_EVERY makes mm_checkheap incremental: it only looks at the
+ * blocks and list nodes changed since its last call, and at their
+ * neighbours, and walks the whole heap on every CHECK_FULL_EVERY-th call or
+ * when too much changed for its log. 1 walks the whole heap every time,
+ * which is what non-debug builds, with no log to keep, default to.
+ */
+#ifndef CHECK_FULL_EVERY
+#ifdef DEBUG
+#define CHECK_FULL_EVERY 64
+#else
+#define CHECK_FULL_EVERY 1
+#endif
+#endif
+
+#if MM_THREADS || CHECK_WORKERS > 1
+#include <pthread.h>
+#endif
+
+#if MM_THREADS
+#include <sched.h>
+#endif
+
+#if MM_PROF
+#include <execinfo.h>
+#include <math.h>
+#endif
+
 #include "memlib.h"
 #include "mm.h"
 
@@ -39,6 +122,13 @@
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define memalign mm_memalign
+#define aligned_alloc mm_aligned_alloc
+#define posix_memalign mm_posix_memalign
+#define malloc_usable_size mm_usable_size
+#define free_sized mm_free_sized
+#define malloc_batch mm_malloc_batch
+#define free_batch mm_free_batch
 #define memset mem_memset
 #define memcpy mem_memcpy
 #endif /* def DRIVER */
@@ -86,11 +176,29 @@ static const size_t dsize = 2 * wsize;
 static const size_t min_block_size = dsize;
 
 /**
- * TODO: explain what chunksize is
+ * @brief Smallest amount (bytes) the heap is extended by
  * (Must be divisible by dsize)
  */
 static const size_t chunksize = (1 << 12);
 
+/**
+ * @brief Most bytes the heap is extended by at once when it keeps growing
+ *        (MM_OPT_GROW_MAX; chunksize or less always extends by chunksize)
+ */
+static size_t grow_max = 1 << 20;
+
+/**
+ * @brief Free list searches within which a second extension counts as
+ *        steady growth; each quiet stretch this long halves the next one
+ */
+static const size_t grow_window = 64;
+
+/**
+ * @brief Free bytes at the top of the heap past which free gives memory back
+ *        to memlib (MM_OPT_TRIM_THRESHOLD; 0 never trims)
+ */
+static size_t trim_threshold = 128 * 1024;
+
 /**
  * TODO: explain what alloc_mask is
  */
@@ -109,6 +217,11 @@ static const word_t alloc_mask_prev = 0x2;
  */
 static const word_t mask_mini = 0x4;
 
+/**
+ * Marks a huge block, which lives in a mapping of its own (see huge_alloc).
+ */
+static const word_t mask_mapped = 0x8;
+
 /**
  * TODO: explain what size_mask is
  */
@@ -138,6 +251,19 @@ typedef struct block {
             struct block *next;
             struct block *prev;
         };
+        /** @brief Links of a free block in the large block tree */
+        struct {
+            struct block *left;
+            struct block *right;
+            struct block *parent;
+            word_t red;
+        };
+        /** @brief Links of a free mini block, which only has room for one
+         *         word: see mini_link */
+        struct {
+            uint32_t mini_next;
+            uint32_t mini_prev;
+        };
         char payload[0];
     };
 
@@ -148,14 +274,609 @@ typedef struct block {
 /** @brief Pointer to first block in the heap */
 static block_t *heap_start = NULL;
 
-/** @brief Number of free lists classes */
-static const int NUMCLASS = 10;
+/*
+ * Mini block links.
+ *
+ * The mini block lists are circular and doubly linked, so that a mini block
+ * can be unlinked in constant time when it is coalesced or reused. Both links
+ * fit in the block's one payload word as 32-bit offsets from mini_base, in
+ * units of dsize, which limits the heap to MINI_SPAN bytes.
+ */
+
+/** @brief Bytes above mini_base that mini block links can address */
+#define MINI_SPAN ((size_t)1 << 36)
+
+/** @brief Start of the heap, which mini block links are relative to */
+static char *mini_base;
+
+#if CHECK_WORKERS > 1
+/** @brief Heap bytes covered by each entry of the boundary index */
+#define CHECK_STRIPE ((size_t)1 << 20)
+
+/** @brief Smallest heap mm_checkheap splits between threads */
+static const size_t check_parallel_min = 8 * CHECK_STRIPE;
+
+/**
+ * @brief Boundary index: for every CHECK_STRIPE bytes of the heap, the block
+ *        holding the first of them (NULL for a prologue or epilogue), so
+ *        that heap walks can start in the middle of the heap
+ */
+static block_t *check_marks[MINI_SPAN / CHECK_STRIPE];
+#endif
+
+#if CHECK_FULL_EVERY > 1
+/** @brief Most changes mm_checkheap can look at without a full check */
+#define CHECK_LOG 256
+
+/** @brief A change to the heap since the last mm_checkheap */
+typedef struct {
+    /** @brief The block, prologue or epilogue written, or the list node */
+    char *start;
+    /** @brief Bytes written there, or 0 if only list links changed */
+    size_t size;
+} check_entry_t;
+
+/** @brief Changes since the last mm_checkheap, in order */
+static check_entry_t check_log[CHECK_LOG];
+
+/** @brief Number of changes logged, which may exceed CHECK_LOG */
+static size_t check_nlog;
+
+/** @brief Number of mm_checkheap calls since mm_init */
+static size_t check_calls;
+#endif
+
+/**
+ * @brief Bytes above an arena's zero watermark that may not be zero: the
+ *        header and free list links (at most the tree links) of the free
+ *        block starting there. Beyond that, memory up to the epilogue only
+ *        holds the footer of the last free block.
+ */
+static const size_t zero_slack = 5 * sizeof(word_t);
+
+/*
+ * Size classes.
+ *
+ * Class 0 holds the mini blocks, classes 1 and 2 the 32 and 48 byte blocks,
+ * and from 64 bytes on each power of two is split into four classes of
+ * equal width, up to 8KB. getHead maps a size to its class without
+ * branches, through class_map.
+ *
+ * All blocks of 8KB or more share the last class, TREE_CLASS, which is not
+ * a list but a red-black tree ordered by size, then address, rooted at the
+ * class head. The search for a large block is therefore a best fit in
+ * logarithmic time, however many large blocks are free.
+ *
+ * Each arena keeps a bitmap of its non-empty classes, so that a search
+ * jumps straight to the next class holding any block with a single ctz.
+ * NUMCLASS must therefore not exceed 64.
+ */
+
+/** @brief Number of free lists classes (the ones mm_get_stats reports) */
+#define NUMCLASS MM_STATS_CLASSES
+
+/** @brief Class of the large free blocks, kept in a tree */
+#define TREE_CLASS (NUMCLASS - 1)
+
+/*
+ * TLSF (two-level segregated fit) mode.
+ *
+ * Selected with MM_OPT_FIT, this replaces the seglists for all blocks but
+ * mini blocks. Free lists are indexed by a first level (the power of two
+ * below the size) and a second level (the next TLSF_SL_BITS bits of the
+ * size), with a bitmap of non-empty lists at each level. Requests are
+ * rounded up to the next list boundary, so that the first block of any
+ * non-empty list at or above it fits: malloc and free take a constant
+ * number of steps, whatever the state of the heap.
+ */
+
+/** @brief log2 of the number of second-level lists per first level */
+#define TLSF_SL_BITS 4
+
+/** @brief Number of second-level lists per first level */
+#define TLSF_SL_COUNT (1 << TLSF_SL_BITS)
+
+/** @brief Sizes below 1 << TLSF_FL_SHIFT have one list per 16 bytes */
+#define TLSF_FL_SHIFT (TLSF_SL_BITS + 4)
+
+/** @brief Number of first levels (level 0 holds the small sizes) */
+#define TLSF_FL_COUNT (64 - TLSF_FL_SHIFT + 1)
+
+#if MM_THREADS
+/* Thread-local storage class for per-thread allocator state */
+#define MM_TLS _Thread_local
+
+/** @brief Most arenas the thread-safe build can be configured with */
+#define MAX_ARENAS 16
+#else
+#define MM_TLS
+
+/** @brief A single thread only ever needs one arena */
+#define MAX_ARENAS 1
+#endif
+
+/*
+ * Slab runs.
+ *
+ * Requests of up to SLAB_MAX bytes are served from runs: allocated heap
+ * blocks of SLAB_RUN_SIZE bytes whose payload is SLAB_RUN_SIZE-aligned,
+ * each dedicated to one 16-byte size class. A run starts with a slab_t
+ * holding a bitmap of its free slots, followed by the objects themselves,
+ * which carry no header: a set bit found with ctz is an object. The pages
+ * holding a run's payload are marked in slab_pages, which is how free tells
+ * a slab object from a regular block. Runs with free slots are listed per
+ * class in their arena; a run that becomes empty is freed back to the heap
+ * unless it is the only one left on its list. Once the last object of an
+ * arena comes back, its remaining runs are all empty and are freed too, so
+ * that an idle arena pins no runs that would keep its heap from coalescing
+ * and trimming.
+ *
+ * Every class in use ties up at least one run, which small heaps cannot
+ * afford: an arena only starts making runs once it has grown past
+ * slab_min_heap bytes, and serves small requests from its free lists until
+ * then.
+ */
+
+/** @brief Largest request (bytes) served from slab runs */
+#define SLAB_MAX 256
+
+/** @brief Number of slab size classes, one per 16 bytes */
+#define SLAB_CLASSES (SLAB_MAX / 16)
+
+/** @brief Size and alignment of a slab run */
+#define SLAB_RUN_SIZE 4096
+
+/** @brief Words in a run's free slot bitmap */
+#define SLAB_MAP_WORDS 4
+
+/** @brief Bytes above the heap start in which slab runs can be placed */
+#define SLAB_ZONE ((size_t)1 << 30)
+
+/** @brief Header of a slab run */
+typedef struct slab {
+    /** @brief Links in the arena's list of runs of this class with free
+     *         slots */
+    struct slab *next;
+    struct slab *prev;
+    /** @brief Object size */
+    uint32_t size;
+    /** @brief Number of objects in the run */
+    uint32_t nobj;
+    /** @brief Number of free objects */
+    uint32_t nfree;
+    uint32_t unused;
+    /** @brief Bit i is set if object i is free */
+    word_t free_map[SLAB_MAP_WORDS];
+} slab_t;
+
+/** @brief One bit per SLAB_RUN_SIZE page of the zone, set for run pages */
+static word_t slab_pages[SLAB_ZONE / SLAB_RUN_SIZE / 64];
+
+/** @brief Address of the first page covered by slab_pages */
+static uintptr_t slab_base;
+
+/** @brief Whether small requests are served from slab runs */
+static bool slab_enabled = true;
+
+/** @brief Size an arena must have grown to before it makes slab runs */
+static const size_t slab_min_heap = 1 << 20;
+
+/*
+ * Deferred coalescing.
+ *
+ * In deferred mode (MM_OPT_DEFER), freeing a block of up to defer_max_size
+ * bytes does not coalesce it: the block stays marked as allocated and is
+ * pushed onto its arena's quick list of that size, chained through its
+ * first payload word like a thread cache bin. An allocation of the same
+ * size pops it back without touching the free lists or any neighbor.
+ * Deferred blocks are coalesced in one batch when a fit fails, before the
+ * heap is extended, and when an arena holds defer_limit of them.
+ */
+
+/** @brief Number of quick lists of an arena, one per 16-byte block size */
+#define DEFER_BINS 64
+
+/** @brief Largest block size (bytes) whose coalescing is deferred */
+static const size_t defer_max_size = DEFER_BINS * 16;
+
+/** @brief Deferred blocks an arena holds before coalescing them all */
+static const size_t defer_limit = 1024;
+
+/** @brief Whether frees of small blocks defer coalescing */
+static bool defer_enabled = false;
+
+/*
+ * Huge blocks.
+ *
+ * Requests of mmap_threshold bytes or more stay out of the heap, where they
+ * would leave large holes once freed: each gets an anonymous mapping of its
+ * own from mem_mmap, holding one unused word, the block header and the
+ * payload. The header records the length of the mapping and carries
+ * mask_mapped, which is how free and realloc tell a huge block from a heap
+ * block. realloc resizes a huge block with mem_mremap. Freed mappings of up
+ * to mmap_cache_bytes in total are kept in a small cache (protected by
+ * heap_lock) and handed out again to requests they fit without wasting
+ * more than half of them.
+ */
+
+/** @brief Number of freed mappings kept for reuse */
+#define MMAP_CACHE 4
+
+/**
+ * @brief Smallest request (bytes) served by a mapping of its own
+ *        (MM_OPT_MMAP_THRESHOLD; 0 keeps every request in the heap)
+ */
+static size_t mmap_threshold = 128 * 1024;
+
+/**
+ * @brief Smallest request served by a mapping since mm_init (SIZE_MAX if
+ *        none), below which a sized free knows the block is not huge
+ */
+static size_t mmap_min_size = SIZE_MAX;
+
+/** @brief Most bytes of freed mappings kept for reuse */
+static const size_t mmap_cache_bytes = 16 << 20;
+
+/** @brief Freed huge blocks kept for reuse */
+static block_t *mmap_cache[MMAP_CACHE];
+
+/** @brief Number of huge blocks in mmap_cache */
+static size_t mmap_ncached = 0;
+
+/** @brief Bytes mapped for huge blocks, cached mappings included */
+static size_t mmap_bytes = 0;
+
+/*
+ * Arenas.
+ *
+ * An arena is an independent set of segregated free lists together with the
+ * heap segments its blocks live in. Threads are bound to an arena (round
+ * robin, or by the CPU they run on) and only take that arena's lock to
+ * allocate, so allocation-heavy threads no longer serialize on one heap.
+ *
+ * Arenas share the brk area: each one grows by carving a segment out of the
+ * top of the heap, laid out like a whole heap of its own (prologue footer,
+ * blocks, epilogue header), so that blocks never coalesce across segments.
+ * When the last segment of an arena still ends at the brk, extending the
+ * arena just grows that segment. A block is freed into the arena owning its
+ * segment, whichever thread frees it.
+ *
+ * A thread freeing a block of an arena it is not bound to does not take that
+ * arena's lock: it pushes the block (still marked allocated) onto the
+ * arena's remote free stack with a compare-and-swap. The arena's own thread
+ * takes the whole stack on its next trip to the free lists and frees the
+ * blocks in one batch, so producer/consumer pairs never contend on a lock.
+ */
+typedef struct arena {
+    /** @brief Pointers to first free block in the free lists */
+    block_t *head[NUMCLASS];
+    /** @brief Bit i is set if head[i] is not NULL */
+    word_t nonempty;
+    /** @brief TLSF mode: bit fl is set if a list of first level fl is
+     *         non-empty */
+    word_t tlsf_fl_map;
+    /** @brief TLSF mode: bit sl of entry fl is set if list [fl][sl] is
+     *         non-empty */
+    word_t tlsf_sl_map[TLSF_FL_COUNT];
+    /** @brief TLSF mode: doubly linked (NULL-terminated) free lists */
+    block_t *tlsf[TLSF_FL_COUNT][TLSF_SL_COUNT];
+    /** @brief Epilogue of the arena's last segment (NULL if it has none) */
+    block_t *epilogue;
+    /** @brief Total size of the arena's segments */
+    size_t heap_size;
+    /** @brief Zero watermark: no block at or above it in the arena's last
+     *         segment has been allocated since the memory came from
+     *         mem_sbrk (see calloc) */
+    char *zero_from;
+    /** @brief Runs of each slab class that have free slots */
+    slab_t *slabs[SLAB_CLASSES];
+    /** @brief Slab objects handed out of the arena's runs and not freed
+     *         back to them (those in thread caches included) */
+    size_t slab_live;
+    /** @brief Deferred mode: blocks of size (i + 1) * dsize whose
+     *         coalescing is deferred, linked through next */
+    block_t *quick[DEFER_BINS];
+    /** @brief Number of blocks on the quick lists */
+    size_t ndeferred;
+    /** @brief Bytes the next extension of the arena asks for at least */
+    size_t grow_size;
+    /** @brief Value of counters.fit_searches at the last extension */
+    size_t grow_mark;
+    /** @brief Bytes freed since the arena last shrank or took back cached
+     *         blocks to trim its heap */
+    size_t trim_pending;
+    /** @brief Set while the arena takes back cached blocks to trim its heap */
+    bool trim_reclaiming;
+    /** @brief Counters of events on the arena (protected by its lock) */
+    mm_counters_t counters;
+#if MM_STATS
+    /** @brief Bytes on the free lists */
+    size_t free_bytes;
+    /** @brief Number of blocks on the free lists, by seglist class */
+    size_t free_blocks[NUMCLASS];
+#endif
+#if MAX_ARENAS > 1
+    /** @brief Lock-free stack of blocks freed by other threads */
+    block_t *remote;
+    /** @brief Number of blocks on the remote stack (may lag behind it) */
+    size_t nremote;
+#endif
+#if MM_THREADS
+    /** @brief Protects the free lists and segments of the arena */
+    pthread_mutex_t lock;
+#endif
+} arena_t;
+
+/** @brief The arenas; the first segment of the heap belongs to arenas[0] */
+static arena_t arenas[MAX_ARENAS];
+
+/** @brief Number of arenas threads are spread over (0 until first mm_init) */
+static unsigned int narenas = 0;
+
+/**
+ * @brief Generation number of the thread to arena bindings, bumped whenever
+ *        they must be redone.
+ */
+static unsigned long arena_epoch = 0;
+
+/** @brief How threads are bound to arenas (one of MM_ARENA_*) */
+static int arena_policy = MM_ARENA_ROUND_ROBIN;
+
+/** @brief Placement engine of the heap (one of MM_FIT_*) */
+static int fit_mode = MM_FIT_SEGLIST;
+
+/** @brief Placement engine the next mm_init sets the heap up with */
+static int fit_mode_next = MM_FIT_SEGLIST;
+
+/** @brief Seglist mode: fitting blocks of a class looked at before taking
+ *         the smallest of them */
+static unsigned int fit_candidates = FIT_CANDIDATES;
+
+/** @brief Most candidates MM_OPT_FIT_CANDIDATES accepts */
+static const long fit_candidates_max = 1 << 16;
+
+#if MAX_ARENAS > 1
+/** @brief Most segments the heap can be carved into */
+#define MAX_SEGMENTS 65536
+
+/** @brief A heap segment: where it starts and which arena owns it */
+typedef struct {
+    /** @brief The segment's prologue footer */
+    char *start;
+    arena_t *arena;
+} segment_t;
+
+/**
+ * @brief All segments, in address order.
+ *
+ * The brk only moves up, so appending keeps the table sorted. Entries are
+ * never modified once published through nsegments, which lets block_arena
+ * search the table without a lock.
+ */
+static segment_t segments[MAX_SEGMENTS];
+
+/** @brief Number of published entries of segments */
+static size_t nsegments = 0;
+
+/** @brief Counter handing out arenas to threads in round-robin order */
+static unsigned int arena_next = 0;
+
+/** @brief Whether frees into other threads' arenas use the remote stacks */
+static bool remote_free = true;
+
+/**
+ * @brief Remote stack length at which the freeing thread drains the stack
+ *        itself, if the arena is idle (its threads may all have exited).
+ */
+static const size_t remote_max = 1024;
+
+/** @brief Arena the calling thread allocates from */
+static MM_TLS arena_t *thread_arena = NULL;
+
+/** @brief arena_epoch at the time thread_arena was chosen */
+static MM_TLS unsigned long thread_arena_epoch = 0;
+#endif
+
+/**
+ * @brief Generation number of the heap.
+ *
+ * Bumped by every mm_init, so that thread caches filled against an earlier
+ * heap can recognize that their blocks no longer exist.
+ */
+static unsigned long heap_epoch = 0;
+
+#if MM_THREADS
+/**
+ * @brief Protects the brk, the segment table and the thread cache registry.
+ *
+ * May be taken while holding an arena lock, never the other way around.
+ */
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** @brief Initializes the arena locks exactly once */
+static pthread_once_t arena_lock_once = PTHREAD_ONCE_INIT;
+
+/** @brief Initializes the heap exactly once for programs that never call
+ *         mm_init */
+static pthread_once_t heap_init_once = PTHREAD_ONCE_INIT;
+#endif
+
+/*
+ * Thread caches (tcache).
+ *
+ * Each thread keeps a handful of recently freed small blocks per size, so
+ * that a free followed by a malloc of the same size never touches the free
+ * lists or the heap lock. Cached blocks stay marked as allocated in the heap
+ * (so nothing coalesces with them) and are chained through their first
+ * payload word. When a bin is full, half of it is flushed back to the free
+ * lists in one batch. Before an arena grows the heap, the calling thread's
+ * cached blocks of that arena go back to its free lists, so that they can
+ * coalesce and serve the request instead. They also go back when a free
+ * block reaches the top of the heap without being trimmed (see
+ * trim_reclaim), and all of them once the thread has freed every block it
+ * allocated (see tcache_idle).
+ */
+
+/** @brief Number of thread cache bins, one per 16-byte block size */
+#define TCACHE_BINS 32
+
+/**
+ * @brief Number of thread cache bins including those of slab objects, which
+ *        follow the block bins, one per slab class.
+ */
+#define TCACHE_ALL_BINS (TCACHE_BINS + SLAB_CLASSES)
+
+/** @brief Largest block size (bytes) that is kept in a thread cache */
+static const size_t tcache_max_size = TCACHE_BINS * 16;
+
+/** @brief Upper bound accepted for the per-bin depth (MM_OPT_TCACHE_COUNT) */
+static const long tcache_max_count = 1024;
+
+/** @brief Maximum number of blocks kept in each bin; 0 disables the cache */
+static unsigned int tcache_count = 7;
+
+/** @brief Per-thread cache of free small blocks */
+typedef struct tcache {
+    /**
+     * @brief Cached blocks of size (i + 1) * dsize, then cached slab objects
+     *        of each class, linked through next
+     */
+    block_t *bin[TCACHE_ALL_BINS];
+
+    /** @brief Number of blocks in each bin */
+    unsigned int count[TCACHE_ALL_BINS];
 
-/** @brief Pointers to first free block in the free lists */
-static block_t *head[NUMCLASS];
+    /** @brief Value of heap_epoch the cached blocks belong to */
+    unsigned long epoch;
 
-/** @brief Pointer to last free block in the mini block free list */
-static block_t *tail;
+    /** @brief Hit/miss/flush counters of this thread */
+    mm_counters_t counters;
+
+    /** @brief Value of counters.freed_bytes when the cache was last emptied
+     *         by tcache_idle */
+    size_t idle_mark;
+
+#if MM_PROF
+    /** @brief Bytes left to allocate before the next sample */
+    int64_t prof_left;
+
+    /** @brief prof_rate the countdown was drawn at */
+    size_t prof_rate;
+
+    /** @brief State of the generator drawing the countdowns */
+    uint64_t prof_seed;
+
+    /** @brief Set while a sample is taken, when the unwinder may allocate */
+    bool prof_busy;
+#endif
+
+#if MM_THREADS
+    /** @brief Set once the cache is on the live list */
+    bool registered;
+
+    /** @brief Links in the list of live thread caches */
+    struct tcache *live_next;
+    struct tcache *live_prev;
+#endif
+} tcache_t;
+
+/** @brief The calling thread's cache */
+static MM_TLS tcache_t tcache;
+
+#if MM_THREADS
+/** @brief Key whose destructor flushes a cache when its thread exits */
+static pthread_key_t tcache_key;
+
+/** @brief Guards the one-time creation of tcache_key */
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+/** @brief Caches of all running threads (protected by heap_lock) */
+static tcache_t *tcache_live = NULL;
+
+/** @brief Counters folded in from threads that have exited */
+static mm_counters_t tcache_retired;
+#endif
+
+#if MM_PROF
+/*
+ * Sampling heap profiler.
+ *
+ * Every thread counts down the bytes it allocates, and the allocation that
+ * takes the count below zero is sampled; the next count is drawn from an
+ * exponential distribution of mean prof_rate, so that samples form a
+ * Poisson process over the bytes allocated. A sample records the call site
+ * (the return address of the entry point and a few frames above it) and
+ * stands for 1 / p allocations of its size, p being the chance that an
+ * allocation of that size is sampled.
+ *
+ * Sampled blocks that are still allocated are kept in a hash table, which
+ * free consults only when the filter, a table of counts indexed by address
+ * hash, says the block may be in it. Both tables and the call sites are
+ * protected by heap_lock.
+ */
+
+/** @brief Frames recorded per call site */
+#define PROF_DEPTH 4
+
+/** @brief Frames the unwinder may find inside the allocator */
+#define PROF_SKIP 8
+
+/** @brief Capacity of the call site table (a power of two) */
+#define PROF_SITES 512
+
+/** @brief Capacity of the live sample table (a power of two) */
+#define PROF_LIVE 4096
+
+/** @brief Entries of the live sample filter (a power of two) */
+#define PROF_FILTER 4096
+
+/** @brief A call site and the allocations sampled there */
+typedef struct {
+    void *pc[PROF_DEPTH];   /* caller first, unused frames NULL */
+    size_t alloc_bytes;     /* estimated bytes allocated */
+    size_t alloc_objs;      /* estimated blocks allocated */
+    size_t live_bytes;      /* estimated bytes still allocated */
+    size_t live_objs;       /* estimated blocks still allocated */
+} prof_site_t;
+
+/** @brief A sampled block that has not been freed */
+typedef struct {
+    void *bp;          /* the payload, NULL for an empty entry */
+    size_t bytes;      /* bytes the sample stands for */
+    size_t objs;       /* blocks the sample stands for */
+    prof_site_t *site;
+} prof_live_t;
+
+/**
+ * @brief Mean number of bytes between samples (MM_OPT_PROF_RATE; 0 turns
+ *        the profiler off)
+ */
+static size_t prof_rate = 0;
+
+/**
+ * @brief Bytes an idle thread allocates between looks at prof_rate, so that
+ *        turning the profiler on reaches every thread
+ */
+static const int64_t prof_recheck = 1 << 20;
+
+/** @brief Call sites, by hash of their frames */
+static prof_site_t prof_sites[PROF_SITES];
+
+/** @brief Number of call sites in use */
+static size_t prof_nsites = 0;
+
+/** @brief Live samples, by hash of their address (linear probing) */
+static prof_live_t prof_live[PROF_LIVE];
+
+/** @brief Number of live samples, read by free without the lock */
+static size_t prof_nlive = 0;
+
+/** @brief Number of live samples per address hash, read likewise */
+static uint16_t prof_filter[PROF_FILTER];
+
+/** @brief Samples dropped because a table was full */
+static size_t prof_dropped = 0;
+#endif
 
 /*
  *****************************************************************************
@@ -349,6 +1070,53 @@ static bool getPrevMiniStatus(block_t *block) {
     return (bool)(word & mask_mini);
 }
 
+/**
+ * @brief Logs a change for the next mm_checkheap to look at.
+ *
+ * @param[in] start The block, prologue or epilogue written, or a free block
+ *                  whose list links changed
+ * @param[in] size Bytes written, or 0 for a change of list links
+ */
+static void check_log_add(void *start, size_t size) {
+#if CHECK_FULL_EVERY > 1
+    // arenas log their changes concurrently
+    size_t i = __atomic_fetch_add(&check_nlog, 1, __ATOMIC_RELAXED);
+    if (i < CHECK_LOG) {
+        check_log[i].start = start;
+        check_log[i].size = size;
+    }
+#else
+    (void)start;
+    (void)size;
+#endif
+}
+
+/**
+ * @brief Records a write of [start, start + size) in the change log, and in
+ *        the boundary index what now starts the stripes of the heap it
+ *        covers.
+ *
+ * @param[in] start
+ * @param[in] size
+ * @param[in] block The block written there, or NULL for a prologue or
+ *                  epilogue
+ */
+static void check_mark(void *start, size_t size, block_t *block) {
+    check_log_add(start, size);
+#if CHECK_WORKERS > 1
+    size_t from = (size_t)((char *)start - (char *)mem_heap_lo());
+    for (size_t i = (from + CHECK_STRIPE - 1) / CHECK_STRIPE;
+         i * CHECK_STRIPE < from + size && i < MINI_SPAN / CHECK_STRIPE;
+         i++) {
+        check_marks[i] = block;
+    }
+#else
+    (void)start;
+    (void)size;
+    (void)block;
+#endif
+}
+
 /**
  * @brief Writes an epilogue header at the given address.
  *
@@ -358,10 +1126,12 @@ static bool getPrevMiniStatus(block_t *block) {
  */
 static void write_epilogue(block_t *block) {
     dbg_requires(block != NULL);
-    dbg_requires((char *)block == mem_heap_hi() - 7);
+    // other arenas may already have grown the heap past it
+    dbg_requires((char *)block <= (char *)mem_heap_hi() - 7);
 
     // the new epilogue should have prevAlloc as free
     block->header = pack(0, true, false);
+    check_mark(block, wsize, NULL);
 }
 
 /**
@@ -390,6 +1160,7 @@ static void write_block(block_t *block, size_t size, bool alloc, bool prevAlloc,
         word_t *footerp = header_to_footer(block);
         *footerp = pack(size, alloc, prevAlloc);
     }
+    check_mark(block, size, block);
 }
 
 /**
@@ -455,93 +1226,654 @@ static block_t *find_prev(block_t *block) {
 /******** The remaining content below are helper and debug routines ********/
 void printHeap(int __line__);
 
+/** @brief How sizes of one power of two map to size classes */
+typedef struct {
+    /** @brief Right shift leaving the top bits of the size (in units of
+     *         dsize) that select the sub-class */
+    unsigned char shift;
+    /** @brief The class is base + (units >> shift) - 1 */
+    unsigned char base;
+} class_map_t;
+
 /**
- * @brief find a head corresponding to the asize.
- * @param[in] asize
- * @return
+ * @brief Size class mapping, indexed by the position of the highest set
+ *        bit of size / dsize. Written out by hand for NUMCLASS == 32:
+ *        entry m is {0, 0} for m < 2, {m - 2, 4 * (m - 2)} for m < 9, and
+ *        {63, 32} above, which sends every size of 8KB or more to
+ *        TREE_CLASS.
  */
-static size_t getHead(size_t asize) {
-    size_t i;
-    if (asize < 32) {
-        i = 0;
-    } else if (asize <= 64) {
-        i = 1;
-    } else if (asize <= 128) {
-        i = 2;
-    } else if (asize <= 256) {
-        i = 3;
-    } else if (asize <= 512) {
-        i = 4;
-    } else if (asize <= 1024) {
-        i = 5;
-    } else if (asize <= 2048) {
-        i = 6;
-    } else if (asize <= 4096) {
-        i = 7;
-    } else if (asize <= 8192) {
-        i = 8;
-    } else {
-        i = 9;
-    }
-    return i;
-}
+static const class_map_t class_map[64] = {
+    {0, 0},   {0, 0},   {0, 0},   {1, 4},   {2, 8},   {3, 12},
+    {4, 16},  {5, 20},  {6, 24},  {63, 32}, {63, 32}, {63, 32},
+    {63, 32}, {63, 32}, {63, 32}, {63, 32}, {63, 32}, {63, 32},
+    {63, 32}, {63, 32}, {63, 32}, {63, 32}, {63, 32}, {63, 32},
+    {63, 32}, {63, 32}, {63, 32}, {63, 32}, {63, 32}, {63, 32},
+    {63, 32}, {63, 32}, {63, 32}, {63, 32}, {63, 32}, {63, 32},
+    {63, 32}, {63, 32}, {63, 32}, {63, 32}, {63, 32}, {63, 32},
+    {63, 32}, {63, 32}, {63, 32}, {63, 32}, {63, 32}, {63, 32},
+    {63, 32}, {63, 32}, {63, 32}, {63, 32}, {63, 32}, {63, 32},
+    {63, 32}, {63, 32}, {63, 32}, {63, 32}, {63, 32}, {63, 32},
+    {63, 32}, {63, 32}, {63, 32}, {63, 32},
+};
+_Static_assert(NUMCLASS == 32, "class_map is written out for 32 classes");
+
+/**
+ * @brief Returns the size class of a block size.
+ *
+ * The top three bits of size / dsize pick one of the four classes of its
+ * power of two (sizes below 64 bytes have their own class each).
+ *
+ * @param[in] asize A block size, at least min_block_size
+ * @return The index of the free list holding blocks of that size
+ */
+static size_t getHead(size_t asize) {
+    dbg_requires(asize >= min_block_size);
+    word_t units = asize / dsize;
+    const class_map_t *map = &class_map[63 - __builtin_clzll(units)];
+    return map->base + (units >> map->shift) - 1;
+}
+
+/**
+ * @brief Returns the link other mini blocks use to point to a block.
+ * @param[in] block
+ */
+static uint32_t mini_link(block_t *block) {
+    return (uint32_t)(((char *)block - mini_base) / dsize);
+}
+
+/**
+ * @brief Returns the block a mini block link points to.
+ * @param[in] link
+ */
+static block_t *mini_at(uint32_t link) {
+    return (block_t *)(mini_base + (size_t)link * dsize + wsize);
+}
+
+/**
+ * @brief Acquires the heap lock (a no-op in the single-threaded build).
+ */
+static void lock_heap(void) {
+#if MM_THREADS
+    pthread_mutex_lock(&heap_lock);
+#endif
+}
+
+/**
+ * @brief Releases the heap lock (a no-op in the single-threaded build).
+ */
+static void unlock_heap(void) {
+#if MM_THREADS
+    pthread_mutex_unlock(&heap_lock);
+#endif
+}
+
+/**
+ * @brief Acquires an arena's lock (a no-op in the single-threaded build).
+ * @param[in] arena
+ */
+static void lock_arena(arena_t *arena) {
+#if MM_THREADS
+    pthread_mutex_lock(&arena->lock);
+#else
+    (void)arena;
+#endif
+}
+
+/**
+ * @brief Releases an arena's lock (a no-op in the single-threaded build).
+ * @param[in] arena
+ */
+static void unlock_arena(arena_t *arena) {
+#if MM_THREADS
+    pthread_mutex_unlock(&arena->lock);
+#else
+    (void)arena;
+#endif
+}
+
+/**
+ * @brief Returns the arena owning a block.
+ *
+ * Binary search for the last segment starting below the block. Safe without
+ * any lock, since segments are only ever appended.
+ *
+ * @param[in] block A block (or epilogue) inside the heap
+ * @return The owning arena
+ */
+static arena_t *block_arena(block_t *block) {
+#if MAX_ARENAS > 1
+    size_t lo = 0;
+    size_t hi = __atomic_load_n(&nsegments, __ATOMIC_ACQUIRE);
+
+    dbg_requires(hi > 0 && (char *)block > segments[0].start);
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (segments[mid].start < (char *)block) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return segments[lo].arena;
+#else
+    (void)block;
+    return &arenas[0];
+#endif
+}
+
+/**
+ * @brief Records a new segment starting at `start` for `arena`.
+ *
+ * @param[in] start The segment's prologue
+ * @param[in] arena
+ * @pre The caller holds the heap lock, and the segment table is not full.
+ */
+static void add_segment(char *start, arena_t *arena) {
+#if MAX_ARENAS > 1
+    dbg_requires(nsegments < MAX_SEGMENTS);
+    segments[nsegments].start = start;
+    segments[nsegments].arena = arena;
+    __atomic_store_n(&nsegments, nsegments + 1, __ATOMIC_RELEASE);
+#else
+    (void)start;
+    (void)arena;
+#endif
+}
+
+/**
+ * @brief Returns the arena the calling thread allocates from.
+ *
+ * Under MM_ARENA_BY_CPU this is picked from the CPU the thread is running
+ * on at each call; otherwise a thread keeps the arena it was handed until
+ * the next mm_init or change of the arena options.
+ *
+ * @return The calling thread's arena
+ */
+static arena_t *get_arena(void) {
+#if MAX_ARENAS > 1
+    if (arena_policy == MM_ARENA_BY_CPU) {
+        int cpu = sched_getcpu();
+        if (cpu >= 0) {
+            return &arenas[(unsigned int)cpu % narenas];
+        }
+    }
+    if (thread_arena == NULL || thread_arena_epoch != arena_epoch) {
+        unsigned int n = __atomic_fetch_add(&arena_next, 1, __ATOMIC_RELAXED);
+        thread_arena = &arenas[n % narenas];
+        thread_arena_epoch = arena_epoch;
+    }
+    return thread_arena;
+#else
+    return &arenas[0];
+#endif
+}
+
+/**
+ * @brief Returns the TLSF list holding free blocks of a size.
+ *
+ * @param[in] size A block size
+ * @param[out] fl First level
+ * @param[out] sl Second level
+ */
+static void tlsf_mapping(size_t size, size_t *fl, size_t *sl) {
+    if (size < ((size_t)1 << TLSF_FL_SHIFT)) {
+        *fl = 0;
+        *sl = size / dsize;
+    } else {
+        size_t msb = 63 - (size_t)__builtin_clzll(size);
+        *fl = msb - TLSF_FL_SHIFT + 1;
+        *sl = (size >> (msb - TLSF_SL_BITS)) - TLSF_SL_COUNT;
+    }
+}
+
+/**
+ * @brief Pushes a free block onto its TLSF list.
+ * @param[in] arena
+ * @param[in] block A free block larger than a mini block
+ */
+static void tlsf_insert(arena_t *arena, block_t *block) {
+    size_t fl, sl;
+    tlsf_mapping(get_size(block), &fl, &sl);
+
+    block_t *head = arena->tlsf[fl][sl];
+    block->prev = NULL;
+    block->next = head;
+    if (head != NULL) {
+        head->prev = block;
+    }
+    arena->tlsf[fl][sl] = block;
+    arena->tlsf_fl_map |= (word_t)1 << fl;
+    arena->tlsf_sl_map[fl] |= (word_t)1 << sl;
+}
+
+/**
+ * @brief Unlinks a free block from its TLSF list.
+ * @param[in] arena
+ * @param[in] block A free block on one of the arena's TLSF lists
+ */
+static void tlsf_remove(arena_t *arena, block_t *block) {
+    size_t fl, sl;
+    tlsf_mapping(get_size(block), &fl, &sl);
+
+    if (block->prev != NULL) {
+        block->prev->next = block->next;
+    } else {
+        arena->tlsf[fl][sl] = block->next;
+        if (block->next == NULL) {
+            arena->tlsf_sl_map[fl] &= ~((word_t)1 << sl);
+            if (arena->tlsf_sl_map[fl] == 0) {
+                arena->tlsf_fl_map &= ~((word_t)1 << fl);
+            }
+        }
+    }
+    if (block->next != NULL) {
+        block->next->prev = block->prev;
+    }
+    block->next = NULL;
+    block->prev = NULL;
+}
+
+/**
+ * @brief Finds a free block of at least `asize` bytes in constant time.
+ *
+ * `asize` is rounded up to the next list boundary, and the first block of
+ * the first non-empty list from there on is taken. This may skip a fitting
+ * block in the list `asize` falls in (a good fit rather than a best fit).
+ *
+ * @param[in] arena
+ * @param[in] asize
+ * @return A free block of at least `asize` bytes, or NULL
+ */
+static block_t *tlsf_find(arena_t *arena, size_t asize) {
+    size_t fl, sl;
+    size_t rsize = asize;
+
+    if (asize >= ((size_t)1 << TLSF_FL_SHIFT)) {
+        size_t msb = 63 - (size_t)__builtin_clzll(asize);
+        rsize += ((size_t)1 << (msb - TLSF_SL_BITS)) - 1;
+    }
+    tlsf_mapping(rsize, &fl, &sl);
+
+    word_t sl_map = arena->tlsf_sl_map[fl] & (~(word_t)0 << sl);
+    if (sl_map == 0) {
+        word_t fl_map = fl + 1 < TLSF_FL_COUNT
+                            ? arena->tlsf_fl_map & (~(word_t)0 << (fl + 1))
+                            : 0;
+        if (fl_map == 0) {
+            return NULL;
+        }
+        fl = (size_t)__builtin_ctzll(fl_map);
+        sl_map = arena->tlsf_sl_map[fl];
+    }
+    sl = (size_t)__builtin_ctzll(sl_map);
+
+    dbg_ensures(get_size(arena->tlsf[fl][sl]) >= asize);
+    return arena->tlsf[fl][sl];
+}
+
+/**
+ * @brief Orders the blocks of the large block tree: by size, then address.
+ * @param[in] a
+ * @param[in] b
+ * @return True if `a` comes before `b`
+ */
+static bool tree_less(block_t *a, block_t *b) {
+    size_t size_a = get_size(a);
+    size_t size_b = get_size(b);
+    return size_a < size_b || (size_a == size_b && a < b);
+}
+
+/**
+ * @brief Puts `child` in the place of `node` under node's parent.
+ * @param[in] arena
+ * @param[in] node A block of the tree
+ * @param[in] child The replacement (may be NULL)
+ */
+static void tree_replace(arena_t *arena, block_t *node, block_t *child) {
+    if (node->parent == NULL) {
+        arena->head[TREE_CLASS] = child;
+    } else if (node == node->parent->left) {
+        node->parent->left = child;
+    } else {
+        node->parent->right = child;
+    }
+    if (child != NULL) {
+        child->parent = node->parent;
+        check_log_add(child, 0);
+    }
+}
+
+/**
+ * @brief Rotates the tree left around `node`, whose right child takes its
+ *        place.
+ * @param[in] arena
+ * @param[in] node
+ */
+static void tree_rotate_left(arena_t *arena, block_t *node) {
+    block_t *child = node->right;
+    node->right = child->left;
+    if (child->left != NULL) {
+        child->left->parent = node;
+    }
+    tree_replace(arena, node, child);
+    child->left = node;
+    node->parent = child;
+}
+
+/**
+ * @brief Rotates the tree right around `node`, whose left child takes its
+ *        place.
+ * @param[in] arena
+ * @param[in] node
+ */
+static void tree_rotate_right(arena_t *arena, block_t *node) {
+    block_t *child = node->left;
+    node->left = child->right;
+    if (child->right != NULL) {
+        child->right->parent = node;
+    }
+    tree_replace(arena, node, child);
+    child->right = node;
+    node->parent = child;
+}
+
+/**
+ * @brief Inserts a free block into the large block tree and rebalances it.
+ * @param[in] arena
+ * @param[in] block A free block of TREE_CLASS
+ */
+static void tree_insert(arena_t *arena, block_t *block) {
+    block_t *parent = NULL;
+    block_t **link = &arena->head[TREE_CLASS];
+    while (*link != NULL) {
+        parent = *link;
+        link = tree_less(block, parent) ? &parent->left : &parent->right;
+    }
+    block->left = NULL;
+    block->right = NULL;
+    block->parent = parent;
+    block->red = 1;
+    *link = block;
+
+    // Restore the red-black properties on the way up
+    block_t *node = block;
+    while (node->parent != NULL && node->parent->red) {
+        block_t *p = node->parent;
+        block_t *g = p->parent; // The root is black, so p is not the root
+        if (p == g->left) {
+            block_t *uncle = g->right;
+            if (uncle != NULL && uncle->red) {
+                p->red = 0;
+                uncle->red = 0;
+                g->red = 1;
+                node = g;
+                continue;
+            }
+            if (node == p->right) {
+                tree_rotate_left(arena, p);
+                p = node;
+            }
+            p->red = 0;
+            g->red = 1;
+            tree_rotate_right(arena, g);
+            break;
+        } else {
+            block_t *uncle = g->left;
+            if (uncle != NULL && uncle->red) {
+                p->red = 0;
+                uncle->red = 0;
+                g->red = 1;
+                node = g;
+                continue;
+            }
+            if (node == p->left) {
+                tree_rotate_right(arena, p);
+                p = node;
+            }
+            p->red = 0;
+            g->red = 1;
+            tree_rotate_left(arena, g);
+            break;
+        }
+    }
+    arena->head[TREE_CLASS]->red = 0;
+}
+
+/**
+ * @brief Removes a block from the large block tree and rebalances it.
+ * @param[in] arena
+ * @param[in] block A block of the tree
+ */
+static void tree_remove(arena_t *arena, block_t *block) {
+    block_t *child;  // The node taking the place of the one removed
+    block_t *parent; // and its parent (child may be NULL)
+    bool removed_red = block->red;
+
+    if (block->left == NULL || block->right == NULL) {
+        child = block->left != NULL ? block->left : block->right;
+        parent = block->parent;
+        tree_replace(arena, block, child);
+    } else {
+        // Replace the block with its successor
+        block_t *next = block->right;
+        while (next->left != NULL) {
+            next = next->left;
+        }
+        removed_red = next->red;
+        child = next->right;
+        if (next->parent == block) {
+            parent = next;
+        } else {
+            parent = next->parent;
+            tree_replace(arena, next, next->right);
+            next->right = block->right;
+            next->right->parent = next;
+        }
+        tree_replace(arena, block, next);
+        next->left = block->left;
+        next->left->parent = next;
+        next->red = block->red;
+    }
+
+    // A black node went missing from the paths through child
+    while (!removed_red && child != arena->head[TREE_CLASS] &&
+           (child == NULL || !child->red)) {
+        if (child == parent->left) {
+            block_t *sibling = parent->right;
+            if (sibling->red) {
+                sibling->red = 0;
+                parent->red = 1;
+                tree_rotate_left(arena, parent);
+                sibling = parent->right;
+            }
+            if ((sibling->left == NULL || !sibling->left->red) &&
+                (sibling->right == NULL || !sibling->right->red)) {
+                sibling->red = 1;
+                child = parent;
+                parent = child->parent;
+                continue;
+            }
+            if (sibling->right == NULL || !sibling->right->red) {
+                sibling->left->red = 0;
+                sibling->red = 1;
+                tree_rotate_right(arena, sibling);
+                sibling = parent->right;
+            }
+            sibling->red = parent->red;
+            parent->red = 0;
+            sibling->right->red = 0;
+            tree_rotate_left(arena, parent);
+        } else {
+            block_t *sibling = parent->left;
+            if (sibling->red) {
+                sibling->red = 0;
+                parent->red = 1;
+                tree_rotate_right(arena, parent);
+                sibling = parent->left;
+            }
+            if ((sibling->left == NULL || !sibling->left->red) &&
+                (sibling->right == NULL || !sibling->right->red)) {
+                sibling->red = 1;
+                child = parent;
+                parent = child->parent;
+                continue;
+            }
+            if (sibling->left == NULL || !sibling->left->red) {
+                sibling->right->red = 0;
+                sibling->red = 1;
+                tree_rotate_left(arena, sibling);
+                sibling = parent->left;
+            }
+            sibling->red = parent->red;
+            parent->red = 0;
+            sibling->left->red = 0;
+            tree_rotate_right(arena, parent);
+        }
+        child = arena->head[TREE_CLASS];
+    }
+    if (child != NULL) {
+        child->red = 0;
+    }
+
+    block->left = NULL;
+    block->right = NULL;
+    block->parent = NULL;
+}
+
+/**
+ * @brief Finds the best fit for a request in the large block tree: the
+ *        smallest block of at least `asize` bytes, lowest address first.
+ * @param[in] arena
+ * @param[in] asize
+ * @return The block, or NULL if the tree holds none that large
+ */
+static block_t *tree_best_fit(arena_t *arena, size_t asize) {
+    block_t *best = NULL;
+    block_t *node = arena->head[TREE_CLASS];
+    while (node != NULL) {
+        if (get_size(node) >= asize) {
+            best = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    return best;
+}
+
+/**
+ * @brief Counts a block going onto or coming off the free lists (MM_STATS).
+ *
+ * Blocks are counted by seglist class in TLSF mode too.
+ *
+ * @param[in] arena
+ * @param[in] block
+ * @param[in] add True if the block goes onto the free lists
+ */
+static void stats_list(arena_t *arena, block_t *block, bool add) {
+#if MM_STATS
+    size_t size = get_size(block);
+    size_t i = getHead(size);
+    if (add) {
+        arena->free_bytes += size;
+        arena->free_blocks[i]++;
+    } else {
+        arena->free_bytes -= size;
+        arena->free_blocks[i]--;
+    }
+#else
+    (void)arena;
+    (void)block;
+    (void)add;
+#endif
+}
+
+/**
+ * @brief Logs the list neighbours of a free block about to leave its list,
+ *        whose links to each other change.
+ * @param[in] block
+ */
+static void check_log_neighbours(block_t *block) {
+#if CHECK_FULL_EVERY > 1
+    block_t *near[3] = {NULL, NULL, NULL};
+    size_t size = get_size(block);
+    if (fit_mode == MM_FIT_TLSF && size != min_block_size) {
+        near[0] = block->next;
+        near[1] = block->prev;
+    } else if (size == min_block_size) {
+        near[0] = mini_at(block->mini_next);
+        near[1] = mini_at(block->mini_prev);
+    } else if (getHead(size) == TREE_CLASS) {
+        near[0] = block->parent;
+        near[1] = block->left;
+        near[2] = block->right;
+    } else {
+        near[0] = block->next;
+        near[1] = block->prev;
+    }
+    for (size_t i = 0; i < 3; i++) {
+        if (near[i] != NULL && near[i] != block) {
+            check_log_add(near[i], 0);
+        }
+    }
+#else
+    (void)block;
+#endif
+}
 
 /**
  * @brief remove designated free block from free list
  * @param[in] block
  * @return
  */
-static void removeFree(block_t *block) {
+static void removeFree(arena_t *arena, block_t *block) {
+    stats_list(arena, block, false);
+    check_log_neighbours(block);
+    if (fit_mode == MM_FIT_TLSF && get_size(block) != min_block_size) {
+        tlsf_remove(arena, block);
+        return;
+    }
+
     size_t i = getHead(get_size(block));
+    if (i == TREE_CLASS) {
+        tree_remove(arena, block);
+        if (arena->head[i] == NULL) {
+            arena->nonempty &= ~((word_t)1 << i);
+        }
+        return;
+    }
+
     // mini block
     if (i == 0) {
-        // when there is only one block in the mini free list
-        if (block->next == block && block == tail && block == head[i]) {
-            head[i] = NULL;
-            tail = NULL;
-            block->next = NULL;
-            return;
-        }
-        if (block == head[i]) {
-            head[i] = head[i]->next;
-            // no need to consider block is head and tail, above case has
-            // covered it
-            tail->next = head[i];
-            block->next = NULL;
+        block_t *next = mini_at(block->mini_next);
+        if (next == block) {
+            arena->head[i] = NULL;
+            arena->nonempty &= ~((word_t)1 << i);
             return;
         }
-        if (block == tail) {
-            block_t *cur = head[i];
-            while (cur->next != tail) {
-                cur = cur->next;
-            }
-            tail = cur;
-            tail->next = head[i];
-            return;
+        mini_at(block->mini_prev)->mini_next = block->mini_next;
+        next->mini_prev = block->mini_prev;
+        if (block == arena->head[i]) {
+            arena->head[i] = next;
         }
-        block_t *cur = head[i];
-        while (cur->next != block) {
-            cur = cur->next;
-        }
-        cur->next = block->next;
-        block->next = NULL;
         return;
     }
 
     // if there is only 1 free block in the list.
     if (block->next == block->prev && block->next == block &&
         block->prev == block) {
-        head[i] = NULL;
+        arena->head[i] = NULL;
+        arena->nonempty &= ~((word_t)1 << i);
         block->next = NULL;
         block->prev = NULL;
         return;
     }
 
     // if block == root
-    if (block == head[i]) {
-        head[i] = head[i]->next;
-        head[i]->prev = block->prev;
-        block->prev->next = head[i];
+    if (block == arena->head[i]) {
+        arena->head[i] = arena->head[i]->next;
+        arena->head[i]->prev = block->prev;
+        block->prev->next = arena->head[i];
         block->next = NULL;
         block->prev = NULL;
         return;
@@ -559,33 +1891,45 @@ static void removeFree(block_t *block) {
  * @param[in] block
  * @return
  */
-static void addFree(block_t *block) {
+static void addFree(arena_t *arena, block_t *block) {
     dbg_requires(block != NULL);
+    stats_list(arena, block, true);
+    check_log_add(block, 0);
+    if (fit_mode == MM_FIT_TLSF && get_size(block) != min_block_size) {
+        tlsf_insert(arena, block);
+        return;
+    }
+
     size_t i = getHead(get_size(block));
+    if (i == TREE_CLASS) {
+        tree_insert(arena, block);
+        arena->nonempty |= (word_t)1 << i;
+        return;
+    }
 
-    // mini block
+    // mini block, appended at the tail (FIFO)
     if (i == 0) {
-        if (head[i] != NULL) {
-            if (block != NULL) {
-                block->next = head[i];
-                // FIFO
-                tail->next = block;
-                tail = block;
-                return;
-            }
+        uint32_t link = mini_link(block);
+        block_t *head = arena->head[i];
+        if (head != NULL) {
+            block->mini_next = mini_link(head);
+            block->mini_prev = head->mini_prev;
+            mini_at(head->mini_prev)->mini_next = link;
+            head->mini_prev = link;
         } else {
-            head[i] = block;
-            block->next = block;
-            tail = block;
-            return;
+            arena->head[i] = block;
+            arena->nonempty |= (word_t)1 << i;
+            block->mini_next = link;
+            block->mini_prev = link;
         }
+        return;
     }
 
-    if (head[i] != NULL) {
+    if (arena->head[i] != NULL) {
         if (block != NULL) {
-            block->next = head[i];
-            block->prev = head[i]->prev;
-            head[i]->prev = block;
+            block->next = arena->head[i];
+            block->prev = arena->head[i]->prev;
+            arena->head[i]->prev = block;
             if (block->prev != NULL) {
                 block->prev->next = block;
             } else {
@@ -599,9 +1943,10 @@ static void addFree(block_t *block) {
         }
 
     } else {
-        head[i] = block;
-        head[i]->next = block;
-        head[i]->prev = block;
+        arena->head[i] = block;
+        arena->nonempty |= (word_t)1 << i;
+        arena->head[i]->next = block;
+        arena->head[i]->prev = block;
     }
 }
 
@@ -610,20 +1955,52 @@ static void addFree(block_t *block) {
  * @param[in] asize
  * @return
  */
-static block_t *find_first_free(size_t asize) {
-    for (size_t i = getHead(asize); i < NUMCLASS; i++) {
+static block_t *find_first_free(arena_t *arena, size_t asize) {
+    arena->counters.fit_searches++;
+    if (fit_mode == MM_FIT_TLSF) {
+        // Mini blocks are still kept on their own list
+        if (asize == min_block_size && arena->head[0] != NULL) {
+            return arena->head[0];
+        }
+        return tlsf_find(arena, asize);
+    }
 
-        if (head[i] == NULL) {
-            continue;
+    size_t prev = getHead(asize);
+    word_t classes = arena->nonempty & (~(word_t)0 << prev);
+    for (; classes != 0; classes &= classes - 1) {
+        size_t i = (size_t)__builtin_ctzll(classes);
+
+        // Empty classes the bitmap let us jump over
+        arena->counters.fit_skipped += i - prev;
+        prev = i + 1;
+
+        if (i == TREE_CLASS) {
+            return tree_best_fit(arena, asize);
         }
 
-        block_t *block = head[i];
+        // Take the tightest of the first fit_candidates fitting blocks
+        block_t *best = NULL;
+        unsigned int seen = 0;
+        block_t *block = arena->head[i];
         do {
-            if (!(get_alloc(block)) && (asize <= get_size(block))) {
-                return block;
+            size_t size = get_size(block);
+            if (!(get_alloc(block)) && (asize <= size)) {
+                if (best == NULL || size < get_size(best)) {
+                    best = block;
+                }
+                if (size == asize || ++seen >= fit_candidates) {
+                    break;
+                }
+            } else {
+                arena->counters.fit_scanned++;
             }
+            // (Never reached for mini blocks, which always fit)
             block = block->next;
-        } while (block != head[i]);
+        } while (block != arena->head[i]);
+
+        if (best != NULL) {
+            return best;
+        }
     }
 
     return NULL; // no fit found
@@ -640,7 +2017,7 @@ static block_t *find_first_free(size_t asize) {
  * @param[in] block
  * @return
  */
-static block_t *coalesce_block(block_t *block) {
+static block_t *coalesce_block(arena_t *arena, block_t *block) {
 
     block_t *prevBlock = NULL;
     block_t *nextBlock = find_next(block);
@@ -666,7 +2043,7 @@ static block_t *coalesce_block(block_t *block) {
     if (prevAlloc && nextAlloc) {
         newSize = get_size(block);
         write_block(block, newSize, false, true, getPrevMiniStatus(block));
-        addFree(block);
+        addFree(arena, block);
 
         // nextBlock should mark the block as free
         if (get_size(block) == min_block_size) {
@@ -679,21 +2056,21 @@ static block_t *coalesce_block(block_t *block) {
 
     // case 2, next is free, prev is alloc
     else if (prevAlloc && (!nextAlloc)) {
-        removeFree(nextBlock);
+        removeFree(arena, nextBlock);
         newSize = get_size(block) + get_size(nextBlock);
         write_block(block, newSize, false, true, getPrevMiniStatus(block));
         // pack the true next block's mini bit as false
         block_t *true_next_block = find_next(block);
         write_block(true_next_block, get_size(true_next_block), true, false,
                     false);
-        addFree(block);
+        addFree(arena, block);
 
         return block;
     }
 
     // case 3, next is alloc, prev is free
     else if ((!prevAlloc) && nextAlloc) {
-        removeFree(prevBlock);
+        removeFree(arena, prevBlock);
         newSize = get_size(block) + get_size(prevBlock);
         // the prev of prevBlock is allocated
         write_block(prevBlock, newSize, false, true,
@@ -703,15 +2080,15 @@ static block_t *coalesce_block(block_t *block) {
         // mark the next block mini bit as false
         write_block(nextBlock, get_size(nextBlock), true, false, false);
 
-        addFree(prevBlock);
+        addFree(arena, prevBlock);
 
         return prevBlock;
     }
 
     // case 4, both are free
     else {
-        removeFree(prevBlock);
-        removeFree(nextBlock);
+        removeFree(arena, prevBlock);
+        removeFree(arena, nextBlock);
         newSize = get_size(block) + get_size(prevBlock) + get_size(nextBlock);
 
         write_block(prevBlock, newSize, false, true,
@@ -719,51 +2096,140 @@ static block_t *coalesce_block(block_t *block) {
         block_t *true_next_block = find_next(prevBlock);
         write_block(true_next_block, get_size(true_next_block), true, false,
                     false);
-        addFree(prevBlock);
+        addFree(arena, prevBlock);
 
         return prevBlock;
     }
 }
 
 /**
- * @brief
+ * @brief Unmaps every freed mapping kept for reuse.
  *
- * <What does this function do?>
- * <What are the function's arguments?>
- * <What is the function's return value?>
- * <Are there any preconditions or postconditions?>
+ * Cached mappings are given back before the heap or the mappings grow, so
+ * that they never add to the peak memory use.
  *
- * @param[in] size
- * @return
+ * @pre The caller holds heap_lock.
  */
-static block_t *extend_heap(size_t size) {
-    void *bp;
-
-    // Allocate an even number of words to maintain alignment
-    size = round_up(size, dsize);
-    if ((bp = mem_sbrk(size)) == (void *)-1) {
-        return NULL;
+static void mmap_cache_flush(void) {
+    while (mmap_ncached > 0) {
+        block_t *block = mmap_cache[--mmap_ncached];
+        mmap_bytes -= get_size(block);
+        mem_munmap((char *)block - wsize, get_size(block));
     }
+}
 
-    // Initialize free block header/footer
-    block_t *block = payload_to_header(bp);
-
-    // when extending heap, keep the prevAlloc bit.
-    write_block(block, size, false, getPrevAlloc(block),
-                getPrevMiniStatus(block));
-
-    // Create new epilogue header
-    block_t *block_next = find_next(block);
-    write_epilogue(block_next);
+/**
+ * @brief Picks how far to extend an arena whose free lists had no fit.
+ *
+ * The extension doubles while the arena runs out of space within
+ * grow_window searches of its last extension, and halves for every quiet
+ * window since then. It never exceeds an eighth of the arena, so small
+ * heaps still grow a page at a time, nor grow_max or trim_threshold, past
+ * which free would give the space straight back.
+ *
+ * @param[in] arena
+ * @return The number of bytes to extend by, at least chunksize
+ * @pre The caller holds the arena's lock.
+ */
+static size_t grow_step(arena_t *arena) {
+    size_t elapsed = arena->counters.fit_searches - arena->grow_mark;
+    size_t size = arena->grow_size;
+    if (elapsed <= grow_window) {
+        size *= 2;
+    } else {
+        elapsed /= grow_window;
+        size = elapsed < 64 ? size >> elapsed : 0;
+    }
 
-    // Coalesce in case the previous block was free
-    block = coalesce_block(block);
+    size_t cap = arena->heap_size / 8;
+    cap = cap < grow_max ? cap : grow_max;
+    if (trim_threshold != 0 && cap > trim_threshold) {
+        cap = trim_threshold;
+    }
+    size = size < cap ? size : cap;
+    size = max(round_up(size, dsize), chunksize);
 
-    return block;
+    arena->grow_size = size;
+    arena->grow_mark = arena->counters.fit_searches;
+    return size;
 }
 
 /**
- * @brief
+ * @brief Extends an arena by at least `size` bytes of free space.
+ *
+ * If the arena's last segment ends at the brk it grows in place, and the new
+ * space is coalesced with a free block at its end. Otherwise a new segment,
+ * with its own prologue and epilogue, is started at the brk.
+ *
+ * @param[in] arena
+ * @param[in] size
+ * @return The free block holding the new space, or NULL if the heap cannot
+ *         grow
+ * @pre The caller holds the arena's lock.
+ */
+static block_t *extend_heap(arena_t *arena, size_t size) {
+    void *bp;
+    block_t *block;
+
+    // Allocate an even number of words to maintain alignment
+    size = round_up(size, dsize);
+
+    lock_heap();
+    bool grow = arena->epilogue != NULL &&
+                (char *)arena->epilogue == (char *)mem_heap_hi() - 7;
+#if MAX_ARENAS > 1
+    if (!grow && nsegments == MAX_SEGMENTS) {
+        unlock_heap();
+        return NULL;
+    }
+#endif
+    // Mini block links cannot reach beyond MINI_SPAN
+    if ((size_t)((char *)mem_heap_hi() + 1 - mini_base) + size + dsize >
+        MINI_SPAN) {
+        unlock_heap();
+        return NULL;
+    }
+    mmap_cache_flush();
+    if ((bp = mem_sbrk(grow ? size : size + dsize)) == (void *)-1) {
+        unlock_heap();
+        return NULL;
+    }
+
+    if (grow) {
+        // The old epilogue becomes the header of the new block
+        block = payload_to_header(bp);
+        arena->zero_from = bp;
+    } else {
+        word_t *prologue = (word_t *)bp;
+        *prologue = pack(0, true, true); // Segment prologue (block footer)
+        check_mark(prologue, wsize, NULL);
+        block = (block_t *)(prologue + 1);
+        block->header = pack(0, true, true);
+        add_segment((char *)prologue, arena);
+        arena->zero_from = (char *)block;
+    }
+    unlock_heap();
+    arena->heap_size += grow ? size : size + dsize;
+    arena->counters.heap_extends++;
+    arena->counters.heap_extended += grow ? size : size + dsize;
+
+    // when extending heap, keep the prevAlloc bit.
+    write_block(block, size, false, getPrevAlloc(block),
+                getPrevMiniStatus(block));
+
+    // Create new epilogue header
+    block_t *block_next = find_next(block);
+    write_epilogue(block_next);
+    arena->epilogue = block_next;
+
+    // Coalesce in case the previous block was free
+    block = coalesce_block(arena, block);
+
+    return block;
+}
+
+/**
+ * @brief
  *
  * <What does this function do?>
  * <What are the function's arguments?>
@@ -773,7 +2239,7 @@ static block_t *extend_heap(size_t size) {
  * @param[in] block
  * @param[in] asize
  */
-static void split_block(block_t *block, size_t asize) {
+static void split_block(arena_t *arena, block_t *block, size_t asize) {
     dbg_requires(get_alloc(block));
 
     size_t block_size = get_size(block);
@@ -801,7 +2267,7 @@ static void split_block(block_t *block, size_t asize) {
                         get_alloc(next_next_block), false, true);
         }
 
-        addFree(block_next);
+        addFree(arena, block_next);
     } else {
         block_t *block_next = find_next(block);
         if (block_size == min_block_size) {
@@ -814,249 +2280,264 @@ static void split_block(block_t *block, size_t asize) {
 }
 
 /**
- * @brief
- *
- * find first suitable block
- *
- * @param[in] asize
- * @return
+ * @brief Moves an arena's zero watermark above a block that was just
+ *        allocated.
+ * @param[in] arena
+ * @param[in] block
  */
-static block_t *find_fit(size_t asize) {
-    block_t *block;
-
-    for (block = heap_start; get_size(block) > 0; block = find_next(block)) {
-
-        if (!(get_alloc(block)) && (asize <= get_size(block))) {
-            return block;
-        }
+static void raise_zero_from(arena_t *arena, block_t *block) {
+    char *end = (char *)block + get_size(block);
+    if (end > arena->zero_from) {
+        arena->zero_from = end;
     }
-    return NULL; // no fit found
 }
 
 /**
- * @brief
- *
- * Print out current blocks of the heap
- *
- * @param[in] asize
- * @return
+ * @brief Returns the size of the free block in front of an arena's last
+ *        epilogue.
+ * @param[in] arena
+ * @return The block size, or 0 if the last block of the arena is allocated
  */
-void printHeap(int __line__) {
-    printf("line num: %d current heap: \n", __line__);
-    for (block_t *block = heap_start; get_size(block) > 0;
-         block = find_next(block)) {
-        printf("block is: %p size is: %lu curAlloc: %d prevAlloc: %d, "
-               "prevMini: %d \n",
-               block, extract_size(block->header), get_alloc(block),
-               getPrevAlloc(block), getPrevMiniStatus(block));
+static size_t top_free(arena_t *arena) {
+    block_t *epilogue = arena->epilogue;
+    if (epilogue == NULL || getPrevAlloc(epilogue)) {
+        return 0;
     }
+    if (getPrevMiniStatus(epilogue)) {
+        return min_block_size;
+    }
+    return get_size(find_prev(epilogue));
 }
 
 /**
- * @brief
+ * @brief Gives the top of the heap back to memlib if it is a free block of
+ *        more than trim_threshold bytes.
  *
- * check the heap
- * @param[in] line
- * @return
+ * Only the arena whose last segment ends at the brk can shrink the heap. The
+ * block is cut back to trim_threshold bytes rather than to nothing, so that
+ * a heap hovering around its size does not shrink and grow on every call.
+ *
+ * @param[in] arena
+ * @param[in] block A free block of the arena
+ * @pre The caller holds the arena's lock.
  */
-bool mm_checkheap(int line) {
-
-    // // Check each block specific features.
-    size_t count = 0;
-
-    for (block_t *block = heap_start; get_size(block) > 0;
-         block = find_next(block)) {
-
-        // check prologue and epilogue
-        if (get_size(mem_heap_hi() - 7) != 0 &&
-            get_alloc(mem_heap_hi() - 7) != true &&
-            get_size(mem_heap_lo()) != 0 && get_alloc(mem_heap_lo()) != true) {
-            return false;
-        }
-
-        // address alignment
-        if ((size_t)header_to_payload(block) % dsize != 0) {
-            return false;
-        }
-
-        // Check heap boundaries
-        if (block < (block_t *)mem_heap_lo() &&
-            block > (block_t *)mem_heap_hi()) {
-            return false;
-        }
-
-        // Check consecutive free blocks
-        block_t *prevBlock = find_prev(block);
-        block_t *nextBlock = find_next(block);
-
-        // check header and footer consistency
-        if (extract_size(block->header) !=
-            extract_size(*header_to_footer(block))) {
-            return false;
-        }
-
-        if (extract_alloc(block->header) !=
-            extract_alloc(*header_to_footer(block))) {
-            return false;
-        }
-
-        // no consecutive free blocks1
-        if (prevBlock) {
-            if (get_alloc(prevBlock) == 0 && get_alloc(block) == 0) {
-                return false;
-            }
-        }
-
-        // // no consecutive free blocks2
-        if (nextBlock) {
-            if (get_alloc(nextBlock) == 0 && get_alloc(block) == 0) {
-                return false;
-            }
-        }
-
-        // block size check
-        if (get_size(block) < min_block_size) {
-            return false;
-        }
-
-        // count free block numbers
-        if (!get_alloc(block)) {
-            count += 1;
-        }
+static void trim_heap(arena_t *arena, block_t *block) {
+    size_t size = get_size(block);
+    size_t keep = round_up(max(trim_threshold, chunksize), dsize);
+    if (trim_threshold == 0 || size <= keep ||
+        find_next(block) != arena->epilogue) {
+        return;
     }
 
-    // Seglist checker
-    for (int i = 0; i < NUMCLASS; i++) {
-        if (head[i] == NULL) {
-            continue;
-        }
-        block_t *block = head[i];
+    lock_heap();
+    if ((char *)arena->epilogue != (char *)mem_heap_hi() - 7) {
+        unlock_heap();
+        return;
+    }
+    removeFree(arena, block);
+    write_block(block, keep, false, getPrevAlloc(block),
+                getPrevMiniStatus(block));
+    block_t *epilogue = find_next(block);
+    write_epilogue(epilogue);
+    mem_sbrk(-(intptr_t)(size - keep));
+    unlock_heap();
+
+    addFree(arena, block);
+    arena->epilogue = epilogue;
+    arena->heap_size -= size - keep;
+    arena->counters.heap_trims++;
+    arena->counters.heap_trimmed += size - keep;
+    arena->trim_pending = 0;
+
+    // The heap stopped growing, so extensions start small again
+    arena->grow_size = chunksize;
+}
 
-        // current class size
-        size_t curSize = (size_t)1 << (i + 6);
-        do {
+/* Defined further down; both free blocks through free_block */
+static bool tcache_reclaim(arena_t *arena);
+static void defer_merge(arena_t *arena);
 
-            // Check all next/prev pointers
-            if (block->prev) {
-                if (block->prev->next != block) {
-                    return false;
-                }
-            }
+/**
+ * @brief Takes back the blocks that were freed but are still marked
+ *        allocated, and trims the heap again. Called when the top of the
+ *        heap is a free block that was not trimmed.
+ *
+ * Blocks in the calling thread's cache and on the quick lists (and the slab
+ * runs their objects keep alive) can sit between the top of the heap and
+ * the free space below it long after the program freed them. Taking them
+ * back costs the cache its hits, so it is done at most once per
+ * trim_threshold bytes freed into the arena since it last shrank.
+ *
+ * @param[in] arena
+ * @pre The caller holds the arena's lock.
+ */
+static void trim_reclaim(arena_t *arena) {
+    // (freeing the blocks taken back comes back here)
+    if (trim_threshold == 0 || arena->trim_reclaiming ||
+        arena->trim_pending < trim_threshold) {
+        return;
+    }
+    arena->trim_pending = 0;
+    arena->trim_reclaiming = true;
+    bool reclaimed = tcache_reclaim(arena);
+    if (arena->ndeferred > 0) {
+        defer_merge(arena);
+        reclaimed = true;
+    }
+    arena->trim_reclaiming = false;
 
-            if (block->next) {
-                if (block->next->prev != block) {
-                    return false;
-                }
-            }
+    size_t top = top_free(arena);
+    if (reclaimed && top > 0) {
+        trim_heap(arena, (block_t *)((char *)arena->epilogue - top));
+    }
+}
 
-            // All free list pointers are between mem heap lo() and mem heap
-            // high()
-            if (block < (block_t *)mem_heap_lo() &&
-                block > (block_t *)mem_heap_hi()) {
-                return false;
-            }
+/**
+ * @brief Marks an allocated block as free and returns it to the free lists,
+ *        coalescing it with its neighbors, and trims the heap if that leaves
+ *        a large free block at its top.
+ *
+ * @param[in] arena The arena owning the block
+ * @param[in] block An allocated block
+ * @pre The caller holds the arena's lock.
+ */
+static void free_block(arena_t *arena, block_t *block) {
+    size_t size = get_size(block);
 
-            // Count free blocks by iterating
-            if (!get_alloc(block)) {
-                count -= 1;
-            }
+    // The block should be marked as allocated
+    dbg_assert(get_alloc(block));
 
-            // All blocks in each list bucket fall within bucket size range
-            if (get_size(block) > curSize && curSize != ((size_t)1 << 14)) {
-                dbg_printf("get_size is: %lu, curSize is: %lu \n",
-                           get_size(block), curSize);
-                return false;
-            }
+    // Mark the block as free
+    write_block(block, size, false, getPrevAlloc(block),
+                getPrevMiniStatus(block));
 
-            block = block->next;
-        } while (block != head[i]);
+    // Try to coalesce the block with its neighbors
+    block = coalesce_block(arena, block);
+    arena->trim_pending += size;
+    trim_heap(arena, block);
+    if (find_next(block) == arena->epilogue) {
+        trim_reclaim(arena);
     }
+}
 
-    if (count != 0) {
-        return false;
+/**
+ * @brief Coalesces every deferred block of an arena into the free lists.
+ * @param[in] arena
+ * @pre The caller holds the arena's lock.
+ */
+static void defer_merge(arena_t *arena) {
+    if (arena->ndeferred == 0) {
+        return;
     }
-
-    return true;
+    for (size_t i = 0; i < DEFER_BINS; i++) {
+        while (arena->quick[i] != NULL) {
+            block_t *block = arena->quick[i];
+            arena->quick[i] = block->next;
+            free_block(arena, block);
+        }
+    }
+    arena->counters.defer_merges++;
+    arena->counters.defer_merged += arena->ndeferred;
+    arena->ndeferred = 0;
 }
 
 /**
- * @brief
- *
- * <What does this function do?>
- * <What are the function's arguments?>
- * <What is the function's return value?>
- * <Are there any preconditions or postconditions?>
+ * @brief Frees a block, deferring its coalescing in deferred mode.
  *
- * @return
+ * @param[in] arena The arena owning the block
+ * @param[in] block An allocated block
+ * @pre The caller holds the arena's lock.
  */
-bool mm_init(void) {
-    // Create the initial empty heap
-    word_t *start = (word_t *)(mem_sbrk(2 * wsize));
-    for (int i = 0; i < NUMCLASS; i++) {
-        head[i] = NULL;
-    }
-    tail = NULL;
-    if (start == (void *)-1) {
-        return false;
+static void defer_block(arena_t *arena, block_t *block) {
+    size_t size = get_size(block);
+    if (!defer_enabled || size > defer_max_size) {
+        free_block(arena, block);
+        return;
     }
 
-    start[0] = pack(0, true, true); // Heap prologue (block footer)
-    start[1] = pack(0, true, true); // Heap epilogue (block header)
-
-    // Heap starts with first "block header", currently the epilogue
-    heap_start = (block_t *)&(start[1]);
-
-    // Extend the empty heap with a free block of chunksize bytes
-    if (extend_heap(chunksize) == NULL) {
-        return false;
+    // A block at the top of the heap, or right under a free block there,
+    // is coalesced at once: deferred, it would keep the top from growing
+    // and being trimmed (and trim_reclaim from merging the others)
+    block_t *next = find_next(block);
+    if (next == arena->epilogue ||
+        (!get_alloc(next) && find_next(next) == arena->epilogue)) {
+        free_block(arena, block);
+        return;
     }
 
-    // add the first free block to freelist?
-    // addFree(heap_start);
-
-    return true;
+    dbg_assert(get_alloc(block));
+    if (arena->ndeferred >= defer_limit) {
+        defer_merge(arena);
+    }
+    size_t i = size / dsize - 1;
+    block->next = arena->quick[i];
+    arena->quick[i] = block;
+    arena->ndeferred++;
+    arena->counters.defer_frees++;
+    arena->trim_pending += size;
+    if (top_free(arena) > 0) {
+        trim_reclaim(arena);
+    }
 }
 
 /**
- * @brief
+ * @brief Takes a block of `asize` bytes from the free lists and marks it
+ *        allocated, extending the heap when no free block fits.
  *
- * @param[in] size
- * @return
+ * @param[in] arena
+ * @param[in] asize Adjusted block size, including the header
+ * @param[out] zero If not NULL, receives the arena's zero watermark from
+ *             before the allocation
+ * @return The allocated block, or NULL if the heap cannot be extended
+ * @pre The caller holds the arena's lock.
  */
-void *malloc(size_t size) {
-    dbg_requires(mm_checkheap(__LINE__));
-
-    size_t asize;      // Adjusted block size
+static block_t *alloc_block(arena_t *arena, size_t asize, char **zero) {
     size_t extendsize; // Amount to extend heap if no fit is found
     block_t *block;
-    void *bp = NULL;
-
-    // Initialize heap if it isn't initialized
-    if (heap_start == NULL) {
-        mm_init();
-    }
 
-    // Ignore spurious request
-    if (size == 0) {
-        dbg_ensures(mm_checkheap(__LINE__));
-        return bp;
+    // A deferred block of this size is still allocated: hand it out as is
+    if (asize <= defer_max_size && arena->ndeferred > 0) {
+        block_t **quick = &arena->quick[asize / dsize - 1];
+        block = *quick;
+        if (block != NULL) {
+            *quick = block->next;
+            arena->ndeferred--;
+            arena->counters.defer_hits++;
+            if (zero != NULL) {
+                *zero = arena->zero_from;
+            }
+            return block;
+        }
     }
 
-    // Adjust block size to include overhead and to meet alignment requirements
-    asize = round_up(size + wsize, dsize);
-
     // Search the free list for a fit
-    // block = find_fit(asize);
-    block = find_first_free(asize);
+    block = find_first_free(arena, asize);
+
+    // Take back this thread's cached blocks and coalesce deferred ones
+    // before giving up on the free lists: both are still marked allocated,
+    // and would keep the heap growing around them
+    if (block == NULL && tcache_reclaim(arena)) {
+        block = find_first_free(arena, asize);
+    }
+    if (block == NULL && arena->ndeferred > 0) {
+        defer_merge(arena);
+        block = find_first_free(arena, asize);
+    }
 
     // If no fit is found, request more memory, and then and place the block
     if (block == NULL) {
-        // Always request at least chunksize
-        extendsize = max(asize, chunksize);
-        block = extend_heap(extendsize);
+        // Request at least the growth step, less a free block at the top
+        // that the new space will be coalesced with
+        size_t top = top_free(arena);
+        extendsize = max(asize > top ? asize - top : 0, grow_step(arena));
+        block = extend_heap(arena, extendsize);
+        // (another arena may have taken the brk, so the top stayed apart)
+        while (block != NULL && get_size(block) < asize) {
+            block = extend_heap(arena, asize - get_size(block));
+        }
         // extend_heap returns an error
         if (block == NULL) {
-            return bp;
+            return NULL;
         }
     }
 
@@ -1064,135 +2545,3539 @@ void *malloc(size_t size) {
     dbg_assert(!get_alloc(block));
 
     // remove from current free list
-    removeFree(block);
+    removeFree(arena, block);
 
     // Mark block as allocated
     size_t block_size = get_size(block);
     write_block(block, block_size, true, true, getPrevMiniStatus(block));
 
     // Try to split the block if too large
-    split_block(block, asize);
+    split_block(arena, block, asize);
 
-    bp = header_to_payload(block);
+    // The block may now be written to
+    if (zero != NULL) {
+        *zero = arena->zero_from;
+    }
+    raise_zero_from(arena, block);
 
-    dbg_ensures(mm_checkheap(__LINE__));
-    return bp;
+    return block;
 }
 
 /**
- * @brief
+ * @brief Shrinks an allocated block to `asize` bytes, freeing the rest of
+ *        it if that is large enough to make a block.
  *
- * <What does this function do?>
- * <What are the function's arguments?>
- * <What is the function's return value?>
- * <Are there any preconditions or postconditions?>
- *
- * @param[in] bp
+ * @param[in] arena The arena owning the block
+ * @param[in] block An allocated block of at least `asize` bytes
+ * @param[in] asize
  */
-void free(void *bp) {
-
-    if (bp == NULL) {
-        return;
+static void shrink_block(arena_t *arena, block_t *block, size_t asize) {
+    size_t size = get_size(block);
+    dbg_requires(get_alloc(block) && size >= asize);
+
+    if (size - asize >= min_block_size) {
+        write_block(block, asize, true, getPrevAlloc(block),
+                    getPrevMiniStatus(block));
+        block_t *rest = find_next(block);
+        write_block(rest, size - asize, true, true, asize == min_block_size);
+        free_block(arena, rest);
     }
+}
 
-    block_t *block = payload_to_header(bp);
+/**
+ * @brief Tries to resize an allocated block to `asize` bytes in place: by
+ *        splitting its tail off, or by absorbing the free block after it.
+ *
+ * A block at the end of its segment is not grown by extending the heap:
+ * that raises the heap's peak by whatever the block had to grow, where
+ * moving it can reuse a hole further down.
+ *
+ * @param[in] arena The arena owning the block
+ * @param[in] block An allocated block
+ * @param[in] asize
+ * @return True if the block now holds at least `asize` bytes
+ * @pre The caller holds the arena's lock.
+ */
+static bool resize_block(arena_t *arena, block_t *block, size_t asize) {
     size_t size = get_size(block);
 
-    // The block should be marked as allocated
-    dbg_assert(get_alloc(block));
+    if (asize <= size) {
+        shrink_block(arena, block, asize);
+        arena->counters.realloc_shrinks++;
+        return true;
+    }
 
-    // Mark the block as free
-    write_block(block, size, false, getPrevAlloc(block),
+    // Absorb the free successor if the two together are large enough
+    block_t *next = find_next(block);
+    if (get_alloc(next) || size + get_size(next) < asize) {
+        return false;
+    }
+    size_t avail = size + get_size(next);
+    removeFree(arena, next);
+    write_block(block, avail, true, getPrevAlloc(block),
                 getPrevMiniStatus(block));
+    block_t *after = find_next(block);
+    write_block(after, get_size(after), get_alloc(after), true, false);
 
-    // Try to coalesce the block with its neighbors
-    block = coalesce_block(block);
-
-    dbg_ensures(mm_checkheap(__LINE__));
+    shrink_block(arena, block, asize);
+    raise_zero_from(arena, block);
+    arena->counters.realloc_grows++;
+    return true;
 }
 
 /**
- * @brief
+ * @brief Allocates a block of at least `asize` bytes whose payload is aligned
+ *        to `align` bytes.
  *
- * <What does this function do?>
- * <What are the function's arguments?>
- * <What is the function's return value?>
- * <Are there any preconditions or postconditions?>
+ * Over-allocates by `align` bytes, then gives back the gap in front of the
+ * aligned payload (always either empty or big enough to be a free block)
+ * and whatever is left behind the block.
  *
- * @param[in] ptr
- * @param[in] size
- * @return
+ * @param[in] arena
+ * @param[in] asize Adjusted block size, including the header
+ * @param[in] align A power of two, at least dsize
+ * @return The allocated block, or NULL if the heap cannot be extended
+ * @pre The caller holds the arena's lock.
  */
-void *realloc(void *ptr, size_t size) {
-    block_t *block = payload_to_header(ptr);
-    size_t copysize;
-    void *newptr;
-
-    // If size == 0, then free block and return NULL
-    if (size == 0) {
-        free(ptr);
+static block_t *alloc_aligned(arena_t *arena, size_t asize, size_t align) {
+    block_t *block = alloc_block(arena, asize + align, NULL);
+    if (block == NULL) {
         return NULL;
     }
 
-    // If ptr is NULL, then equivalent to malloc
-    if (ptr == NULL) {
-        return malloc(size);
+    // Cut the block in two at the aligned payload, keeping both halves
+    // allocated until the end so that nothing coalesces in between
+    size_t bp = (size_t)header_to_payload(block);
+    size_t gap = round_up(bp, align) - bp;
+    block_t *aligned = block;
+    if (gap > 0) {
+        size_t size = get_size(block);
+        aligned = (block_t *)((char *)block + gap);
+        write_block(block, gap, true, getPrevAlloc(block),
+                    getPrevMiniStatus(block));
+        write_block(aligned, size - gap, true, true, gap == min_block_size);
     }
 
-    // Otherwise, proceed with reallocation
-    newptr = malloc(size);
+    // Give back the space behind the aligned block...
+    shrink_block(arena, aligned, asize);
 
-    // If malloc fails, the original block is left untouched
-    if (newptr == NULL) {
-        return NULL;
+    // ...and in front of it
+    if (gap > 0) {
+        free_block(arena, block);
     }
 
-    // Copy the old data
-    copysize = get_payload_size(block); // gets size of old payload
-    if (size < copysize) {
-        copysize = size;
+    dbg_ensures(bp + gap == (size_t)header_to_payload(aligned));
+    dbg_ensures((bp + gap) % align == 0);
+    return aligned;
+}
+
+/**
+ * @brief Returns the slab run holding a payload address.
+ *
+ * @param[in] bp A payload returned by malloc
+ * @return The run, or NULL if `bp` is the payload of a regular block
+ */
+static slab_t *slab_of(const void *bp) {
+    size_t page = ((uintptr_t)bp - slab_base) / SLAB_RUN_SIZE;
+    if (page >= SLAB_ZONE / SLAB_RUN_SIZE) {
+        return NULL;
+    }
+#if MM_THREADS
+    word_t word = __atomic_load_n(&slab_pages[page / 64], __ATOMIC_RELAXED);
+#else
+    word_t word = slab_pages[page / 64];
+#endif
+    if (!((word >> (page % 64)) & 1)) {
+        return NULL;
+    }
+    return (slab_t *)(slab_base + page * SLAB_RUN_SIZE);
+}
+
+/**
+ * @brief Marks or unmarks the page of a slab run in slab_pages.
+ *
+ * Runs of other arenas may be marked at the same time, hence the atomic
+ * updates in the thread-safe build.
+ *
+ * @param[in] run
+ * @param[in] mark
+ */
+static void slab_mark(slab_t *run, bool mark) {
+    size_t page = ((uintptr_t)run - slab_base) / SLAB_RUN_SIZE;
+    word_t bit = (word_t)1 << (page % 64);
+#if MM_THREADS
+    if (mark) {
+        __atomic_fetch_or(&slab_pages[page / 64], bit, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_and(&slab_pages[page / 64], ~bit, __ATOMIC_RELAXED);
+    }
+#else
+    if (mark) {
+        slab_pages[page / 64] |= bit;
+    } else {
+        slab_pages[page / 64] &= ~bit;
+    }
+#endif
+}
+
+/**
+ * @brief Returns the slab class serving a request.
+ * @param[in] size A request of 1 to SLAB_MAX bytes
+ * @return The class index
+ */
+static size_t slab_class(size_t size) {
+    dbg_requires(size > 0 && size <= SLAB_MAX);
+    return (size - 1) / 16;
+}
+
+/**
+ * @brief Returns the object size of a slab class.
+ * @param[in] cls
+ * @return The size of the objects of the class, in bytes
+ */
+static size_t slab_size(size_t cls) {
+    return (cls + 1) * 16;
+}
+
+/**
+ * @brief Returns the address of object `i` of a run.
+ * @param[in] run
+ * @param[in] i
+ * @return The object's payload
+ */
+static void *slab_object(slab_t *run, size_t i) {
+    return (char *)(run + 1) + i * run->size;
+}
+
+/**
+ * @brief Removes a run from its arena's list of runs with free slots.
+ * @param[in] arena
+ * @param[in] run
+ */
+static void slab_unlink(arena_t *arena, slab_t *run) {
+    if (run->prev != NULL) {
+        run->prev->next = run->next;
+    } else {
+        arena->slabs[slab_class(run->size)] = run->next;
+    }
+    if (run->next != NULL) {
+        run->next->prev = run->prev;
+    }
+    run->next = NULL;
+    run->prev = NULL;
+}
+
+/**
+ * @brief Puts a run at the front of its arena's list of runs with free
+ *        slots.
+ * @param[in] arena
+ * @param[in] run
+ */
+static void slab_link(arena_t *arena, slab_t *run) {
+    slab_t **list = &arena->slabs[slab_class(run->size)];
+    run->prev = NULL;
+    run->next = *list;
+    if (*list != NULL) {
+        (*list)->prev = run;
+    }
+    *list = run;
+}
+
+/**
+ * @brief Carves a new run for slab class `cls` out of the arena.
+ *
+ * @param[in] arena
+ * @param[in] cls
+ * @return The run, or NULL if the heap is exhausted or the run would fall
+ *         outside of the slab zone
+ * @pre The caller holds the arena's lock.
+ */
+static slab_t *slab_new(arena_t *arena, size_t cls) {
+    block_t *block = alloc_aligned(arena, SLAB_RUN_SIZE, SLAB_RUN_SIZE);
+    if (block == NULL) {
+        return NULL;
+    }
+    slab_t *run = header_to_payload(block);
+    if ((uintptr_t)run - slab_base >= SLAB_ZONE) {
+        free_block(arena, block);
+        return NULL;
+    }
+
+    run->size = (uint32_t)slab_size(cls);
+    run->nobj = (uint32_t)((SLAB_RUN_SIZE - wsize - sizeof(slab_t)) /
+                           run->size);
+    run->nfree = run->nobj;
+    run->unused = 0;
+    for (size_t i = 0; i < SLAB_MAP_WORDS; i++) {
+        size_t bits = run->nobj > 64 * i ? run->nobj - 64 * i : 0;
+        run->free_map[i] = bits >= 64 ? ~(word_t)0 : ((word_t)1 << bits) - 1;
+    }
+
+    slab_mark(run, true);
+    slab_link(arena, run);
+    arena->counters.slab_runs++;
+    return run;
+}
+
+/**
+ * @brief Allocates an object of slab class `cls` from the arena.
+ *
+ * @param[in] arena
+ * @param[in] cls
+ * @return The object, or NULL if the arena is too small for slab runs or no
+ *         run could be made
+ * @pre The caller holds the arena's lock.
+ */
+static void *slab_alloc(arena_t *arena, size_t cls) {
+    slab_t *run = arena->slabs[cls];
+    if (run == NULL) {
+        if (arena->heap_size < slab_min_heap) {
+            return NULL;
+        }
+        if ((run = slab_new(arena, cls)) == NULL) {
+            return NULL;
+        }
+    }
+
+    size_t w = 0;
+    while (run->free_map[w] == 0) {
+        w++;
+    }
+    size_t bit = (size_t)__builtin_ctzll(run->free_map[w]);
+    run->free_map[w] &= run->free_map[w] - 1;
+    if (--run->nfree == 0) {
+        slab_unlink(arena, run);
+    }
+    arena->slab_live++;
+    return slab_object(run, w * 64 + bit);
+}
+
+/**
+ * @brief Allocates up to `n` objects of slab class `cls` from the arena,
+ *        taking every free slot of a run in one pass over its map.
+ *
+ * @param[in] arena
+ * @param[in] cls
+ * @param[out] out Receives the objects
+ * @param[in] n
+ * @return The number of objects allocated, fewer than `n` if the arena is
+ *         too small for slab runs or no run could be made
+ * @pre The caller holds the arena's lock.
+ */
+static size_t slab_alloc_batch(arena_t *arena, size_t cls, void **out,
+                               size_t n) {
+    size_t got = 0;
+    while (got < n) {
+        slab_t *run = arena->slabs[cls];
+        if (run == NULL) {
+            if (arena->heap_size < slab_min_heap) {
+                break;
+            }
+            if ((run = slab_new(arena, cls)) == NULL) {
+                break;
+            }
+        }
+
+        for (size_t w = 0; w < SLAB_MAP_WORDS && got < n; w++) {
+            word_t map = run->free_map[w];
+            while (map != 0 && got < n) {
+                size_t bit = (size_t)__builtin_ctzll(map);
+                map &= map - 1;
+                out[got++] = slab_object(run, w * 64 + bit);
+                run->nfree--;
+                arena->slab_live++;
+            }
+            run->free_map[w] = map;
+        }
+        if (run->nfree == 0) {
+            slab_unlink(arena, run);
+        }
+    }
+    return got;
+}
+
+/**
+ * @brief Frees a slab run, which must be empty, back to the heap.
+ *
+ * @param[in] arena The arena owning the run
+ * @param[in] run
+ * @pre The caller holds the arena's lock.
+ */
+static void slab_release(arena_t *arena, slab_t *run) {
+    dbg_requires(run->nfree == run->nobj);
+
+    slab_unlink(arena, run);
+    slab_mark(run, false);
+    free_block(arena, payload_to_header(run));
+    arena->counters.slab_releases++;
+}
+
+/**
+ * @brief Frees a slab object, and the run holding it once it is empty
+ *        (unless it is the only run of its class with free slots, and the
+ *        arena still has objects out).
+ *
+ * @param[in] arena The arena owning the run
+ * @param[in] run
+ * @param[in] bp The object
+ * @pre The caller holds the arena's lock.
+ */
+static void slab_free(arena_t *arena, slab_t *run, void *bp) {
+    size_t i = (size_t)((char *)bp - (char *)(run + 1)) / run->size;
+    word_t bit = (word_t)1 << (i % 64);
+
+    dbg_requires(bp == slab_object(run, i));
+    dbg_requires(!(run->free_map[i / 64] & bit));
+
+    run->free_map[i / 64] |= bit;
+    if (++run->nfree == 1) {
+        slab_link(arena, run);
+    }
+    dbg_assert(arena->slab_live > 0);
+    if (--arena->slab_live == 0) {
+        // The arena is idle: every run left is empty
+        for (size_t cls = 0; cls < SLAB_CLASSES; cls++) {
+            while (arena->slabs[cls] != NULL) {
+                slab_release(arena, arena->slabs[cls]);
+            }
+        }
+    } else if (run->nfree == run->nobj &&
+               (run->prev != NULL || run->next != NULL)) {
+        slab_release(arena, run);
+    }
+}
+
+/**
+ * @brief Frees a block, or the slab object whose payload follows it.
+ *
+ * Thread caches and remote free stacks hold slab objects as if they were
+ * blocks: through the address a header would have, one word in front of
+ * the object. Only `next` and `payload` (the object itself) may be used;
+ * the "header" is the end of the object before it.
+ *
+ * @param[in] arena The arena owning the block or object
+ * @param[in] block
+ * @pre The caller holds the arena's lock.
+ */
+static void free_object(arena_t *arena, block_t *block) {
+    void *bp = block->payload;
+    slab_t *run = slab_of(bp);
+    if (run != NULL) {
+        slab_free(arena, run, bp);
+    } else {
+        defer_block(arena, block);
+    }
+}
+
+/**
+ * @brief Adds every counter in `src` to the matching counter in `dst`.
+ *
+ * All members of mm_counters_t are size_t, so the struct is summed as an
+ * array and new counters need no change here.
+ *
+ * @param[in,out] dst
+ * @param[in] src
+ */
+static void counters_add(mm_counters_t *dst, const mm_counters_t *src) {
+    size_t *d = (size_t *)dst;
+    const size_t *s = (const size_t *)src;
+    for (size_t i = 0; i < sizeof(mm_counters_t) / sizeof(size_t); i++) {
+        d[i] += s[i];
+    }
+}
+
+/**
+ * @brief Returns the thread cache bin holding blocks of size `asize`.
+ * @param[in] asize A block size no larger than tcache_max_size
+ * @return The bin index
+ */
+static size_t tcache_bin(size_t asize) {
+    dbg_requires(asize >= min_block_size && asize <= tcache_max_size);
+    return asize / dsize - 1;
+}
+
+/**
+ * @brief Takes the most recently cached block out of a thread cache bin.
+ *
+ * @param[in] tc
+ * @param[in] bin
+ * @return The block, or NULL if the bin is empty
+ */
+static block_t *tcache_pop(tcache_t *tc, size_t bin) {
+    block_t *block = tc->bin[bin];
+    if (block != NULL) {
+        tc->bin[bin] = block->next;
+        tc->count[bin]--;
+    }
+    return block;
+}
+
+/**
+ * @brief Returns the thread cache bin an allocated block or slab object is
+ *        cached in.
+ *
+ * @param[in] block The block, or the handle in front of a slab object
+ * @param[in] run The run holding the slab object, or NULL for a block
+ * @return The bin, or TCACHE_ALL_BINS if the block is too large to cache
+ */
+static size_t tcache_bin_of(block_t *block, slab_t *run) {
+    if (run != NULL) {
+        return TCACHE_BINS + slab_class(run->size);
+    }
+    if (get_size(block) <= tcache_max_size) {
+        return tcache_bin(get_size(block));
+    }
+    return TCACHE_ALL_BINS;
+}
+
+#if MAX_ARENAS > 1
+/**
+ * @brief Frees every block on an arena's remote free stack.
+ *
+ * @param[in] arena
+ * @param[in] tc The calling thread's cache, which counts the drain
+ * @pre The caller holds the arena's lock.
+ */
+static void remote_drain(arena_t *arena, tcache_t *tc) {
+    if (__atomic_load_n(&arena->remote, __ATOMIC_RELAXED) == NULL) {
+        return;
+    }
+
+    block_t *block = __atomic_exchange_n(&arena->remote, NULL,
+                                         __ATOMIC_ACQUIRE);
+    size_t n = 0;
+    while (block != NULL) {
+        block_t *next = block->next;
+        free_object(arena, block);
+        block = next;
+        n++;
+    }
+    __atomic_sub_fetch(&arena->nremote, n, __ATOMIC_RELAXED);
+
+    tc->counters.remote_drains++;
+    tc->counters.remote_drained += n;
+}
+
+/**
+ * @brief Pushes an allocated block onto the remote free stack of the arena
+ *        owning it.
+ *
+ * @param[in] arena The arena owning the block
+ * @param[in] block
+ * @param[in] tc The calling thread's cache, which counts the free
+ */
+static void remote_push(arena_t *arena, block_t *block, tcache_t *tc) {
+    block_t *top = __atomic_load_n(&arena->remote, __ATOMIC_RELAXED);
+    do {
+        block->next = top;
+    } while (!__atomic_compare_exchange_n(&arena->remote, &top, block, true,
+                                          __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+
+    // Nobody may be allocating from the arena any more to drain it
+    if (__atomic_add_fetch(&arena->nremote, 1, __ATOMIC_RELAXED) >=
+            remote_max &&
+        pthread_mutex_trylock(&arena->lock) == 0) {
+        remote_drain(arena, tc);
+        unlock_arena(arena);
+    }
+    tc->counters.remote_frees++;
+}
+#endif
+
+/**
+ * @brief Moves up to `n` blocks from one bin of a thread cache back to the
+ *        free lists.
+ *
+ * Each block goes back to the arena that owns it. Runs of blocks from the
+ * calling thread's arena are freed under a single acquisition of its lock;
+ * blocks of other arenas go onto their remote free stacks.
+ *
+ * @param[in] tc
+ * @param[in] bin
+ * @param[in] n
+ */
+static void tcache_drain(tcache_t *tc, size_t bin, unsigned int n) {
+    arena_t *locked = NULL;
+#if MAX_ARENAS > 1
+    arena_t *own = get_arena();
+#endif
+
+    while (n > 0 && tc->bin[bin] != NULL) {
+        block_t *block = tc->bin[bin];
+        arena_t *arena = block_arena(block);
+#if MAX_ARENAS > 1
+        if (remote_free && arena != own) {
+            tc->bin[bin] = block->next;
+            tc->count[bin]--;
+            remote_push(arena, block, tc);
+            tc->counters.tcache_flushed++;
+            n--;
+            continue;
+        }
+#endif
+        if (arena != locked) {
+            if (locked != NULL) {
+                unlock_arena(locked);
+            }
+            lock_arena(arena);
+            locked = arena;
+        }
+        tc->bin[bin] = block->next;
+        tc->count[bin]--;
+        free_object(arena, block);
+        tc->counters.tcache_flushed++;
+        n--;
+    }
+    if (locked != NULL) {
+        unlock_arena(locked);
+    }
+}
+
+/**
+ * @brief Flushes a full bin, so that it is left half full.
+ *
+ * @param[in] tc
+ * @param[in] bin
+ */
+static void tcache_flush(tcache_t *tc, size_t bin) {
+    unsigned int keep = tcache_count / 2;
+    if (tc->count[bin] <= keep) {
+        return;
+    }
+    tcache_drain(tc, bin, tc->count[bin] - keep);
+    tc->counters.tcache_flushes++;
+}
+
+/**
+ * @brief Parks a freed block in a thread cache bin, flushing half of the
+ *        bin first if it is full.
+ *
+ * @param[in] tc
+ * @param[in] bin
+ * @param[in] block The block, or the handle in front of a slab object
+ */
+static void tcache_push(tcache_t *tc, size_t bin, block_t *block) {
+    if (tc->count[bin] >= tcache_count) {
+        tcache_flush(tc, bin);
+    }
+    block->next = tc->bin[bin];
+    tc->bin[bin] = block;
+    tc->count[bin]++;
+}
+
+/**
+ * @brief Returns every block of a thread cache to the free lists.
+ * @param[in] tc
+ */
+static void tcache_drain_all(tcache_t *tc) {
+    for (size_t i = 0; i < TCACHE_ALL_BINS; i++) {
+        tcache_drain(tc, i, tc->count[i]);
+    }
+}
+
+/**
+ * @brief Empties a thread cache once its thread has freed as many blocks as
+ *        it allocated, so that a program done with the heap leaves nothing
+ *        cached that keeps it from coalescing and being trimmed. The
+ *        deferred blocks of the thread's arena are coalesced too.
+ *
+ * Relies on the MM_STATS counters. The cache is emptied at most once per
+ * trim_threshold bytes freed, so that a thread allocating and freeing one
+ * block over and over keeps it.
+ *
+ * @param[in] tc The calling thread's cache
+ */
+static void tcache_idle(tcache_t *tc) {
+#if MM_STATS
+    if (trim_threshold == 0 || tc->counters.allocs != tc->counters.frees ||
+        tc->counters.freed_bytes - tc->idle_mark < trim_threshold) {
+        return;
+    }
+    tc->idle_mark = tc->counters.freed_bytes;
+    tcache_drain_all(tc);
+
+    // Deferred blocks would keep the heap from shrinking just the same
+    arena_t *arena = get_arena();
+    lock_arena(arena);
+    defer_merge(arena);
+#if !MM_THREADS
+    // The only thread freed every block, so the heap must have shrunk
+    dbg_ensures(top_free(arena) <=
+                round_up(max(trim_threshold, chunksize), dsize));
+#endif
+    unlock_arena(arena);
+#else
+    (void)tc;
+#endif
+}
+
+/**
+ * @brief Returns the calling thread's cached blocks of an arena to its free
+ *        lists, before the arena grows.
+ *
+ * Blocks of other arenas stay cached, since their locks cannot be taken
+ * while this one is held.
+ *
+ * @param[in] arena
+ * @return True if any block was returned
+ * @pre The caller holds the arena's lock.
+ */
+static bool tcache_reclaim(arena_t *arena) {
+    tcache_t *tc = &tcache;
+    bool any = false;
+
+    // Blocks cached before the last mm_init belong to no heap
+    if (tc->epoch != heap_epoch) {
+        return false;
+    }
+    for (size_t i = 0; i < TCACHE_ALL_BINS; i++) {
+        block_t **link = &tc->bin[i];
+        while (*link != NULL) {
+            block_t *block = *link;
+            if (block_arena(block) != arena) {
+                link = &block->next;
+                continue;
+            }
+            *link = block->next;
+            tc->count[i]--;
+            free_object(arena, block);
+            tc->counters.tcache_flushed++;
+            any = true;
+        }
+    }
+    return any;
+}
+
+#if MM_THREADS
+/**
+ * @brief Thread exit hook: gives the cached blocks of an exiting thread back
+ *        to the heap and keeps its counters.
+ * @param[in] arg The exiting thread's cache
+ */
+static void tcache_thread_exit(void *arg) {
+    tcache_t *tc = (tcache_t *)arg;
+
+    if (tc->epoch == heap_epoch) {
+        tcache_drain_all(tc);
+    }
+
+    lock_heap();
+    if (tc->epoch == heap_epoch) {
+        counters_add(&tcache_retired, &tc->counters);
+    }
+    if (tc->live_prev != NULL) {
+        tc->live_prev->live_next = tc->live_next;
+    } else {
+        tcache_live = tc->live_next;
+    }
+    if (tc->live_next != NULL) {
+        tc->live_next->live_prev = tc->live_prev;
+    }
+    tc->registered = false;
+    unlock_heap();
+}
+
+/**
+ * @brief Creates the key used to run tcache_thread_exit.
+ */
+static void tcache_key_create(void) {
+    pthread_key_create(&tcache_key, tcache_thread_exit);
+}
+
+/**
+ * @brief Puts a thread cache on the live list, and arranges for it to be
+ *        flushed when its thread exits.
+ * @param[in] tc
+ */
+static void tcache_register(tcache_t *tc) {
+    pthread_once(&tcache_key_once, tcache_key_create);
+    pthread_setspecific(tcache_key, tc);
+
+    lock_heap();
+    tc->live_prev = NULL;
+    tc->live_next = tcache_live;
+    if (tcache_live != NULL) {
+        tcache_live->live_prev = tc;
+    }
+    tcache_live = tc;
+    tc->registered = true;
+    unlock_heap();
+}
+#endif
+
+/**
+ * @brief Returns the calling thread's cache.
+ *
+ * A cache filled against an earlier heap (before the last mm_init) refers to
+ * blocks that no longer exist, so it is emptied instead of flushed.
+ *
+ * @return The calling thread's cache
+ */
+static tcache_t *get_tcache(void) {
+    tcache_t *tc = &tcache;
+    if (tc->epoch != heap_epoch) {
+        for (size_t i = 0; i < TCACHE_ALL_BINS; i++) {
+            tc->bin[i] = NULL;
+            tc->count[i] = 0;
+        }
+        tc->counters = (mm_counters_t){0};
+        tc->idle_mark = 0;
+        tc->epoch = heap_epoch;
+#if MM_THREADS
+        if (!tc->registered) {
+            tcache_register(tc);
+        }
+#endif
+    }
+    return tc;
+}
+
+/**
+ * @brief Counts a block handed out to the application (MM_STATS).
+ * @param[in] size The block's size, slot size or mapping length
+ */
+static void stats_alloc(size_t size) {
+#if MM_STATS
+    tcache_t *tc = get_tcache();
+    tc->counters.allocs++;
+    tc->counters.alloc_bytes += size;
+#else
+    (void)size;
+#endif
+}
+
+/**
+ * @brief Counts a block given back by the application (MM_STATS).
+ * @param[in] size The block's size, slot size or mapping length
+ */
+static void stats_free(size_t size) {
+#if MM_STATS
+    tcache_t *tc = get_tcache();
+    tc->counters.frees++;
+    tc->counters.freed_bytes += size;
+#else
+    (void)size;
+#endif
+}
+
+#if MM_PROF
+/**
+ * @brief Hashes a payload or a stack for the profiler's tables.
+ * @param[in] key
+ * @return The hash, to be masked to the size of a table
+ */
+static size_t prof_hash(uintptr_t key) {
+    return (size_t)((key >> 4) * UINT64_C(0x9e3779b97f4a7c15) >> 32);
+}
+
+/**
+ * @brief Draws the number of bytes to allocate before the next sample.
+ *
+ * @param[in] tc The calling thread's cache, which holds the generator
+ * @param[in] rate The mean of the exponential distribution drawn from
+ * @return The number of bytes
+ */
+static int64_t prof_next(tcache_t *tc, size_t rate) {
+    // xorshift64*, seeded from the address of the thread's cache
+    uint64_t x = tc->prof_seed;
+    if (x == 0) {
+        x = (uintptr_t)tc * UINT64_C(0x9e3779b97f4a7c15) | 1;
+    }
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    tc->prof_seed = x;
+
+    // Uniform in (0, 1], so that the logarithm is finite
+    double u = (double)((x * UINT64_C(0x2545f4914f6cdd1d) >> 11) + 1) /
+               (double)(UINT64_C(1) << 53);
+    double next = -log(u) * (double)rate;
+    return next < (double)(INT64_MAX / 2) ? (int64_t)next : INT64_MAX / 2;
+}
+
+/**
+ * @brief Adjusts the filter and the live sample count for a payload.
+ *
+ * Free reads both without the lock, hence the atomic stores in the
+ * thread-safe build.
+ *
+ * @param[in] bp
+ * @param[in] add True if a sample of the payload is added, false if removed
+ * @pre The caller holds heap_lock.
+ */
+static void prof_count(void *bp, bool add) {
+    uint16_t *slot = &prof_filter[prof_hash((uintptr_t)bp) & (PROF_FILTER - 1)];
+    uint16_t count = (uint16_t)(add ? *slot + 1 : *slot - 1);
+    size_t nlive = add ? prof_nlive + 1 : prof_nlive - 1;
+#if MM_THREADS
+    __atomic_store_n(slot, count, __ATOMIC_RELAXED);
+    __atomic_store_n(&prof_nlive, nlive, __ATOMIC_RELAXED);
+#else
+    *slot = count;
+    prof_nlive = nlive;
+#endif
+}
+
+/**
+ * @brief Returns whether a payload may be a live sample, without the lock.
+ * @param[in] bp
+ * @return False if the payload is certainly not a live sample
+ */
+static bool prof_may_hold(void *bp) {
+    uint16_t *slot = &prof_filter[prof_hash((uintptr_t)bp) & (PROF_FILTER - 1)];
+#if MM_THREADS
+    return __atomic_load_n(&prof_nlive, __ATOMIC_RELAXED) != 0 &&
+           __atomic_load_n(slot, __ATOMIC_RELAXED) != 0;
+#else
+    return prof_nlive != 0 && *slot != 0;
+#endif
+}
+
+/**
+ * @brief Finds the call site of a stack, adding it if it is new.
+ *
+ * @param[in] pc The frames of the stack, caller first
+ * @return The site, or NULL if the table is full
+ * @pre The caller holds heap_lock.
+ */
+static prof_site_t *prof_site(void *const pc[PROF_DEPTH]) {
+    uintptr_t key = 0;
+    for (size_t d = 0; d < PROF_DEPTH; d++) {
+        key = (key ^ (uintptr_t)pc[d]) * UINT64_C(0x100000001b3);
+    }
+
+    size_t i = prof_hash(key) & (PROF_SITES - 1);
+    while (prof_sites[i].pc[0] != NULL) {
+        if (memcmp(prof_sites[i].pc, pc, sizeof(prof_sites[i].pc)) == 0) {
+            return &prof_sites[i];
+        }
+        i = (i + 1) & (PROF_SITES - 1);
+    }
+    if (prof_nsites >= PROF_SITES / 4 * 3) {
+        return NULL;
+    }
+    prof_nsites++;
+    memcpy(prof_sites[i].pc, pc, sizeof(prof_sites[i].pc));
+    return &prof_sites[i];
+}
+
+/**
+ * @brief Samples an allocation, or redraws the countdown if the rate
+ *        changed since it was drawn.
+ *
+ * The unwinder may allocate (the first time it runs, to load itself); such
+ * allocations are not sampled.
+ *
+ * The countdown runs on block sizes, which set the odds of a sample, but a
+ * sample is weighted by the bytes the application asked for, so that the
+ * profile reports the bytes in use rather than the heap they take up.
+ *
+ * @param[in] tc The calling thread's cache
+ * @param[in] bp The payload
+ * @param[in] size The block's size, slot size or mapping length
+ * @param[in] req The size requested by the application
+ * @param[in] caller Return address of the allocator's entry point
+ */
+static void prof_sample(tcache_t *tc, void *bp, size_t size, size_t req,
+                        void *caller) {
+    size_t rate = prof_rate;
+    if (tc->prof_busy) {
+        return;
+    }
+    if (rate == 0 || rate != tc->prof_rate) {
+        tc->prof_rate = rate;
+        tc->prof_left = rate == 0 ? prof_recheck : prof_next(tc, rate);
+        return;
+    }
+    tc->prof_left = prof_next(tc, rate);
+
+    // The stack starts at the caller; the frames below it are the allocator's
+    void *frames[PROF_SKIP + PROF_DEPTH];
+    tc->prof_busy = true;
+    int n = backtrace(frames, PROF_SKIP + PROF_DEPTH);
+    tc->prof_busy = false;
+    int i = 0;
+    while (i < n && frames[i] != caller) {
+        i++;
+    }
+    void *pc[PROF_DEPTH] = {caller};
+    for (size_t d = 0; d < PROF_DEPTH && i < n; d++, i++) {
+        pc[d] = frames[i];
+    }
+
+    // A block of `size` bytes is sampled with probability p
+    double p = 1.0 - exp(-(double)size / (double)rate);
+    size_t bytes = (size_t)((double)req / p + 0.5);
+    size_t objs = (size_t)(1.0 / p + 0.5);
+
+    lock_heap();
+    prof_site_t *site = prof_site(pc);
+    if (site != NULL) {
+        site->alloc_bytes += bytes;
+        site->alloc_objs += objs;
+    }
+    if (site == NULL || prof_nlive >= PROF_LIVE / 4 * 3) {
+        prof_dropped++;
+        unlock_heap();
+        return;
+    }
+    size_t j = prof_hash((uintptr_t)bp) & (PROF_LIVE - 1);
+    while (prof_live[j].bp != NULL) {
+        j = (j + 1) & (PROF_LIVE - 1);
+    }
+    prof_live[j] = (prof_live_t){bp, bytes, objs, site};
+    site->live_bytes += bytes;
+    site->live_objs += objs;
+    prof_count(bp, true);
+    unlock_heap();
+}
+
+/**
+ * @brief Removes a freed block from the live samples, if it is one.
+ *
+ * The entries following it in its cluster move back over the hole, so
+ * that lookups never need tombstones.
+ *
+ * @param[in] bp The payload
+ */
+static void prof_forget(void *bp) {
+    size_t mask = PROF_LIVE - 1;
+
+    lock_heap();
+    size_t i = prof_hash((uintptr_t)bp) & mask;
+    while (prof_live[i].bp != NULL && prof_live[i].bp != bp) {
+        i = (i + 1) & mask;
+    }
+    if (prof_live[i].bp == NULL) {
+        unlock_heap();
+        return;
+    }
+    prof_live[i].site->live_bytes -= prof_live[i].bytes;
+    prof_live[i].site->live_objs -= prof_live[i].objs;
+    prof_count(bp, false);
+
+    // An entry may fill the hole if the hole lies between its home and it
+    for (size_t j = (i + 1) & mask; prof_live[j].bp != NULL;
+         j = (j + 1) & mask) {
+        size_t home = prof_hash((uintptr_t)prof_live[j].bp) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            prof_live[i] = prof_live[j];
+            i = j;
+        }
+    }
+    prof_live[i].bp = NULL;
+    unlock_heap();
+}
+
+/**
+ * @brief Forgets every call site and live sample (the blocks of the old
+ *        heap are gone).
+ */
+static void prof_reset(void) {
+    if (prof_nsites == 0) {
+        return;
+    }
+    memset(prof_sites, 0, sizeof(prof_sites));
+    memset(prof_live, 0, sizeof(prof_live));
+    memset(prof_filter, 0, sizeof(prof_filter));
+    prof_nsites = 0;
+    prof_nlive = 0;
+    prof_dropped = 0;
+}
+#endif
+
+/**
+ * @brief Records a block handed out to the application: counts it
+ *        (MM_STATS) and gives the profiler a chance to sample it (MM_PROF).
+ *
+ * @param[in] bp The payload
+ * @param[in] size The block's size, slot size or mapping length
+ * @param[in] req The size requested by the application
+ * @param[in] caller Return address of the allocator's entry point
+ * @pre The caller holds no lock, as a sample takes heap_lock and may
+ *      allocate.
+ */
+static void note_alloc(void *bp, size_t size, size_t req, void *caller) {
+    stats_alloc(size);
+#if MM_PROF
+    tcache_t *tc = get_tcache();
+    tc->prof_left -= (int64_t)size;
+    if (tc->prof_left < 0) {
+        prof_sample(tc, bp, size, req, caller);
+    }
+#else
+    (void)bp;
+    (void)req;
+    (void)caller;
+#endif
+}
+
+/**
+ * @brief Records a block given back by the application.
+ *
+ * @param[in] bp The payload
+ * @param[in] size The block's size, slot size or mapping length
+ * @pre The caller holds no lock other than an arena's.
+ */
+static void note_free(void *bp, size_t size) {
+    stats_free(size);
+#if MM_PROF
+    if (prof_may_hold(bp)) {
+        prof_forget(bp);
+    }
+#else
+    (void)bp;
+#endif
+}
+
+/**
+ * @brief Returns whether a block handle is a huge block.
+ *
+ * @param[in] block The block, or the handle in front of a slab object
+ * @param[in] run The run holding the slab object, or NULL for a block
+ * @return True if the block lives in a mapping of its own
+ */
+static bool is_huge(block_t *block, slab_t *run) {
+    return run == NULL && (block->header & mask_mapped) != 0;
+}
+
+/**
+ * @brief Returns whether a request is too large to be served: the block or
+ *        mapping size computed from it would wrap around.
+ * @param[in] size The requested payload size
+ */
+static bool size_too_large(size_t size) {
+    return size > SIZE_MAX - mem_pagesize() - dsize;
+}
+
+/**
+ * @brief Returns the mapping length needed for a huge block.
+ * @param[in] size The requested payload size
+ * @return The length, in whole pages
+ */
+static size_t huge_length(size_t size) {
+    dbg_requires(!size_too_large(size));
+    return round_up(size + dsize, mem_pagesize());
+}
+
+/**
+ * @brief Lowers mmap_min_size to a request about to be served by a mapping.
+ *
+ * Sized frees read mmap_min_size without the lock, hence the atomic store
+ * in the thread-safe build.
+ *
+ * @param[in] size The requested payload size
+ * @pre The caller holds heap_lock.
+ */
+static void huge_note_size(size_t size) {
+    if (size < mmap_min_size) {
+#if MM_THREADS
+        __atomic_store_n(&mmap_min_size, size, __ATOMIC_RELAXED);
+#else
+        mmap_min_size = size;
+#endif
+    }
+}
+
+/**
+ * @brief Allocates a huge block, from the cache of freed mappings if one of
+ *        them fits.
+ *
+ * @param[in] size The requested payload size
+ * @param[out] fresh Set if the block is a new mapping, which reads as zero
+ * @return The block, or NULL if no memory could be mapped
+ */
+static block_t *huge_alloc(size_t size, bool *fresh) {
+    size_t length = huge_length(size);
+    tcache_t *tc = get_tcache();
+
+    // Take the tightest cached mapping that is at most twice as long
+    lock_heap();
+    huge_note_size(size);
+    size_t best = MMAP_CACHE;
+    for (size_t i = 0; i < mmap_ncached; i++) {
+        size_t cached = get_size(mmap_cache[i]);
+        if (cached >= length && cached / 2 <= length &&
+            (best == MMAP_CACHE || cached < get_size(mmap_cache[best]))) {
+            best = i;
+        }
+    }
+    if (best < MMAP_CACHE) {
+        block_t *block = mmap_cache[best];
+        mmap_cache[best] = mmap_cache[--mmap_ncached];
+        unlock_heap();
+        tc->counters.mmap_reuses++;
+        *fresh = false;
+        return block;
+    }
+
+    // Nothing fits: give the cache back rather than map on top of it
+    mmap_cache_flush();
+    char *start = mem_mmap(length);
+    if (start != NULL) {
+        mmap_bytes += length;
+    }
+    unlock_heap();
+    if (start == NULL) {
+        return NULL;
+    }
+    block_t *block = (block_t *)(start + wsize);
+    block->header = pack(length, true, true) | mask_mapped;
+    tc->counters.mmap_allocs++;
+    *fresh = true;
+    return block;
+}
+
+/**
+ * @brief Frees a huge block, keeping its mapping in the cache if there is
+ *        room for it.
+ * @param[in] block
+ */
+static void huge_free(block_t *block) {
+    size_t length = get_size(block);
+    size_t cached = length;
+
+    lock_heap();
+    for (size_t i = 0; i < mmap_ncached; i++) {
+        cached += get_size(mmap_cache[i]);
+    }
+    if (mmap_ncached < MMAP_CACHE && cached <= mmap_cache_bytes) {
+        mmap_cache[mmap_ncached++] = block;
+    } else {
+        mmap_bytes -= length;
+        mem_munmap((char *)block - wsize, length);
+    }
+    unlock_heap();
+}
+
+/**
+ * @brief Resizes a huge block by remapping it.
+ *
+ * @param[in] block
+ * @param[in] size The requested payload size
+ * @return The block, possibly moved, or NULL (leaving the block as it was)
+ *         if it cannot be resized
+ */
+static block_t *huge_resize(block_t *block, size_t size) {
+    size_t length = huge_length(size);
+
+    lock_heap();
+    huge_note_size(size);
+    if (length == get_size(block)) {
+        unlock_heap();
+        return block;
+    }
+    size_t old_length = get_size(block);
+    char *start = mem_mremap((char *)block - wsize, old_length, length);
+    if (start != NULL) {
+        mmap_bytes = mmap_bytes - old_length + length;
+    }
+    unlock_heap();
+    if (start == NULL) {
+        return NULL;
+    }
+    block = (block_t *)(start + wsize);
+    block->header = pack(length, true, true) | mask_mapped;
+    get_tcache()->counters.mmap_remaps++;
+    return block;
+}
+
+/**
+ * @brief Returns the first block of the segment following an epilogue.
+ *
+ * @param[in] epilogue The epilogue of a segment
+ * @return The first block of the next segment, or NULL if `epilogue` ends
+ *         the heap
+ */
+static block_t *next_segment(block_t *epilogue) {
+    word_t *prologue = (word_t *)epilogue + 1;
+    if ((char *)prologue > (char *)mem_heap_hi()) {
+        return NULL;
+    }
+    return (block_t *)(prologue + 1);
+}
+
+/**
+ * @brief
+ *
+ * Print out current blocks of the heap
+ *
+ * @param[in] asize
+ * @return
+ */
+void printHeap(int __line__) {
+    printf("line num: %d current heap: \n", __line__);
+    for (block_t *block = heap_start; block != NULL;
+         block = next_segment(block)) {
+        printf("segment of arena %td:\n", block_arena(block) - arenas);
+        for (; get_size(block) > 0; block = find_next(block)) {
+            printf("block is: %p size is: %lu curAlloc: %d prevAlloc: %d, "
+                   "prevMini: %d \n",
+                   block, extract_size(block->header), get_alloc(block),
+                   getPrevAlloc(block), getPrevMiniStatus(block));
+        }
+    }
+}
+
+/**
+ * @brief Checks one block of the implicit list.
+ *
+ * @param[in] block
+ * @param[in] prev_alloc Allocation status of the block before it
+ * @param[in] prev_mini Whether the block before it is a mini block
+ * @return True if the block is consistent
+ */
+static bool check_block(block_t *block, bool prev_alloc, bool prev_mini) {
+    size_t size = get_size(block);
+
+    // address alignment
+    if ((size_t)header_to_payload(block) % dsize != 0) {
+        dbg_printf("block %p: misaligned payload\n", (void *)block);
+        return false;
+    }
+
+    // Check heap boundaries
+    if ((void *)block < mem_heap_lo() ||
+        (char *)block + size - 1 > (char *)mem_heap_hi()) {
+        dbg_printf("block %p: outside of the heap\n", (void *)block);
+        return false;
+    }
+
+    // block size check
+    if (size < min_block_size || size % dsize != 0) {
+        dbg_printf("block %p: bad size %zu\n", (void *)block, size);
+        return false;
+    }
+
+    // only huge blocks, which are not in the heap, are marked as mapped
+    if (block->header & mask_mapped) {
+        dbg_printf("block %p: marked as mapped\n", (void *)block);
+        return false;
+    }
+
+    // the prev bits must describe the previous block
+    if (getPrevAlloc(block) != prev_alloc ||
+        getPrevMiniStatus(block) != prev_mini) {
+        dbg_printf("block %p: stale prev bits\n", (void *)block);
+        return false;
+    }
+
+    // no consecutive free blocks
+    if (!prev_alloc && !get_alloc(block)) {
+        dbg_printf("block %p: consecutive free blocks\n", (void *)block);
+        return false;
+    }
+
+    // check header and footer consistency (only free blocks have footers)
+    if (!get_alloc(block) && size != min_block_size) {
+        word_t footer = *header_to_footer(block);
+        if (extract_size(footer) != size || extract_alloc(footer)) {
+            dbg_printf("block %p: header/footer mismatch\n", (void *)block);
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Returns the number of the free list a free block belongs in: its
+ *        seglist class, or NUMCLASS plus its TLSF list in TLSF mode.
+ *
+ * @param[in] size Size of the free block
+ */
+static size_t free_list_of(size_t size) {
+    if (fit_mode == MM_FIT_TLSF && size != min_block_size) {
+        size_t fl, sl;
+        tlsf_mapping(size, &fl, &sl);
+        return NUMCLASS + fl * TLSF_SL_COUNT + sl;
+    }
+    return getHead(size);
+}
+
+/**
+ * @brief Checks that a free list entry is a free block inside the heap that
+ *        belongs in list `i` of `arena` (see free_list_of).
+ *
+ * @param[in] arena
+ * @param[in] block
+ * @param[in] i
+ * @return True if the entry is consistent
+ */
+static bool check_free_entry(arena_t *arena, block_t *block, size_t i) {
+    // All free list pointers are between mem heap lo() and mem heap high()
+    if ((void *)block < mem_heap_lo() || (void *)block > mem_heap_hi()) {
+        dbg_printf("list %zu: %p outside of the heap\n", i, (void *)block);
+        return false;
+    }
+    if (get_alloc(block)) {
+        dbg_printf("list %zu: %p is allocated\n", i, (void *)block);
+        return false;
+    }
+
+    // All blocks in each list bucket fall within bucket size range
+    if (free_list_of(get_size(block)) != i) {
+        dbg_printf("list %zu: %p has size %zu\n", i, (void *)block,
+                   get_size(block));
+        return false;
+    }
+
+    // Free blocks stay in the arena owning their segment
+    if (block_arena(block) != arena) {
+        dbg_printf("list %zu: %p belongs to another arena\n", i,
+                   (void *)block);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Checks a subtree of the large block tree.
+ *
+ * @param[in] arena
+ * @param[in] node Root of the subtree (may be NULL)
+ * @param[in] parent The parent node should have
+ * @param[in] lo Block every node of the subtree must come after, or NULL
+ * @param[in] hi Block every node of the subtree must come before, or NULL
+ * @param[in] limit Most free blocks the heap can hold
+ * @param[in,out] count Free blocks seen on lists so far
+ * @return The number of black nodes on every path down the subtree, or -1
+ *         if it is inconsistent
+ */
+static int check_tree(arena_t *arena, block_t *node, block_t *parent,
+                      block_t *lo, block_t *hi, size_t limit, size_t *count) {
+    if (node == NULL) {
+        return 0;
+    }
+    if (!check_free_entry(arena, node, TREE_CLASS)) {
+        return -1;
+    }
+    if (++*count > limit) {
+        dbg_printf("free lists hold more blocks than the heap\n");
+        return -1;
+    }
+    if (node->parent != parent) {
+        dbg_printf("tree: %p has the wrong parent\n", (void *)node);
+        return -1;
+    }
+    if ((lo != NULL && !tree_less(lo, node)) ||
+        (hi != NULL && !tree_less(node, hi))) {
+        dbg_printf("tree: %p is out of order\n", (void *)node);
+        return -1;
+    }
+    if (node->red && ((node->left != NULL && node->left->red) ||
+                      (node->right != NULL && node->right->red))) {
+        dbg_printf("tree: red %p has a red child\n", (void *)node);
+        return -1;
+    }
+
+    int left = check_tree(arena, node->left, node, lo, node, limit, count);
+    if (left < 0) {
+        return -1;
+    }
+    int right = check_tree(arena, node->right, node, node, hi, limit, count);
+    if (right < 0) {
+        return -1;
+    }
+    if (left != right) {
+        dbg_printf("tree: black heights differ under %p\n", (void *)node);
+        return -1;
+    }
+    return left + (node->red ? 0 : 1);
+}
+
+/**
+ * @brief Checks the TLSF lists of an arena against its bitmaps.
+ *
+ * @param[in] arena
+ * @param[in] limit Most free blocks the heap can hold
+ * @param[in,out] count Free blocks seen on lists so far
+ * @return True if the lists and bitmaps are consistent
+ */
+static bool check_tlsf_lists(arena_t *arena, size_t limit, size_t *count) {
+    for (size_t fl = 0; fl < TLSF_FL_COUNT; fl++) {
+        bool fl_set = (arena->tlsf_fl_map >> fl) & 1;
+        if (fl_set != (arena->tlsf_sl_map[fl] != 0)) {
+            dbg_printf("tlsf: first level %zu bit is wrong\n", fl);
+            return false;
+        }
+        for (size_t sl = 0; sl < TLSF_SL_COUNT; sl++) {
+            block_t *block = arena->tlsf[fl][sl];
+            bool sl_set = (arena->tlsf_sl_map[fl] >> sl) & 1;
+            if (sl_set != (block != NULL)) {
+                dbg_printf("tlsf: list [%zu][%zu] bit is wrong\n", fl, sl);
+                return false;
+            }
+            if (block != NULL && block->prev != NULL) {
+                dbg_printf("tlsf: head of [%zu][%zu] has a prev\n", fl, sl);
+                return false;
+            }
+            for (; block != NULL; block = block->next) {
+                if (!check_free_entry(arena, block,
+                                      NUMCLASS + fl * TLSF_SL_COUNT + sl)) {
+                    return false;
+                }
+                if (block->next != NULL && block->next->prev != block) {
+                    dbg_printf("tlsf: broken links at %p\n", (void *)block);
+                    return false;
+                }
+                if (++*count > limit) {
+                    dbg_printf("free lists hold more blocks than the heap\n");
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Checks the segregated free lists of an arena.
+ *
+ * Only needs the arena's lists, so it can run while other threads walk the
+ * heap; check_free_count then compares the result with their walks.
+ *
+ * @param[in] arena
+ * @param[in] limit Most free blocks the heap can hold, which bounds the
+ *                  walk of a list that loops
+ * @param[out] count Number of blocks on the lists
+ * @return True if the lists are well formed
+ */
+static bool check_free_lists(arena_t *arena, size_t limit, size_t *count) {
+    *count = 0;
+
+    for (size_t i = 0; i < NUMCLASS; i++) {
+        if (((arena->nonempty >> i) & 1) != (arena->head[i] != NULL)) {
+            dbg_printf("list %zu: non-empty bit is wrong\n", i);
+            return false;
+        }
+        if (arena->head[i] == NULL) {
+            continue;
+        }
+        if (i == TREE_CLASS) {
+            if (arena->head[i]->red) {
+                dbg_printf("tree: the root is red\n");
+                return false;
+            }
+            if (check_tree(arena, arena->head[i], NULL, NULL, NULL, limit,
+                           count) < 0) {
+                return false;
+            }
+            continue;
+        }
+        block_t *block = arena->head[i];
+        do {
+            if (!check_free_entry(arena, block, i)) {
+                return false;
+            }
+
+            // Check all next/prev pointers
+            block_t *next =
+                i == 0 ? mini_at(block->mini_next) : block->next;
+            if (i == 0 ? next->mini_prev != mini_link(block)
+                       : next->prev != block) {
+                dbg_printf("list %zu: broken links at %p\n", i,
+                           (void *)block);
+                return false;
+            }
+
+            // Count free blocks by iterating
+            if (++*count > limit) {
+                dbg_printf("free lists hold more blocks than the heap\n");
+                return false;
+            }
+            block = next;
+        } while (block != arena->head[i]);
+    }
+
+    return check_tlsf_lists(arena, limit, count);
+}
+
+/**
+ * @brief Checks that the free lists and statistics of an arena account for
+ *        exactly the free blocks of its segments.
+ *
+ * @param[in] arena
+ * @param[in] nfree Number of free blocks found in the arena's segments
+ * @param[in] listed Number of blocks on the arena's free lists
+ * @return True if the counts agree
+ */
+static bool check_free_count(arena_t *arena, size_t nfree, size_t listed) {
+    if (listed != nfree) {
+        dbg_printf("%zu free blocks, %zu on free lists\n", nfree, listed);
+        return false;
+    }
+
+#if MM_STATS
+    // The statistics count the same blocks
+    size_t counted = 0;
+    for (size_t i = 0; i < NUMCLASS; i++) {
+        counted += arena->free_blocks[i];
+    }
+    if (counted != nfree) {
+        dbg_printf("%zu free blocks, %zu in the statistics\n", nfree,
+                   counted);
+        return false;
+    }
+#else
+    (void)arena;
+#endif
+    return true;
+}
+
+/**
+ * @brief Checks that a block handle held by a thread cache or a remote free
+ *        stack stands for an allocated block or slab object.
+ *
+ * @param[in] block
+ * @return True if the block or object is allocated
+ */
+static bool check_object(block_t *block) {
+    void *bp = block->payload;
+    slab_t *run = slab_of(bp);
+
+    if (run != NULL) {
+        size_t i = (size_t)((char *)bp - (char *)(run + 1)) / run->size;
+        return (char *)bp >= (char *)(run + 1) && i < run->nobj &&
+               bp == slab_object(run, i) &&
+               !((run->free_map[i / 64] >> (i % 64)) & 1);
+    }
+    return (void *)block >= mem_heap_lo() && (void *)block <= mem_heap_hi() &&
+           get_alloc(block);
+}
+
+/**
+ * @brief Checks a slab run: its header, its free slot bitmap and whether it
+ *        is listed in its arena exactly when it has free slots.
+ *
+ * @param[in] arena The arena owning the run
+ * @param[in] run
+ * @return True if the run is consistent
+ */
+static bool check_slab(arena_t *arena, slab_t *run) {
+    if (run->size == 0 || run->size > SLAB_MAX || run->size % 16 != 0 ||
+        run->nobj != (SLAB_RUN_SIZE - wsize - sizeof(slab_t)) / run->size) {
+        dbg_printf("slab run %p: bad header\n", (void *)run);
+        return false;
+    }
+
+    // The bitmap counts the free slots, and has no bits past the last one
+    size_t nfree = 0;
+    for (size_t i = 0; i < SLAB_MAP_WORDS; i++) {
+        size_t bits = run->nobj > 64 * i ? run->nobj - 64 * i : 0;
+        word_t valid = bits >= 64 ? ~(word_t)0 : ((word_t)1 << bits) - 1;
+        if (run->free_map[i] & ~valid) {
+            dbg_printf("slab run %p: free bits past the end\n", (void *)run);
+            return false;
+        }
+        nfree += (size_t)__builtin_popcountll(run->free_map[i]);
+    }
+    if (nfree != run->nfree) {
+        dbg_printf("slab run %p: %u free, bitmap has %zu\n", (void *)run,
+                   run->nfree, nfree);
+        return false;
+    }
+
+    bool listed = false;
+    for (slab_t *r = arena->slabs[slab_class(run->size)]; r != NULL;
+         r = r->next) {
+        if (r == run) {
+            listed = true;
+            break;
+        }
+    }
+    if (listed != (nfree > 0)) {
+        dbg_printf("slab run %p: %s listed\n", (void *)run,
+                   listed ? "full run" : "run with free slots not");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Checks the lists of slab runs with free slots of an arena.
+ *
+ * @param[in] arena
+ * @return True if the lists only hold marked runs of their class, with
+ *         consistent links
+ */
+static bool check_slab_lists(arena_t *arena) {
+    for (size_t c = 0; c < SLAB_CLASSES; c++) {
+        slab_t *prev = NULL;
+        for (slab_t *run = arena->slabs[c]; run != NULL; run = run->next) {
+            if (slab_of(run) != run || run->prev != prev ||
+                slab_class(run->size) != c ||
+                block_arena(payload_to_header(run)) != arena) {
+                dbg_printf("slab list %zu: bad run %p\n", c, (void *)run);
+                return false;
+            }
+            prev = run;
+        }
+    }
+    return true;
+}
+
+#if MAX_ARENAS > 1
+/**
+ * @brief Checks the remote free stack of an arena.
+ *
+ * Other threads may keep pushing onto the stack, but never take blocks off
+ * it without the arena's lock, so the blocks below its top stay put.
+ *
+ * @param[in] arena
+ * @return True if the stack only holds allocated blocks and slab objects of
+ *         the arena
+ */
+static bool check_remote(arena_t *arena) {
+    block_t *block = __atomic_load_n(&arena->remote, __ATOMIC_ACQUIRE);
+    for (; block != NULL; block = block->next) {
+        if (!check_object(block) || block_arena(block) != arena) {
+            dbg_printf("remote stack of arena %td: bad block %p\n",
+                       arena - arenas, (void *)block);
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+/**
+ * @brief Checks the quick lists of an arena.
+ *
+ * @param[in] arena
+ * @return True if every deferred block is an allocated block of the arena
+ *         and of its list's size, and ndeferred counts them
+ */
+static bool check_deferred(arena_t *arena) {
+    size_t n = 0;
+    for (size_t i = 0; i < DEFER_BINS; i++) {
+        for (block_t *block = arena->quick[i]; block != NULL;
+             block = block->next) {
+            if (slab_of(block->payload) != NULL || !check_object(block) ||
+                block_arena(block) != arena ||
+                get_size(block) != (i + 1) * dsize) {
+                dbg_printf("quick list %zu of arena %td: bad block %p\n", i,
+                           arena - arenas, (void *)block);
+                return false;
+            }
+            if (++n > arena->ndeferred) {
+                break;
+            }
+        }
+    }
+    if (n != arena->ndeferred) {
+        dbg_printf("arena %td: %zu deferred blocks, found %zu\n",
+                   arena - arenas, arena->ndeferred, n);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Checks the cache of freed mappings.
+ * @return True if it only holds allocated huge blocks, each starting its
+ *         own mapping, within mmap_cache_bytes in total
+ */
+static bool check_mmap_cache(void) {
+    size_t cached = 0;
+    for (size_t i = 0; i < mmap_ncached; i++) {
+        block_t *block = mmap_cache[i];
+        char *start = (char *)block - wsize;
+        if (!is_huge(block, NULL) || !get_alloc(block) ||
+            (uintptr_t)start % mem_pagesize() != 0 ||
+            get_size(block) % mem_pagesize() != 0) {
+            dbg_printf("mapping cache: bad block %p\n", (void *)block);
+            return false;
+        }
+        cached += get_size(block);
+    }
+    if (cached > mmap_cache_bytes) {
+        dbg_printf("mapping cache holds %zu bytes\n", cached);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Checks the size passed to a sized free.
+ *
+ * @param[in] bp A payload returned by malloc
+ * @param[in] size The size the caller frees it with
+ * @return True if `size` can be what the payload was last allocated with:
+ *         one that rounds up to the block's size, fits its slab slot or
+ *         fits its mapping
+ */
+static bool check_free_size(void *bp, size_t size) {
+    block_t *block = payload_to_header(bp);
+    slab_t *run = slab_of(bp);
+    bool ok;
+    if (size_too_large(size)) {
+        ok = false;
+    } else if (run != NULL) {
+        ok = size > 0 && size <= run->size;
+    } else if (is_huge(block, run)) {
+        // (a cached mapping may be up to twice as long as needed)
+        ok = size >= mmap_min_size && huge_length(size) <= get_size(block);
+    } else {
+        ok = get_alloc(block) &&
+             round_up(size + wsize, dsize) == get_size(block);
+    }
+    if (!ok) {
+        dbg_printf("sized free of %p with wrong size %zu\n", bp, size);
+    }
+    return ok;
+}
+
+/**
+ * @brief Checks the calling thread's cache.
+ *
+ * Other threads' caches cannot be inspected safely while they run.
+ *
+ * @return True if every cached block is an allocated block or slab object of
+ *         its bin size
+ */
+static bool check_tcache(void) {
+    tcache_t *tc = &tcache;
+    if (tc->epoch != heap_epoch) {
+        return true;
+    }
+    for (size_t i = 0; i < TCACHE_ALL_BINS; i++) {
+        unsigned int n = 0;
+        for (block_t *block = tc->bin[i]; block != NULL; block = block->next) {
+            if (!check_object(block) ||
+                tcache_bin_of(block, slab_of(block->payload)) != i) {
+                dbg_printf("tcache bin %zu: bad block %p\n", i,
+                           (void *)block);
+                return false;
+            }
+            if (++n > tc->count[i]) {
+                break;
+            }
+        }
+        if (n != tc->count[i]) {
+            dbg_printf("tcache bin %zu: count %u, found %u\n", i,
+                       tc->count[i], n);
+            return false;
+        }
+    }
+    return true;
+}
+
+#if CHECK_FULL_EVERY > 1
+/**
+ * @brief Checks the path from a node of the large block tree up to the
+ *        root: links both ways, order and colours.
+ *
+ * @param[in] arena
+ * @param[in] block A free block of TREE_CLASS
+ * @return True if the path is consistent
+ */
+static bool check_tree_path(arena_t *arena, block_t *block) {
+    if ((block->left != NULL && block->left->parent != block) ||
+        (block->right != NULL && block->right->parent != block)) {
+        dbg_printf("tree: children of %p have the wrong parent\n",
+                   (void *)block);
+        return false;
+    }
+
+    // A balanced tree is at most twice as deep as the bits of a size
+    size_t depth = 0;
+    block_t *node = block;
+    for (; node->parent != NULL; node = node->parent) {
+        block_t *parent = node->parent;
+        bool placed = parent->left == node    ? tree_less(node, parent)
+                      : parent->right == node ? tree_less(parent, node)
+                                              : false;
+        if (++depth > 2 * 64 || !placed ||
+            !check_free_entry(arena, parent, TREE_CLASS)) {
+            dbg_printf("tree: %p is not where its parent has it\n",
+                       (void *)node);
+            return false;
+        }
+        if (node->red && parent->red) {
+            dbg_printf("tree: red %p has a red child\n", (void *)parent);
+            return false;
+        }
+    }
+    if (arena->head[TREE_CLASS] != node) {
+        dbg_printf("tree: %p is not under the root\n", (void *)block);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Checks that a free block is on the right list of its arena and
+ *        linked both ways with its list neighbours.
+ *
+ * @param[in] arena
+ * @param[in] block
+ * @return True if the block is properly listed
+ */
+static bool check_links(arena_t *arena, block_t *block) {
+    size_t i = free_list_of(get_size(block));
+    bool linked;
+
+    if (!check_free_entry(arena, block, i)) {
+        return false;
+    }
+    if (i >= NUMCLASS) {
+        // TLSF lists end in NULL, and their heads are in the table
+        size_t fl = (i - NUMCLASS) / TLSF_SL_COUNT;
+        size_t sl = (i - NUMCLASS) % TLSF_SL_COUNT;
+        linked = (block->next == NULL || block->next->prev == block) &&
+                 (block->prev != NULL ? block->prev->next == block
+                                      : arena->tlsf[fl][sl] == block);
+    } else if (i == TREE_CLASS) {
+        return check_tree_path(arena, block);
+    } else if (i == 0) {
+        uint32_t link = mini_link(block);
+        linked = mini_at(block->mini_next)->mini_prev == link &&
+                 mini_at(block->mini_prev)->mini_next == link;
+    } else {
+        linked = block->next->prev == block && block->prev->next == block;
+    }
+    if (!linked) {
+        dbg_printf("list %zu: broken links at %p\n", i, (void *)block);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Checks a block against its neighbours on the heap and on its free
+ *        list, or its slab run if it holds one.
+ *
+ * @param[in] block
+ * @return True if the block fits in with its neighbours
+ */
+static bool check_local(block_t *block) {
+    arena_t *arena = block_arena(block);
+
+    if (!check_block(block, getPrevAlloc(block), getPrevMiniStatus(block))) {
+        return false;
+    }
+
+    // a free block before it ends right here
+    if (!getPrevAlloc(block)) {
+        block_t *prev = getPrevMiniStatus(block)
+                            ? (block_t *)((char *)block - min_block_size)
+                            : footer_to_header(find_prev_footer(block));
+        if ((void *)prev < mem_heap_lo() ||
+            !check_block(prev, getPrevAlloc(prev),
+                         getPrevMiniStatus(prev)) ||
+            get_alloc(prev) || find_next(prev) != block) {
+            dbg_printf("block %p: bad previous block %p\n", (void *)block,
+                       (void *)prev);
+            return false;
+        }
+        if (!check_links(arena, prev)) {
+            return false;
+        }
+    }
+
+    // the next block records this one in its prev bits
+    block_t *next = find_next(block);
+    bool alloc = get_alloc(block);
+    bool mini = get_size(block) == min_block_size;
+    if (get_size(next) == 0) {
+        if (!get_alloc(next) || getPrevAlloc(next) != alloc ||
+            getPrevMiniStatus(next) != mini) {
+            dbg_printf("epilogue %p: bad header\n", (void *)next);
+            return false;
+        }
+    } else if (!check_block(next, alloc, mini)) {
+        return false;
+    }
+
+    if (!alloc) {
+        return check_links(arena, block);
+    }
+    slab_t *run = slab_of(header_to_payload(block));
+    if (run != NULL) {
+        if ((void *)run != header_to_payload(block) ||
+            get_size(block) != SLAB_RUN_SIZE) {
+            dbg_printf("block %p: inside slab run %p\n", (void *)block,
+                       (void *)run);
+            return false;
+        }
+        return check_slab(arena, run);
+    }
+    return true;
+}
+
+/**
+ * @brief Tells whether entry i of the change log is the last to concern
+ *        its address, and whether a block or list node still starts there.
+ *
+ * @param[in] i
+ * @param[in] n Number of entries in the log
+ * @return False if a later entry concerns the same address, or a later
+ *         write covers it without starting there
+ */
+static bool check_current(size_t i, size_t n) {
+    char *start = check_log[i].start;
+    for (size_t j = n; j-- > i + 1;) {
+        if (check_log[j].start == start) {
+            return false;
+        }
+        if (check_log[j].start < start &&
+            start < check_log[j].start + check_log[j].size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Checks the blocks and list nodes changed since the last
+ *        mm_checkheap, and their neighbours.
+ *
+ * The heap was consistent at the last check, so only what changed since,
+ * and what points to it, can have gone wrong, short of the counts and list
+ * sizes that the next full check compares.
+ *
+ * @return True if all changes fit in with their neighbours
+ */
+static bool check_changes(void) {
+    char *heap_lo = (char *)mem_heap_lo();
+    char *heap_end = (char *)mem_heap_hi() + 1;
+
+    for (size_t i = 0; i < check_nlog; i++) {
+        char *start = check_log[i].start;
+
+        // huge blocks and trimmed space are outside the heap
+        if (start < heap_lo || start >= heap_end ||
+            !check_current(i, check_nlog)) {
+            continue;
+        }
+        // prologues and epilogues are checked with the blocks next to them
+        block_t *block = (block_t *)start;
+        if (get_size(block) == 0) {
+            continue;
+        }
+        if (!check_local(block)) {
+            return false;
+        }
+    }
+
+    // empty list bits are cheap enough to check every time
+    for (size_t a = 0; a < MAX_ARENAS; a++) {
+        for (size_t i = 0; i < NUMCLASS; i++) {
+            if (((arenas[a].nonempty >> i) & 1) !=
+                (arenas[a].head[i] != NULL)) {
+                dbg_printf("list %zu: non-empty bit is wrong\n", i);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+#endif
+
+/** @brief A stretch of the heap walked by one thread of mm_checkheap */
+typedef struct {
+    /** @brief First block of the stretch, or the prologue at the bottom */
+    block_t *start;
+    /** @brief The stretch holds the blocks starting below end */
+    char *end;
+    /** @brief Set by the walk: where it stopped, at or past end */
+    block_t *stop;
+    /** @brief Allocation status of the block before start, as its header
+     *         records it; set by the walk to that of the last block walked */
+    bool prev_alloc;
+    /** @brief Likewise whether that block is a mini block */
+    bool prev_mini;
+    /** @brief Set by the walk: whether it stopped after an epilogue */
+    bool at_segment;
+    /** @brief Set by the walk: whether every block walked is consistent */
+    bool ok;
+    /** @brief Free block count of each arena within the stretch */
+    size_t nfree[MAX_ARENAS];
+    /** @brief Slab run count within the stretch */
+    size_t nruns;
+    /** @brief Objects in use in the slab runs of each arena within the
+     *         stretch */
+    size_t slab_live[MAX_ARENAS];
+} check_range_t;
+
+/**
+ * @brief Checks the blocks of a stretch of the heap, and the prologue and
+ *        epilogue of every segment boundary inside it.
+ *
+ * Only reads the heap, so several walks can run at once, one per thread.
+ *
+ * @param[in,out] arg The check_range_t to walk and fill in
+ * @return NULL
+ */
+static void *check_range(void *arg) {
+    check_range_t *range = arg;
+    block_t *block = range->start;
+    bool prev_alloc = range->prev_alloc;
+    bool prev_mini = range->prev_mini;
+    bool at_segment = (void *)block == mem_heap_lo();
+    arena_t *arena = at_segment ? NULL : block_arena(block);
+
+    range->ok = false;
+    while ((char *)block < range->end) {
+        // check prologue
+        if (at_segment) {
+            word_t *prologue = (word_t *)block;
+            if (extract_size(*prologue) != 0 || !extract_alloc(*prologue)) {
+                dbg_printf("segment %p: bad prologue\n", (void *)prologue);
+                return NULL;
+            }
+            block = (block_t *)(prologue + 1);
+            arena = block_arena(block);
+            prev_alloc = true;
+            prev_mini = false;
+            at_segment = false;
+            continue;
+        }
+
+        // check epilogue
+        if (get_size(block) == 0) {
+            if (!get_alloc(block) || getPrevAlloc(block) != prev_alloc ||
+                getPrevMiniStatus(block) != prev_mini) {
+                dbg_printf("epilogue %p: bad header\n", (void *)block);
+                return NULL;
+            }
+            block = (block_t *)((word_t *)block + 1);
+            at_segment = true;
+            continue;
+        }
+
+        // Check each block specific features.
+        if (!check_block(block, prev_alloc, prev_mini)) {
+            return NULL;
+        }
+
+        // count free block numbers
+        if (!get_alloc(block)) {
+            range->nfree[arena - arenas]++;
+        }
+
+        // slab runs are the only blocks inside pages marked as runs
+        slab_t *run = get_alloc(block) ? slab_of(header_to_payload(block))
+                                       : NULL;
+        if (run != NULL) {
+            if ((void *)run != header_to_payload(block) ||
+                get_size(block) != SLAB_RUN_SIZE) {
+                dbg_printf("block %p: inside slab run %p\n", (void *)block,
+                           (void *)run);
+                return NULL;
+            }
+            if (!check_slab(arena, run)) {
+                return NULL;
+            }
+            range->nruns++;
+            range->slab_live[arena - arenas] += run->nobj - run->nfree;
+        }
+        prev_alloc = get_alloc(block);
+        prev_mini = get_size(block) == min_block_size;
+        block = find_next(block);
+    }
+
+    range->stop = block;
+    range->prev_alloc = prev_alloc;
+    range->prev_mini = prev_mini;
+    range->at_segment = at_segment;
+    range->ok = true;
+    return NULL;
+}
+
+/**
+ * @brief Splits the heap into stretches for the threads of mm_checkheap.
+ *
+ * Stretches start at blocks taken from the boundary index; small heaps, or
+ * builds without the index, make do with one.
+ *
+ * @param[out] ranges CHECK_WORKERS stretches, the first ones filled in
+ * @param[in] heap_end
+ * @return The number of stretches
+ */
+static size_t check_split(check_range_t ranges[], char *heap_end) {
+    char *heap_lo = (char *)mem_heap_lo();
+    size_t nranges = 1;
+
+    memset(ranges, 0, CHECK_WORKERS * sizeof(check_range_t));
+    ranges[0].start = (block_t *)heap_lo;
+#if CHECK_WORKERS > 1
+    size_t span = (size_t)(heap_end - heap_lo);
+    for (size_t i = 1; span >= check_parallel_min && i < CHECK_WORKERS;
+         i++) {
+        block_t *mark = check_marks[i * (span / CHECK_STRIPE) /
+                                    CHECK_WORKERS];
+        // stale or huge blocks can leave a stripe without a usable start
+        if (mark == NULL || (char *)mark >= heap_end ||
+            mark <= ranges[nranges - 1].start || get_size(mark) == 0) {
+            continue;
+        }
+        ranges[nranges].start = mark;
+        ranges[nranges].prev_alloc = getPrevAlloc(mark);
+        ranges[nranges].prev_mini = getPrevMiniStatus(mark);
+        nranges++;
+    }
+#endif
+    for (size_t i = 0; i < nranges; i++) {
+        ranges[i].end =
+            i + 1 < nranges ? (char *)ranges[i + 1].start : heap_end;
+    }
+    return nranges;
+}
+
+/**
+ * @brief Checks the whole heap.
+ *
+ * Walks every segment checking every block and slab run, then checks that
+ * the free lists of each arena hold exactly the free blocks of its
+ * segments, that its slab run lists are well formed, that remote
+ * free stacks and the calling thread's cache only hold allocated blocks, of
+ * the right arena and size respectively.
+ *
+ * A large heap is split between CHECK_WORKERS threads, each walking its own
+ * stretch while this one checks the free lists, and their counts are added
+ * up once all are done. The walks must meet exactly where each stretch
+ * ends.
+ *
+ * @return True if the heap is consistent
+ * @pre The caller holds every lock.
+ */
+static bool check_heap(void) {
+    bool ok = true;
+    check_range_t ranges[CHECK_WORKERS];
+    size_t listed[MAX_ARENAS] = {0};
+    size_t nfree[MAX_ARENAS] = {0};
+    size_t nruns = 0;
+    size_t slab_live[MAX_ARENAS] = {0};
+
+    // Segments follow each other up to the top of the heap
+    char *heap_end = (char *)mem_heap_hi() + 1;
+    size_t nranges = check_split(ranges, heap_end);
+#if CHECK_WORKERS > 1
+    pthread_t workers[CHECK_WORKERS];
+    size_t nworkers = 1;
+    while (nworkers < nranges &&
+           pthread_create(&workers[nworkers], NULL, check_range,
+                          &ranges[nworkers]) == 0) {
+        nworkers++;
+    }
+#else
+    size_t nworkers = 1;
+#endif
+
+    // Seglist checker, while the workers walk the heap
+    size_t limit = (size_t)(heap_end - (char *)mem_heap_lo()) /
+                   min_block_size;
+    for (size_t i = 0; ok && i < MAX_ARENAS; i++) {
+        ok = check_free_lists(&arenas[i], limit, &listed[i]) &&
+             check_slab_lists(&arenas[i]) && check_deferred(&arenas[i]);
+#if MAX_ARENAS > 1
+        ok = ok && check_remote(&arenas[i]);
+#endif
+    }
+    ok = ok && check_tcache() && check_mmap_cache();
+
+    // Walk the first stretch here, and any no thread could be started for
+    check_range(&ranges[0]);
+    for (size_t i = nworkers; i < nranges; i++) {
+        check_range(&ranges[i]);
+    }
+#if CHECK_WORKERS > 1
+    for (size_t i = 1; i < nworkers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+#endif
+
+    // Each walk must stop where the next starts, in the same state
+    for (size_t i = 0; i < nranges; i++) {
+        ok = ok && ranges[i].ok;
+        if (ok && i + 1 < nranges &&
+            (ranges[i].stop != ranges[i + 1].start ||
+             ranges[i].prev_alloc != getPrevAlloc(ranges[i + 1].start) ||
+             ranges[i].prev_mini !=
+                 getPrevMiniStatus(ranges[i + 1].start))) {
+            dbg_printf("block %p: walks to it and from it disagree\n",
+                       (void *)ranges[i + 1].start);
+            ok = false;
+        }
+        for (size_t j = 0; j < MAX_ARENAS; j++) {
+            nfree[j] += ranges[i].nfree[j];
+            slab_live[j] += ranges[i].slab_live[j];
+        }
+        nruns += ranges[i].nruns;
+    }
+    if (ok && (!ranges[nranges - 1].at_segment ||
+               (char *)ranges[nranges - 1].stop != heap_end)) {
+        dbg_printf("heap does not end with an epilogue\n");
+        ok = false;
+    }
+
+    // Every page marked as a slab run is one
+    size_t npages = 0;
+    for (size_t i = 0; i < SLAB_ZONE / SLAB_RUN_SIZE / 64; i++) {
+        npages += (size_t)__builtin_popcountll(slab_pages[i]);
+    }
+    if (ok && npages != nruns) {
+        dbg_printf("%zu pages marked as slab runs, %zu runs\n", npages,
+                   nruns);
+        ok = false;
+    }
+
+    for (size_t i = 0; ok && i < MAX_ARENAS; i++) {
+        ok = check_free_count(&arenas[i], nfree[i], listed[i]);
+        if (ok && slab_live[i] != arenas[i].slab_live) {
+            dbg_printf("arena %zu: %zu slab objects in use, %zu counted\n",
+                       i, slab_live[i], arenas[i].slab_live);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+/**
+ * @brief Checks the heap for consistency.
+ *
+ * Builds with CHECK_FULL_EVERY > 1 check only what changed since the last
+ * call on most calls, see check_changes, and the whole heap on the others.
+ *
+ * @param[in] line The line number mm_checkheap is being called from
+ * @return True if the heap is consistent
+ */
+bool mm_checkheap(int line) {
+    bool ok;
+
+    if (heap_start == NULL) {
+        return true;
+    }
+
+    for (size_t i = 0; i < MAX_ARENAS; i++) {
+        lock_arena(&arenas[i]);
+    }
+    lock_heap();
+
+#if CHECK_FULL_EVERY > 1
+    if (++check_calls % CHECK_FULL_EVERY != 0 && check_nlog <= CHECK_LOG) {
+        ok = check_changes();
+    } else {
+        ok = check_heap();
+    }
+    check_nlog = 0;
+#else
+    ok = check_heap();
+#endif
+
+    unlock_heap();
+    for (size_t i = 0; i < MAX_ARENAS; i++) {
+        unlock_arena(&arenas[i]);
+    }
+
+    if (!ok) {
+        dbg_printf("mm_checkheap failed (called from line %d)\n", line);
+    }
+    return ok;
+}
+
+#if MM_THREADS
+/**
+ * @brief Initializes the lock of every arena.
+ */
+static void init_arena_locks(void) {
+    for (size_t i = 0; i < MAX_ARENAS; i++) {
+        pthread_mutex_init(&arenas[i].lock, NULL);
+    }
+}
+
+/**
+ * @brief Initializes the heap on the first malloc of a program that never
+ *        called mm_init.
+ */
+static void init_heap(void) {
+    mm_init();
+}
+#endif
+
+/**
+ * @brief Returns the default number of arenas: one per online CPU, up to
+ *        MAX_ARENAS.
+ * @return The number of arenas
+ */
+static unsigned int default_narenas(void) {
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus < 1) {
+        return 1;
+    }
+    if (ncpus > MAX_ARENAS) {
+        return MAX_ARENAS;
+    }
+    return (unsigned int)ncpus;
+}
+
+/**
+ * @brief Initializes an empty heap.
+ *
+ * Empties every arena and the slab page map, starts the first heap segment
+ * (owned by arenas[0]) with a free block of chunksize bytes and invalidates
+ * every thread cache and arena binding. Tuning parameters set through
+ * mm_mallopt are kept.
+ *
+ * In the thread-safe build this must not run concurrently with any other
+ * allocator call.
+ *
+ * @return True on success
+ */
+bool mm_init(void) {
+#if MM_THREADS
+    pthread_once(&arena_lock_once, init_arena_locks);
+#endif
+    if (narenas == 0) {
+        narenas = default_narenas();
+    }
+
+    for (size_t a = 0; a < MAX_ARENAS; a++) {
+        for (int i = 0; i < NUMCLASS; i++) {
+            arenas[a].head[i] = NULL;
+        }
+        arenas[a].nonempty = 0;
+        arenas[a].tlsf_fl_map = 0;
+        for (size_t fl = 0; fl < TLSF_FL_COUNT; fl++) {
+            arenas[a].tlsf_sl_map[fl] = 0;
+            for (size_t sl = 0; sl < TLSF_SL_COUNT; sl++) {
+                arenas[a].tlsf[fl][sl] = NULL;
+            }
+        }
+        arenas[a].epilogue = NULL;
+        arenas[a].heap_size = 0;
+        arenas[a].zero_from = NULL;
+        for (size_t c = 0; c < SLAB_CLASSES; c++) {
+            arenas[a].slabs[c] = NULL;
+        }
+        arenas[a].slab_live = 0;
+        for (size_t i = 0; i < DEFER_BINS; i++) {
+            arenas[a].quick[i] = NULL;
+        }
+        arenas[a].ndeferred = 0;
+        arenas[a].grow_size = chunksize;
+        arenas[a].grow_mark = 0;
+        arenas[a].trim_pending = 0;
+        arenas[a].trim_reclaiming = false;
+        arenas[a].counters = (mm_counters_t){0};
+#if MM_STATS
+        arenas[a].free_bytes = 0;
+        for (size_t i = 0; i < NUMCLASS; i++) {
+            arenas[a].free_blocks[i] = 0;
+        }
+#endif
+#if MAX_ARENAS > 1
+        arenas[a].remote = NULL;
+        arenas[a].nremote = 0;
+#endif
+    }
+#if MAX_ARENAS > 1
+    nsegments = 0;
+#endif
+    heap_start = NULL;
+    mini_base = (char *)mem_heap_lo();
+
+    // Cached mappings belonged to the old heap (mem_reset_brk unmaps them)
+    mmap_ncached = 0;
+    mmap_bytes = 0;
+    mmap_min_size = SIZE_MAX;
+#if MM_PROF
+    prof_reset();
+#endif
+#if CHECK_FULL_EVERY > 1
+    check_nlog = 0;
+    check_calls = 0;
+#endif
+    fit_mode = fit_mode_next;
+
+    // Runs are aligned pages of the heap
+    slab_base = round_up((uintptr_t)mem_heap_lo(), SLAB_RUN_SIZE);
+    for (size_t i = 0; i < SLAB_ZONE / SLAB_RUN_SIZE / 64; i++) {
+        slab_pages[i] = 0;
+    }
+
+    // Blocks held in thread caches belonged to the old heap
+    heap_epoch++;
+    arena_epoch++;
+#if MM_THREADS
+    tcache_retired = (mm_counters_t){0};
+#endif
+
+    // Create the first segment, holding a free block of chunksize bytes
+    block_t *block = extend_heap(&arenas[0], chunksize);
+    if (block == NULL) {
+        return false;
+    }
+
+    // Heap starts with the first block of the first segment
+    heap_start = block;
+
+    return true;
+}
+
+/**
+ * @brief Allocates a block with a payload of at least `size` bytes, on
+ *        behalf of the code at `caller`.
+ *
+ * Requests are first served from the calling thread's cache; the rest take
+ * the lock of the calling thread's arena, and are carved out of one of its
+ * slab runs (up to SLAB_MAX bytes) or found on its free lists.
+ *
+ * @param[in] size
+ * @param[in] caller Return address of the allocator's entry point
+ * @return The payload of the block, or NULL if `size` is 0 or the heap is
+ *         exhausted (and with errno set to ENOMEM if `size` is too large
+ *         for any block)
+ */
+static void *malloc_from(size_t size, void *caller) {
+    dbg_requires(mm_checkheap(__LINE__));
+
+    size_t asize; // Adjusted block size
+    block_t *block;
+    void *bp = NULL;
+
+    // Ignore spurious request
+    if (size == 0) {
+        dbg_ensures(mm_checkheap(__LINE__));
+        return bp;
+    }
+
+    // No block or mapping size can hold the request
+    if (size_too_large(size)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // Huge requests get a mapping of their own
+    if (mmap_threshold != 0 && size >= mmap_threshold) {
+        bool fresh;
+        block = huge_alloc(size, &fresh);
+        if (block != NULL) {
+            bp = header_to_payload(block);
+            note_alloc(bp, get_size(block), size, caller);
+        }
+        dbg_ensures(mm_checkheap(__LINE__));
+        return bp;
+    }
+
+    // Adjust block size to include overhead and to meet alignment requirements
+    asize = round_up(size + wsize, dsize);
+
+    // Small requests come from slab runs (cached in bins of their own) once
+    // their arena is large enough, and are regular blocks until then
+    bool slab = slab_enabled && size <= SLAB_MAX;
+
+    // Try the thread cache first
+    if (asize <= tcache_max_size && tcache_count > 0) {
+        tcache_t *tc = get_tcache();
+        size_t got = slab ? slab_size(slab_class(size)) : asize;
+        block = NULL;
+        if (slab) {
+            block = tcache_pop(tc, TCACHE_BINS + slab_class(size));
+        }
+        if (block == NULL) {
+            block = tcache_pop(tc, tcache_bin(asize));
+            got = asize;
+        }
+        if (block != NULL) {
+            tc->counters.tcache_hits++;
+            bp = block->payload;
+            note_alloc(bp, got, size, caller);
+            dbg_ensures(mm_checkheap(__LINE__));
+            return bp;
+        }
+        tc->counters.tcache_misses++;
+    }
+
+    // Initialize heap if it isn't initialized
+    if (heap_start == NULL) {
+#if MM_THREADS
+        pthread_once(&heap_init_once, init_heap);
+#else
+        mm_init();
+#endif
+    }
+
+    arena_t *arena = get_arena();
+#if MAX_ARENAS > 1
+    tcache_t *tc = get_tcache();
+#endif
+    lock_arena(arena);
+#if MAX_ARENAS > 1
+    remote_drain(arena, tc);
+#endif
+    size_t got = 0;
+    if (slab) {
+        bp = slab_alloc(arena, slab_class(size));
+        got = slab_size(slab_class(size));
+    }
+    if (bp == NULL) {
+        block = alloc_block(arena, asize, NULL);
+        if (block != NULL) {
+            bp = header_to_payload(block);
+            got = get_size(block);
+        }
+    }
+    unlock_arena(arena);
+    if (bp != NULL) {
+        note_alloc(bp, got, size, caller);
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    return bp;
+}
+
+/**
+ * @brief Allocates a block with a payload of at least `size` bytes.
+ * @param[in] size
+ * @return The payload of the block, or NULL if `size` is 0 or the heap is
+ *         exhausted
+ */
+void *malloc(size_t size) {
+    return malloc_from(size, __builtin_return_address(0));
+}
+
+/**
+ * @brief Frees a block allocated by malloc, calloc or realloc.
+ *
+ * Slab objects and small blocks are parked in the calling thread's cache
+ * (flushing half of the bin first if it is full). Larger ones are coalesced
+ * into the free lists right away if they belong to the calling thread's
+ * arena, and pushed onto the owning arena's remote free stack otherwise.
+ *
+ * @param[in] bp The block's payload, or NULL
+ */
+void free(void *bp) {
+
+    if (bp == NULL) {
+        return;
+    }
+
+    block_t *block = payload_to_header(bp);
+    slab_t *run = slab_of(bp);
+    note_free(bp, run != NULL ? run->size : get_size(block));
+    if (is_huge(block, run)) {
+        huge_free(block);
+        dbg_ensures(mm_checkheap(__LINE__));
+        return;
+    }
+    size_t bin = tcache_bin_of(block, run);
+
+    // The block should be marked as allocated
+    dbg_assert(run != NULL || get_alloc(block));
+
+    if (bin < TCACHE_ALL_BINS && tcache_count > 0) {
+        tcache_push(get_tcache(), bin, block);
+        tcache_idle(get_tcache());
+        dbg_ensures(mm_checkheap(__LINE__));
+        return;
+    }
+
+    arena_t *arena = block_arena(block);
+#if MAX_ARENAS > 1
+    if (remote_free && arena != get_arena()) {
+        remote_push(arena, block, get_tcache());
+        tcache_idle(get_tcache());
+        dbg_ensures(mm_checkheap(__LINE__));
+        return;
+    }
+#endif
+    lock_arena(arena);
+    if (run != NULL) {
+        slab_free(arena, run, bp);
+    } else {
+        defer_block(arena, block);
+    }
+    unlock_arena(arena);
+    tcache_idle(get_tcache());
+
+    dbg_ensures(mm_checkheap(__LINE__));
+}
+
+/**
+ * @brief
+ *
+ * <What does this function do?>
+ * <What are the function's arguments?>
+ * <What is the function's return value?>
+ * <Are there any preconditions or postconditions?>
+ *
+ * @param[in] ptr
+ * @param[in] size
+ * @return
+ */
+void *realloc(void *ptr, size_t size) {
+    void *caller = __builtin_return_address(0);
+    block_t *block = payload_to_header(ptr);
+    size_t copysize;
+    void *newptr;
+
+    // If size == 0, then free block and return NULL
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+
+    // If ptr is NULL, then equivalent to malloc
+    if (ptr == NULL) {
+        return malloc_from(size, caller);
+    }
+
+    // The original block is left untouched, as when malloc fails
+    if (size_too_large(size)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // A huge block staying huge is remapped
+    slab_t *run = slab_of(ptr);
+    bool huge = is_huge(block, run);
+    bool to_huge = mmap_threshold != 0 && size >= mmap_threshold;
+    if (huge && to_huge) {
+        size_t old_size = get_size(block);
+        block = huge_resize(block, size);
+        if (block != NULL) {
+            note_free(ptr, old_size);
+            note_alloc(header_to_payload(block), get_size(block), size,
+                       caller);
+        }
+        dbg_ensures(mm_checkheap(__LINE__));
+        return block != NULL ? header_to_payload(block) : NULL;
+    }
+
+    // Resize the block where it is if possible (a slab object only if it
+    // still fits its slot)
+    if (!huge && !to_huge) {
+        arena_t *arena = block_arena(block);
+        lock_arena(arena);
+        size_t old_size = run != NULL ? run->size : get_size(block);
+        bool resized = run != NULL
+                           ? size <= run->size
+                           : resize_block(arena, block,
+                                          round_up(size + wsize, dsize));
+        if (!resized) {
+            arena->counters.realloc_copies++;
+        }
+        unlock_arena(arena);
+        if (resized && run == NULL) {
+            note_free(ptr, old_size);
+            note_alloc(ptr, get_size(block), size, caller);
+        }
+        if (resized) {
+            dbg_ensures(mm_checkheap(__LINE__));
+            return ptr;
+        }
+    }
+
+    // Otherwise, proceed with reallocation
+    newptr = malloc_from(size, caller);
+
+    // If malloc fails, the original block is left untouched
+    if (newptr == NULL) {
+        return NULL;
+    }
+
+    // Copy the old data
+    if (run != NULL) {
+        copysize = run->size;
+    } else if (huge) {
+        copysize = get_size(block) - dsize;
+    } else {
+        copysize = get_payload_size(block); // gets size of old payload
+    }
+    if (size < copysize) {
+        copysize = size;
+    }
+    memcpy(newptr, ptr, copysize);
+
+    // Free the old block
+    free(ptr);
+
+    return newptr;
+}
+
+/**
+ * @brief Allocates a zeroed array of `elements` elements of `size` bytes.
+ *
+ * Small arrays come from malloc and are cleared. Larger ones are carved out
+ * of the free lists directly, and only the part of the block that may have
+ * been written since the memory came from mem_sbrk is cleared: whatever
+ * lies below the arena's zero watermark, the free list metadata at the start
+ * of the block, and the footer at its end. An array taken from fresh heap
+ * space is thereby cleared in a few words.
+ *
+ * @param[in] elements
+ * @param[in] size
+ * @return The array, or NULL if it cannot be allocated
+ */
+void *calloc(size_t elements, size_t size) {
+    void *caller = __builtin_return_address(0);
+    void *bp;
+    size_t asize = elements * size;
+
+    if (elements == 0) {
+        return NULL;
+    }
+    if (asize / elements != size) {
+        // Multiplication overflowed
+        return NULL;
+    }
+    if (size_too_large(asize)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // Thread cache and slab sizes: cheaper to clear than to track
+    size_t bsize = round_up(asize + wsize, dsize);
+    if ((bsize <= tcache_max_size && tcache_count > 0) ||
+        (slab_enabled && asize <= SLAB_MAX)) {
+        bp = malloc_from(asize, caller);
+        if (bp == NULL) {
+            return NULL;
+        }
+
+        // Initialize all bits to 0
+        memset(bp, 0, asize);
+
+        return bp;
+    }
+
+    // Huge arrays: a new mapping reads as zero already
+    if (mmap_threshold != 0 && asize >= mmap_threshold) {
+        bool fresh;
+        block_t *block = huge_alloc(asize, &fresh);
+        if (block == NULL) {
+            return NULL;
+        }
+        bp = header_to_payload(block);
+        note_alloc(bp, get_size(block), asize, caller);
+        if (fresh) {
+            get_tcache()->counters.calloc_skipped += asize;
+        } else {
+            get_tcache()->counters.calloc_cleared += asize;
+            memset(bp, 0, asize);
+        }
+        return bp;
+    }
+
+    if (heap_start == NULL) {
+#if MM_THREADS
+        pthread_once(&heap_init_once, init_heap);
+#else
+        mm_init();
+#endif
+    }
+
+    arena_t *arena = get_arena();
+    lock_arena(arena);
+#if MAX_ARENAS > 1
+    remote_drain(arena, get_tcache());
+#endif
+    char *zero;
+    block_t *block = alloc_block(arena, bsize, &zero);
+    if (block == NULL) {
+        unlock_arena(arena);
+        return NULL;
+    }
+    bp = header_to_payload(block);
+
+    // Find what may be dirty: everything up to the watermark or the block's
+    // free list metadata, and the block's footer
+    char *start = bp;
+    char *end = start + asize;
+    char *clean = ((char *)block > zero ? (char *)block : zero) + zero_slack;
+    if (clean > end) {
+        clean = end;
+    }
+    char *footer = (char *)block + get_size(block) - wsize;
+    if (footer < clean) {
+        footer = end;
+    }
+    arena->counters.calloc_cleared += (size_t)(clean - start);
+    arena->counters.calloc_skipped += asize - (size_t)(clean - start);
+    unlock_arena(arena);
+    note_alloc(bp, get_size(block), asize, caller);
+
+    memset(start, 0, (size_t)(clean - start));
+    if (footer < end) {
+        memset(footer, 0, (size_t)(end - footer));
     }
-    memcpy(newptr, ptr, copysize);
 
-    // Free the old block
-    free(ptr);
+    dbg_ensures(mm_checkheap(__LINE__));
+    return bp;
+}
 
-    return newptr;
+/**
+ * @brief Allocates a block whose payload is aligned to `alignment` bytes.
+ *
+ * Every payload is dsize-aligned already, so smaller alignments are plain
+ * mallocs. Larger ones are carved out of a free block by alloc_aligned,
+ * which returns the slack in front of the payload to the free lists. They
+ * always come from the heap, as the payload of a huge block sits a header
+ * past the start of its mapping.
+ *
+ * @param[in] alignment A power of two
+ * @param[in] size
+ * @param[in] caller Return address of the allocator's entry point
+ * @return The payload of the block, or NULL if `size` is 0, `alignment` is
+ *         not a power of two or the heap is exhausted
+ */
+static void *memalign_from(size_t alignment, size_t size, void *caller) {
+    if (alignment <= dsize) {
+        return malloc_from(size, caller);
+    }
+    if (size == 0 || (alignment & (alignment - 1)) != 0 ||
+        size > SIZE_MAX / 2 || alignment > SIZE_MAX / 2 - size) {
+        return NULL;
+    }
+
+    dbg_requires(mm_checkheap(__LINE__));
+
+    if (heap_start == NULL) {
+#if MM_THREADS
+        pthread_once(&heap_init_once, init_heap);
+#else
+        mm_init();
+#endif
+    }
+
+    void *bp = NULL;
+    size_t asize = round_up(size + wsize, dsize);
+    arena_t *arena = get_arena();
+    lock_arena(arena);
+#if MAX_ARENAS > 1
+    remote_drain(arena, get_tcache());
+#endif
+    block_t *block = alloc_aligned(arena, asize, alignment);
+    if (block != NULL) {
+        bp = header_to_payload(block);
+    }
+    unlock_arena(arena);
+    if (bp != NULL) {
+        note_alloc(bp, get_size(block), size, caller);
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    return bp;
 }
 
 /**
- * @brief
+ * @brief Allocates a block whose payload is aligned to `alignment` bytes.
+ * @param[in] alignment A power of two
+ * @param[in] size
+ * @return The payload of the block, or NULL on failure
+ */
+void *memalign(size_t alignment, size_t size) {
+    return memalign_from(alignment, size, __builtin_return_address(0));
+}
+
+/**
+ * @brief Allocates a block whose payload is aligned to `alignment` bytes.
  *
- * <What does this function do?>
- * <What are the function's arguments?>
- * <What is the function's return value?>
- * <Are there any preconditions or postconditions?>
+ * Same as memalign; `size` need not be a multiple of `alignment`.
  *
- * @param[in] elements
+ * @param[in] alignment A power of two
  * @param[in] size
- * @return
+ * @return The payload of the block, or NULL on failure
  */
-void *calloc(size_t elements, size_t size) {
-    void *bp;
-    size_t asize = elements * size;
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign_from(alignment, size, __builtin_return_address(0));
+}
 
-    if (elements == 0) {
-        return NULL;
+/**
+ * @brief Allocates a block whose payload is aligned to `alignment` bytes,
+ *        POSIX style.
+ *
+ * @param[out] memptr Receives the payload, left alone on failure
+ * @param[in] alignment A power of two multiple of sizeof(void *)
+ * @param[in] size
+ * @return 0 on success, EINVAL if `alignment` is invalid, or ENOMEM if the
+ *         heap is exhausted
+ */
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
     }
-    if (asize / elements != size) {
-        // Multiplication overflowed
-        return NULL;
+    void *bp = memalign_from(alignment, size, __builtin_return_address(0));
+    if (bp == NULL && size != 0) {
+        return ENOMEM;
     }
+    *memptr = bp;
+    return 0;
+}
 
-    bp = malloc(asize);
+/**
+ * @brief Returns the number of bytes usable in the payload of a block.
+ *
+ * @param[in] bp A payload returned by malloc, or NULL
+ * @return The usable size, at least the size the block was allocated with,
+ *         or 0 if `bp` is NULL
+ */
+size_t malloc_usable_size(void *bp) {
     if (bp == NULL) {
-        return NULL;
+        return 0;
     }
+    block_t *block = payload_to_header(bp);
+    slab_t *run = slab_of(bp);
+    if (run != NULL) {
+        return run->size;
+    }
+    if (is_huge(block, run)) {
+        return get_size(block) - dsize;
+    }
+    return get_payload_size(block);
+}
+
+/**
+ * @brief Frees a block, given the size it was allocated with.
+ *
+ * A heap block small enough for the thread cache is parked in the bin its
+ * size rounds up to, without reading its header: the size alone tells that
+ * it is not huge, as long as it is below every request served by a mapping
+ * since mm_init. Slab objects still take their bin from their run, as
+ * realloc keeps them in place when they shrink. Everything else is a plain
+ * free.
+ *
+ * @param[in] bp The block's payload, or NULL
+ * @param[in] size The size last passed to malloc, calloc or realloc for it
+ */
+void free_sized(void *bp, size_t size) {
+    if (bp == NULL) {
+        return;
+    }
+    dbg_requires(check_free_size(bp, size));
 
-    // Initialize all bits to 0
-    memset(bp, 0, asize);
+    // No block has such a size: do not let it wrap around
+    if (size_too_large(size)) {
+        free(bp);
+        return;
+    }
 
-    return bp;
+    size_t asize = round_up(size + wsize, dsize);
+#if MM_THREADS
+    size_t min_huge = __atomic_load_n(&mmap_min_size, __ATOMIC_RELAXED);
+#else
+    size_t min_huge = mmap_min_size;
+#endif
+    if (tcache_count == 0 || asize > tcache_max_size || size >= min_huge) {
+        free(bp);
+        return;
+    }
+
+    slab_t *run = slab_of(bp);
+    size_t bin = run != NULL ? TCACHE_BINS + slab_class(run->size)
+                             : tcache_bin(asize);
+    note_free(bp, run != NULL ? run->size : asize);
+    tcache_push(get_tcache(), bin, payload_to_header(bp));
+    tcache_idle(get_tcache());
+    dbg_ensures(mm_checkheap(__LINE__));
+}
+
+/**
+ * @brief Cuts an allocated block into `n` allocated blocks of exactly
+ *        `asize` bytes, as free_sized expects them to be.
+ *
+ * @param[in] arena
+ * @param[in] block An allocated block of `n` * `asize` bytes (alloc_block
+ *            splits off any rest, since sizes are multiples of
+ *            min_block_size)
+ * @param[in] asize
+ * @param[in] n
+ * @param[out] out Receives the payloads of the blocks
+ * @pre The caller holds the arena's lock.
+ */
+static void carve_block(arena_t *arena, block_t *block, size_t asize,
+                        size_t n, void **out) {
+    size_t left = get_size(block);
+    bool prev_alloc = getPrevAlloc(block);
+    bool prev_mini = getPrevMiniStatus(block);
+
+    for (size_t i = 0; i < n; i++) {
+        // Nothing is left over for the last block
+        dbg_assert(i + 1 < n || left == asize);
+        write_block(block, asize, true, prev_alloc, prev_mini);
+        out[i] = header_to_payload(block);
+        left -= asize;
+        prev_alloc = true;
+        prev_mini = asize == min_block_size;
+        block = find_next(block);
+    }
+
+    // The block after the last one may now follow a mini block
+    write_block(block, get_size(block), get_alloc(block), true, prev_mini);
+    arena->counters.batch_carved += n;
+}
+
+/**
+ * @brief Allocates `n` blocks with payloads of at least `size` bytes each.
+ *
+ * Slab-sized requests empty the slots of the arena's runs in a single pass
+ * over their maps. The rest are carved out of one free block of `n` times
+ * the block size, found and split once. Should the heap not have room for
+ * such a block, they are allocated one by one. The thread cache is not
+ * used.
+ *
+ * @param[in] size
+ * @param[in] n
+ * @param[out] out Receives the payloads
+ * @return The number of blocks allocated, fewer than `n` only if the heap
+ *         is exhausted (0 if `size` is 0, or with errno set to ENOMEM if it
+ *         is too large for any block)
+ */
+size_t malloc_batch(size_t size, size_t n, void **out) {
+    void *caller = __builtin_return_address(0);
+    size_t done = 0;
+
+    if (size == 0 || n == 0) {
+        return 0;
+    }
+    if (size_too_large(size)) {
+        errno = ENOMEM;
+        return 0;
+    }
+
+    // Huge requests get a mapping each
+    if (mmap_threshold != 0 && size >= mmap_threshold) {
+        while (done < n && (out[done] = malloc_from(size, caller)) != NULL) {
+            done++;
+        }
+        return done;
+    }
+
+    dbg_requires(mm_checkheap(__LINE__));
+
+    if (heap_start == NULL) {
+#if MM_THREADS
+        pthread_once(&heap_init_once, init_heap);
+#else
+        mm_init();
+#endif
+    }
+
+    size_t asize = round_up(size + wsize, dsize);
+    arena_t *arena = get_arena();
+    lock_arena(arena);
+#if MAX_ARENAS > 1
+    remote_drain(arena, get_tcache());
+#endif
+    if (slab_enabled && size <= SLAB_MAX) {
+        done = slab_alloc_batch(arena, slab_class(size), out, n);
+    }
+
+    size_t left = n - done;
+    block_t *block = NULL;
+    if (left > 1 && left <= SIZE_MAX / asize) {
+        block = alloc_block(arena, left * asize, NULL);
+    }
+    if (block != NULL) {
+        carve_block(arena, block, asize, left, out + done);
+        done = n;
+    }
+    while (done < n && (block = alloc_block(arena, asize, NULL)) != NULL) {
+        out[done++] = header_to_payload(block);
+    }
+    unlock_arena(arena);
+
+    for (size_t i = 0; i < done; i++) {
+        block = payload_to_header(out[i]);
+        slab_t *run = slab_of(out[i]);
+        note_alloc(out[i], run != NULL ? run->size : get_size(block), size,
+                   caller);
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    return done;
+}
+
+/**
+ * @brief qsort comparator ordering payload pointers by address.
+ * @param[in] a
+ * @param[in] b
+ * @return Negative, zero or positive as `a` lies below, at or above `b`
+ */
+static int compare_addr(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)*(void *const *)a;
+    uintptr_t y = (uintptr_t)*(void *const *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Frees `n` blocks at once.
+ *
+ * The payloads are sorted by address, so that blocks lying next to each
+ * other come one after the other. Each run of neighboring heap blocks is
+ * merged into one allocated block first, which is then freed and
+ * coalesced once. Each arena's lock is taken once per stretch of its
+ * blocks. The blocks go straight back to the free lists, bypassing the
+ * thread cache and the quick lists, except those of arenas the calling
+ * thread is not bound to: as in free, they go onto the remote free stacks
+ * of their arenas (when remote_free is set).
+ *
+ * @param[in,out] ptrs The payloads, or NULLs; left sorted by address
+ * @param[in] n
+ */
+void free_batch(void **ptrs, size_t n) {
+    qsort(ptrs, n, sizeof(*ptrs), compare_addr);
+
+#if MAX_ARENAS > 1
+    arena_t *own = get_arena();
+#endif
+    arena_t *locked = NULL;
+    block_t *run = NULL;
+    for (size_t i = 0; i < n; i++) {
+        if (ptrs[i] == NULL) {
+            continue;
+        }
+        block_t *block = payload_to_header(ptrs[i]);
+        slab_t *slab = slab_of(ptrs[i]);
+        note_free(ptrs[i], slab != NULL ? slab->size : get_size(block));
+        if (is_huge(block, slab)) {
+            huge_free(block);
+            continue;
+        }
+        dbg_assert(slab != NULL || get_alloc(block));
+
+        // Extend the run if the block lies right after it
+        if (slab == NULL && run != NULL && find_next(run) == block) {
+            write_block(run, get_size(run) + get_size(block), true,
+                        getPrevAlloc(run), getPrevMiniStatus(run));
+            locked->counters.batch_merged++;
+            continue;
+        }
+
+        if (run != NULL) {
+            free_block(locked, run);
+            run = NULL;
+        }
+        arena_t *arena = block_arena(block);
+#if MAX_ARENAS > 1
+        if (remote_free && arena != own) {
+            remote_push(arena, block, get_tcache());
+            continue;
+        }
+#endif
+        if (arena != locked) {
+            if (locked != NULL) {
+                unlock_arena(locked);
+            }
+            lock_arena(arena);
+            locked = arena;
+        }
+        if (slab != NULL) {
+            slab_free(arena, slab, ptrs[i]);
+        } else {
+            run = block;
+        }
+    }
+    if (run != NULL) {
+        free_block(locked, run);
+    }
+    if (locked != NULL) {
+        unlock_arena(locked);
+    }
+    tcache_idle(get_tcache());
+
+    dbg_ensures(mm_checkheap(__LINE__));
+}
+
+/**
+ * @brief Sets an allocator tuning parameter.
+ *
+ * Changing MM_OPT_TCACHE_COUNT flushes the calling thread's cache; other
+ * threads trim their bins the next time they free into them. Changing the
+ * arena options rebinds every thread on its next allocation; blocks keep
+ * belonging to the arena they came from. MM_OPT_FIT only takes effect at
+ * the next mm_init, as the free lists of a live heap cannot be rebuilt.
+ *
+ * @param[in] param One of the MM_OPT_* constants
+ * @param[in] value
+ * @return True if the parameter was set
+ */
+bool mm_mallopt(int param, long value) {
+    switch (param) {
+    case MM_OPT_TCACHE_COUNT:
+        if (value < 0 || value > tcache_max_count) {
+            return false;
+        }
+        if (heap_start != NULL) {
+            tcache_drain_all(get_tcache());
+        }
+        tcache_count = (unsigned int)value;
+        return true;
+    case MM_OPT_ARENAS:
+        if (value < 0 || value > MAX_ARENAS) {
+            return false;
+        }
+        narenas = value == 0 ? default_narenas() : (unsigned int)value;
+        arena_epoch++;
+        return true;
+    case MM_OPT_SLAB:
+        if (value != 0 && value != 1) {
+            return false;
+        }
+        slab_enabled = value == 1;
+        return true;
+    case MM_OPT_REMOTE_FREE:
+        if (value != 0 && value != 1) {
+            return false;
+        }
+#if MAX_ARENAS > 1
+        remote_free = value == 1;
+#endif
+        return true;
+    case MM_OPT_ARENA_POLICY:
+        if (value != MM_ARENA_ROUND_ROBIN && value != MM_ARENA_BY_CPU) {
+            return false;
+        }
+        arena_policy = (int)value;
+        arena_epoch++;
+        return true;
+    case MM_OPT_FIT:
+        if (value != MM_FIT_SEGLIST && value != MM_FIT_TLSF) {
+            return false;
+        }
+        fit_mode_next = (int)value;
+        return true;
+    case MM_OPT_FIT_CANDIDATES:
+        if (value < 1 || value > fit_candidates_max) {
+            return false;
+        }
+        fit_candidates = (unsigned int)value;
+        return true;
+    case MM_OPT_MMAP_THRESHOLD:
+        if (value < 0) {
+            return false;
+        }
+        mmap_threshold = (size_t)value;
+        return true;
+    case MM_OPT_TRIM_THRESHOLD:
+        if (value < 0) {
+            return false;
+        }
+        trim_threshold = (size_t)value;
+        return true;
+    case MM_OPT_GROW_MAX:
+        if (value < 0) {
+            return false;
+        }
+        grow_max = (size_t)value;
+        return true;
+#if MM_PROF
+    case MM_OPT_PROF_RATE:
+        if (value < 0) {
+            return false;
+        }
+        prof_rate = (size_t)value;
+        return true;
+#endif
+    case MM_OPT_DEFER:
+        if (value != 0 && value != 1) {
+            return false;
+        }
+        defer_enabled = value == 1;
+        if (!defer_enabled && heap_start != NULL) {
+            for (size_t a = 0; a < MAX_ARENAS; a++) {
+                lock_arena(&arenas[a]);
+                defer_merge(&arenas[a]);
+                unlock_arena(&arenas[a]);
+            }
+        }
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief Reads the event counters, summed over all arenas and thread caches.
+ *
+ * @param[out] counters
+ */
+void mm_get_counters(mm_counters_t *counters) {
+    mm_counters_t sum = {0};
+
+    for (size_t i = 0; i < MAX_ARENAS; i++) {
+        lock_arena(&arenas[i]);
+        counters_add(&sum, &arenas[i].counters);
+        unlock_arena(&arenas[i]);
+    }
+
+    lock_heap();
+#if MM_THREADS
+    counters_add(&sum, &tcache_retired);
+    for (tcache_t *tc = tcache_live; tc != NULL; tc = tc->live_next) {
+        if (tc->epoch == heap_epoch) {
+            counters_add(&sum, &tc->counters);
+        }
+    }
+#else
+    if (tcache.epoch == heap_epoch) {
+        counters_add(&sum, &tcache.counters);
+    }
+#endif
+    unlock_heap();
+
+    *counters = sum;
+}
+
+#if MM_STATS
+/**
+ * @brief Returns the size of the largest block on an arena's free lists.
+ *
+ * The largest non-empty class is found from the block counts. Only the
+ * list it lies in is walked, and the tree of the top seglist class only
+ * down its right spine.
+ *
+ * @param[in] arena
+ * @return The size of the block, or 0 if the free lists are empty
+ * @pre The caller holds the arena's lock.
+ */
+static size_t largest_free(arena_t *arena) {
+    size_t largest = 0;
+
+    if (fit_mode == MM_FIT_TLSF && arena->tlsf_fl_map != 0) {
+        size_t fl = 63 - (size_t)__builtin_clzll(arena->tlsf_fl_map);
+        size_t sl = 63 - (size_t)__builtin_clzll(arena->tlsf_sl_map[fl]);
+        for (block_t *block = arena->tlsf[fl][sl]; block != NULL;
+             block = block->next) {
+            largest = max(largest, get_size(block));
+        }
+        return largest;
+    }
+
+    size_t i = NUMCLASS;
+    while (i > 0 && arena->free_blocks[i - 1] == 0) {
+        i--;
+    }
+    if (i == 0) {
+        return 0;
+    }
+    i--;
+    if (i == 0 || fit_mode == MM_FIT_TLSF) {
+        // Only mini blocks are left
+        return min_block_size;
+    }
+    if (i == TREE_CLASS) {
+        block_t *node = arena->head[TREE_CLASS];
+        while (node->right != NULL) {
+            node = node->right;
+        }
+        return get_size(node);
+    }
+    block_t *block = arena->head[i];
+    do {
+        largest = max(largest, get_size(block));
+        block = block->next;
+    } while (block != arena->head[i]);
+    return largest;
+}
+#endif
+
+/**
+ * @brief Reads a snapshot of the heap.
+ *
+ * Allocations and frees are counted in the calling thread's counters, and
+ * the free lists keep their arena's totals as blocks come and go, so this
+ * only has to add them up. Blocks held in thread caches, quick lists and
+ * empty slab slots are neither allocated nor on the free lists.
+ *
+ * @param[out] stats
+ */
+void mm_get_stats(mm_stats_t *stats) {
+    mm_stats_t sum = {0};
+
+#if MM_STATS
+    mm_counters_t counters;
+    mm_get_counters(&counters);
+    sum.allocated_bytes = counters.alloc_bytes - counters.freed_bytes;
+    sum.allocated_blocks = counters.allocs - counters.frees;
+    sum.sbrk_calls = counters.heap_extends + counters.heap_trims;
+
+    for (size_t a = 0; a < MAX_ARENAS; a++) {
+        arena_t *arena = &arenas[a];
+        lock_arena(arena);
+        sum.heap_bytes += arena->heap_size;
+        sum.free_bytes += arena->free_bytes;
+        for (size_t i = 0; i < NUMCLASS; i++) {
+            sum.free_blocks[i] += arena->free_blocks[i];
+        }
+        sum.largest_free = max(sum.largest_free, largest_free(arena));
+        unlock_arena(arena);
+    }
+
+    lock_heap();
+    sum.heap_bytes += mmap_bytes;
+    unlock_heap();
+
+    if (sum.free_bytes > 0) {
+        sum.fragmentation =
+            1.0 - (double)sum.largest_free / (double)sum.free_bytes;
+    }
+#endif
+
+    *stats = sum;
+}
+
+/**
+ * @brief Writes the heap profile: the bytes and blocks allocated at each
+ *        call site, and those still in use, as estimated from the samples.
+ *
+ * Sites are listed by bytes in use, largest first, each with its frames
+ * (caller first). The sites are copied under the lock and printed after
+ * it is released, as printing may allocate.
+ *
+ * @param[in] out
+ */
+void mm_prof_dump(FILE *out) {
+#if MM_PROF
+    prof_site_t sites[PROF_SITES];
+    size_t nsites = 0;
+    size_t live_bytes = 0;
+    size_t alloc_bytes = 0;
+
+    lock_heap();
+    for (size_t i = 0; i < PROF_SITES; i++) {
+        if (prof_sites[i].pc[0] != NULL) {
+            sites[nsites++] = prof_sites[i];
+            live_bytes += prof_sites[i].live_bytes;
+            alloc_bytes += prof_sites[i].alloc_bytes;
+        }
+    }
+    size_t nlive = prof_nlive;
+    size_t dropped = prof_dropped;
+    unlock_heap();
+
+    // Insertion sort by bytes in use
+    for (size_t i = 1; i < nsites; i++) {
+        prof_site_t site = sites[i];
+        size_t j = i;
+        while (j > 0 && sites[j - 1].live_bytes < site.live_bytes) {
+            sites[j] = sites[j - 1];
+            j--;
+        }
+        sites[j] = site;
+    }
+
+    fprintf(out,
+            "heap profile: %zu bytes in use, %zu allocated, 1 sample per "
+            "%zu bytes (%zu live, %zu dropped)\n",
+            live_bytes, alloc_bytes, prof_rate, nlive, dropped);
+    fprintf(out, "%14s %12s %14s %12s  call stack\n", "in-use bytes",
+            "in-use objs", "alloc bytes", "alloc objs");
+    for (size_t i = 0; i < nsites; i++) {
+        fprintf(out, "%14zu %12zu %14zu %12zu ", sites[i].live_bytes,
+                sites[i].live_objs, sites[i].alloc_bytes,
+                sites[i].alloc_objs);
+        for (size_t d = 0; d < PROF_DEPTH && sites[i].pc[d] != NULL; d++) {
+            fprintf(out, " %p", sites[i].pc[d]);
+        }
+        fprintf(out, "\n");
+    }
+#else
+    fprintf(out, "heap profile: not built in (MM_PROF=0)\n");
+#endif
 }
 
 /*
@@ -6,6 +6,98 @@
 #include <stdio.h>
 #include <stdbool.h>
 
+/**
+ * @brief Event counters maintained by the allocator.
+ *
+ * Every member is a `size_t` count of events since the last mm_init.
+ */
+typedef struct {
+    size_t tcache_hits;    /* mallocs served from the thread cache */
+    size_t tcache_misses;  /* cacheable mallocs that found their bin empty */
+    size_t tcache_flushes; /* batch flushes of a full bin */
+    size_t tcache_flushed; /* blocks returned to the free lists by flushes */
+    size_t remote_frees;   /* frees pushed onto another arena's remote stack */
+    size_t remote_drains;  /* remote stacks emptied into the free lists */
+    size_t remote_drained; /* blocks freed by those drains */
+    size_t slab_runs;      /* slab runs carved out of the heap */
+    size_t slab_releases;  /* empty slab runs given back to the heap */
+    size_t fit_searches;   /* free list searches for a fitting block */
+    size_t fit_scanned;    /* free blocks those searches passed over */
+    size_t fit_skipped;    /* empty classes they jumped over */
+
+    size_t realloc_shrinks;    /* reallocs shrinking (or keeping) in place */
+    size_t realloc_grows;      /* reallocs absorbing the next free block */
+    size_t realloc_copies;     /* reallocs that had to move the block */
+    size_t calloc_cleared;     /* bytes calloc had to clear */
+    size_t calloc_skipped;     /* bytes calloc knew to be zero already */
+    size_t defer_frees;        /* frees that deferred coalescing */
+    size_t defer_hits;         /* allocations served from quick lists */
+    size_t defer_merges;       /* batch coalescing passes */
+    size_t defer_merged;       /* deferred blocks those passes coalesced */
+    size_t heap_trims;         /* frees that shrank the heap */
+    size_t heap_trimmed;       /* bytes given back by those frees */
+    size_t mmap_allocs;        /* huge blocks given a new mapping */
+    size_t mmap_reuses;        /* huge blocks given a cached mapping */
+    size_t mmap_remaps;        /* huge blocks resized by remapping */
+    size_t heap_extends;       /* extensions of the heap by mem_sbrk */
+    size_t heap_extended;      /* bytes added by those extensions */
+    size_t batch_carved;       /* batch blocks carved out of one free block */
+    size_t batch_merged;       /* batch frees merged into a neighbor first */
+    size_t allocs;             /* blocks handed out (0 without MM_STATS) */
+    size_t alloc_bytes;        /* bytes those blocks occupy */
+    size_t frees;              /* blocks given back (0 without MM_STATS) */
+    size_t freed_bytes;        /* bytes those blocks occupied */
+} mm_counters_t;
+
+/* Number of size classes mm_stats_t breaks free blocks down into (mm.c's
+ * class_map is written out for 32) */
+#define MM_STATS_CLASSES 32
+
+/**
+ * @brief A snapshot of the heap, as returned by mm_get_stats.
+ *
+ * Block sizes include their header, slab objects count at their slot size
+ * and huge blocks at the length of their mapping.
+ */
+typedef struct {
+    size_t heap_bytes;       /* bytes obtained by mem_sbrk and mem_mmap */
+    size_t allocated_bytes;  /* bytes in blocks the application holds */
+    size_t allocated_blocks; /* blocks the application holds */
+    size_t free_bytes;       /* bytes in blocks on the free lists */
+    size_t free_blocks[MM_STATS_CLASSES]; /* free blocks, by size class */
+    size_t largest_free;     /* size of the largest free block */
+    size_t sbrk_calls;       /* calls to mem_sbrk growing or trimming */
+    double fragmentation;    /* 1 - largest_free / free_bytes */
+} mm_stats_t;
+
+/* Tunable parameters accepted by mm_mallopt */
+enum {
+    MM_OPT_TCACHE_COUNT = 1, /* Blocks kept per thread cache bin (0 = off) */
+    MM_OPT_ARENAS,           /* Number of arenas (0 = one per online CPU) */
+    MM_OPT_ARENA_POLICY,     /* How threads are bound to arenas (MM_ARENA_*) */
+    MM_OPT_REMOTE_FREE,      /* Defer frees into other arenas (0 or 1) */
+    MM_OPT_SLAB,             /* Serve requests <= 256 bytes from slab runs */
+    MM_OPT_FIT,              /* Placement engine (MM_FIT_*), from next init */
+    MM_OPT_FIT_CANDIDATES,   /* Seglist fits compared per class (1 = first) */
+    MM_OPT_DEFER,            /* Defer coalescing of small frees (0 or 1) */
+    MM_OPT_TRIM_THRESHOLD,   /* Free heap top (bytes) to trim (0 = never) */
+    MM_OPT_MMAP_THRESHOLD,   /* Request (bytes) to map apart (0 = never) */
+    MM_OPT_GROW_MAX,         /* Largest heap extension (bytes) */
+    MM_OPT_PROF_RATE,        /* Mean bytes between samples (0 = off) */
+};
+
+/* Values of MM_OPT_FIT */
+enum {
+    MM_FIT_SEGLIST = 0, /* Segregated lists, first fit within a class */
+    MM_FIT_TLSF,        /* Two-level segregated fit: O(1) malloc and free */
+};
+
+/* Values of MM_OPT_ARENA_POLICY */
+enum {
+    MM_ARENA_ROUND_ROBIN = 0, /* Threads take arenas in turn and keep them */
+    MM_ARENA_BY_CPU,          /* Each call uses the arena of the current CPU */
+};
+
 #ifdef DRIVER
 
 /* declare functions for driver tests */
@@ -13,6 +105,13 @@ extern void *mm_malloc(size_t size);
 extern void mm_free(void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc(size_t nmemb, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+extern int mm_posix_memalign(void **memptr, size_t alignment, size_t size);
+extern size_t mm_usable_size(void *ptr);
+extern void mm_free_sized(void *ptr, size_t size);
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+extern void mm_free_batch(void **ptrs, size_t n);
 
 #else
 
@@ -56,6 +155,75 @@ extern void *realloc(void *ptr, size_t size);
  * @return A pointer to the first element of the array.
  */
 extern void *calloc(size_t nmemb, size_t size);
+
+/**
+ * @brief  Allocate memory of at least `size` bytes aligned to `alignment`.
+ *
+ * @param[in] alignment  The alignment of the payload, a power of two.
+ * @param[in] size  The minimum size of bytes to allocate.
+ *
+ * @return  A pointer to the beginning of the allocated bytes, or NULL.
+ */
+extern void *memalign(size_t alignment, size_t size);
+
+/**
+ * @brief  Allocate memory of at least `size` bytes aligned to `alignment`.
+ *
+ * @param[in] alignment  The alignment of the payload, a power of two.
+ * @param[in] size  The minimum size of bytes to allocate.
+ *
+ * @return  A pointer to the beginning of the allocated bytes, or NULL.
+ */
+extern void *aligned_alloc(size_t alignment, size_t size);
+
+/**
+ * @brief  Allocate memory of at least `size` bytes aligned to `alignment`.
+ *
+ * @param[out] memptr  Receives a pointer to the allocated bytes.
+ * @param[in] alignment  The alignment of the payload, a power of two
+ *                       multiple of sizeof(void *).
+ * @param[in] size  The minimum size of bytes to allocate.
+ *
+ * @return  0 on success, EINVAL or ENOMEM otherwise.
+ */
+extern int posix_memalign(void **memptr, size_t alignment, size_t size);
+
+/**
+ * @brief  Return the number of usable bytes in an allocated block.
+ *
+ * @param[in] ptr  A pointer to the beginning of the allocated payload.
+ *
+ * @return  The usable size, at least the size it was allocated with.
+ */
+extern size_t malloc_usable_size(void *ptr);
+
+/**
+ * @brief  Marks an allocated block of known size as free.
+ *
+ * @param[in] ptr  A pointer to the beginning of the allocated payload.
+ * @param[in] size  The size last passed to malloc, calloc or realloc.
+ */
+extern void free_sized(void *ptr, size_t size);
+
+/**
+ * @brief  Allocate `n` blocks of at least `size` bytes each.
+ *
+ * @param[in] size  The minimum size of bytes of each block.
+ * @param[in] n  The number of blocks to allocate.
+ * @param[out] out  Receives pointers to the allocated payloads.
+ *
+ * @return  The number of blocks allocated, fewer than `n` on failure.
+ */
+extern size_t malloc_batch(size_t size, size_t n, void **out);
+
+/**
+ * @brief  Marks `n` allocated blocks as free.
+ *
+ * @param[in,out] ptrs  Pointers to the payloads (or NULLs), which are
+ *                      reordered.
+ * @param[in] n  The number of pointers.
+ */
+extern void free_batch(void **ptrs, size_t n);
 #endif
 
 /**
@@ -74,3 +242,46 @@ extern bool mm_init(void);
  * @return  True if the heap is consistent, False otherwise.
  */
 extern bool mm_checkheap(int line);
+
+/**
+ * @brief  Set an allocator tuning parameter.
+ *
+ * Parameters keep their value across mm_init, so a driver can set them once
+ * before running its traces.
+ *
+ * @param[in] param  One of the MM_OPT_* constants.
+ * @param[in] value  The new value of the parameter.
+ *
+ * @return  True if the parameter was set, False if `param` is unknown or
+ *          `value` is out of range.
+ */
+extern bool mm_mallopt(int param, long value);
+
+/**
+ * @brief  Read the allocator's event counters.
+ *
+ * @param[out] counters  Receives the counters summed over all threads.
+ */
+extern void mm_get_counters(mm_counters_t *counters);
+
+/**
+ * @brief  Read a snapshot of the heap.
+ *
+ * The figures are kept up to date as the heap changes, so the call is cheap
+ * enough to poll. All of them are zero when the allocator was built with
+ * MM_STATS=0.
+ *
+ * @param[out] stats  Receives the snapshot.
+ */
+extern void mm_get_stats(mm_stats_t *stats);
+
+/**
+ * @brief  Write the sampling heap profile.
+ *
+ * Lists, for each call site, the bytes and blocks still in use and those
+ * allocated since mm_init, as estimated from the allocations sampled while
+ * MM_OPT_PROF_RATE was set.
+ *
+ * @param[in] out  The stream to write to.
+ */
+extern void mm_prof_dump(FILE *out);
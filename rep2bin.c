@@ -0,0 +1,159 @@
+/*
+ * rep2bin.c - Convert a text trace (.rep) into a binary trace
+ *
+ * The drivers map binary traces (see tracefmt.h) and decode requests
+ * as they replay them, instead of parsing and storing every line of a
+ * text trace first. The two forms of a trace replay the same requests.
+ *
+ * usage: rep2bin [-h] [-z] <in.rep> <out>
+ */
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tracefmt.h"
+
+#define MAXLINE 1024
+
+static void app_error(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2), noreturn));
+static void usage(char *prog);
+
+/*
+ * convert - Encode the first num_ops request lines of in into w, checking
+ *     them as read_trace does. Returns the highest block index.
+ */
+static int convert(FILE *in, const char *filename, int num_ops,
+                   tf_writer_t *w)
+{
+    char type[MAXLINE];
+    tf_op_t op;
+    int max_index = 0;
+    int thread = 0;
+
+    while (w->header.num_ops < (uint64_t)num_ops &&
+           fscanf(in, "%s", type) == 1)
+    {
+        int n;
+
+        memset(&op, 0, sizeof(op));
+        switch (type[0])
+        {
+        case 't':
+            if (fscanf(in, "%d", &thread) != 1 || thread < 0)
+                app_error("%s: bad thread number\n", filename);
+            continue;
+        case 'a':
+            op.type = TF_ALLOC;
+            n = fscanf(in, "%d %zu", &op.index, &op.size) - 2;
+            break;
+        case 'r':
+            op.type = TF_REALLOC;
+            n = fscanf(in, "%d %zu", &op.index, &op.size) - 2;
+            break;
+        case 'f':
+            op.type = TF_FREE;
+            n = fscanf(in, "%d", &op.index) - 1;
+            break;
+        case 'm':
+            op.type = TF_MEMALIGN;
+            n = fscanf(in, "%d %zu %zu", &op.index, &op.size, &op.align) - 3;
+            if (n == 0 && (op.align == 0 || (op.align & (op.align - 1)) != 0))
+                app_error("%s: alignment %zu is not a power of two\n",
+                          filename, op.align);
+            break;
+        default:
+            app_error("%s: bogus type character (%c)\n", filename, type[0]);
+        }
+        if (n != 0 || op.index < (op.type == TF_FREE ? -1 : 0))
+            app_error("%s: bad request %" PRIu64 "\n", filename,
+                      w->header.num_ops);
+        op.thread = thread;
+        if (op.index > max_index)
+            max_index = op.index;
+        if (!tf_write_op(w, &op))
+            app_error("%s: write failed\n", filename);
+    }
+    return max_index;
+}
+
+int main(int argc, char **argv)
+{
+    FILE *in, *out;
+    tf_writer_t w;
+    bool compress = false;
+    int c, weight, num_ids, num_ops;
+    size_t data_bytes;
+
+    while ((c = getopt(argc, argv, "zh")) != EOF)
+    {
+        switch (c)
+        {
+        case 'z':
+            compress = true;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != 2)
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    if ((in = fopen(argv[optind], "r")) == NULL)
+        app_error("Could not open %s\n", argv[optind]);
+    if (fscanf(in, "%d %d %d %zu", &weight, &num_ids, &num_ops,
+               &data_bytes) != 4 ||
+        weight < 0 || weight > 3 || num_ids < 0 || num_ops < 0)
+        app_error("%s: bad header\n", argv[optind]);
+
+    if ((out = fopen(argv[optind + 1], "wb")) == NULL)
+        app_error("Could not create %s\n", argv[optind + 1]);
+    if (!tf_writer_open(&w, out, compress))
+        app_error("%s: write failed\n", argv[optind + 1]);
+
+    if (convert(in, argv[optind], num_ops, &w) != num_ids - 1 ||
+        w.header.num_ops != (uint64_t)num_ops)
+        app_error("%s: requests do not match the header\n", argv[optind]);
+
+    w.header.weight = (uint32_t)weight;
+    w.header.num_ids = (uint32_t)num_ids;
+    w.header.data_bytes = data_bytes;
+    if (!tf_writer_close(&w) || fclose(out) != 0)
+        app_error("%s: write failed\n", argv[optind + 1]);
+    fclose(in);
+    return 0;
+}
+
+/*
+ * app_error - Report an arbitrary application error
+ */
+static void app_error(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    exit(1);
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(char *prog)
+{
+    fprintf(stderr, "Usage: %s [-h] [-z] <in.rep> <out>\n", prog);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-z         Compress the blocks of requests.\n");
+}
@@ -0,0 +1,422 @@
+/*
+ * Binary trace format for the malloc lab drivers
+ *
+ * Compression is a small LZ77 in the style of LZ4: each sequence is a token
+ * byte holding a literal count and a match length in its two halves, the
+ * literals, then a 16-bit offset back into the decoded data. A half of 15
+ * is continued by bytes added on until one is below 255. The last sequence
+ * has literals only.
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tracefmt.h"
+
+/* Most bytes a request can take once encoded */
+#define TF_MAX_OP 24
+
+/* Largest block, decoded */
+#define TF_MAX_BLOCK (TF_BLOCK_OPS * TF_MAX_OP)
+
+/* Tag bits */
+#define TAG_TYPE 0x3
+#define TAG_THREAD 0x4
+#define TAG_SAME_SIZE 0x8
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+
+static unsigned char *put_varint(unsigned char *p, uint64_t v);
+static bool get_varint(const unsigned char **p, const unsigned char *end,
+                       uint64_t *v);
+static bool flush_block(tf_writer_t *w);
+static bool next_block(tf_reader_t *r);
+static size_t compress(const unsigned char *src, size_t len,
+                       unsigned char *dst, size_t cap);
+static bool decompress(const unsigned char *src, size_t len,
+                       unsigned char *dst, size_t dst_len);
+
+bool tf_writer_open(tf_writer_t *w, FILE *out, bool compress)
+{
+    memset(w, 0, sizeof(*w));
+    w->out = out;
+    memcpy(w->header.magic, TF_MAGIC, TF_MAGIC_LEN);
+    w->header.flags = compress ? TF_COMPRESS : 0;
+    w->raw = malloc(TF_MAX_BLOCK);
+    if (compress)
+        w->packed = malloc(TF_MAX_BLOCK);
+    if (w->raw == NULL || (compress && w->packed == NULL))
+        return false;
+
+    /* The header is written again, filled in, by tf_writer_close */
+    return fwrite(&w->header, sizeof(w->header), 1, out) == 1;
+}
+
+bool tf_write_op(tf_writer_t *w, const tf_op_t *op)
+{
+    unsigned char *p = w->raw + w->raw_len;
+    unsigned char *tag = p++;
+    int64_t delta = (int64_t)op->index - w->index;
+
+    *tag = (unsigned char)(op->type & TAG_TYPE);
+    if (op->thread != w->thread)
+    {
+        *tag |= TAG_THREAD;
+        p = put_varint(p, (uint64_t)op->thread);
+    }
+    p = put_varint(p, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+    if (op->size == w->size)
+        *tag |= TAG_SAME_SIZE;
+    else
+        p = put_varint(p, op->size);
+    if (op->type == TF_MEMALIGN)
+    {
+        unsigned char shift = 0;
+        while (((size_t)1 << shift) < op->align)
+            shift++;
+        *p++ = shift;
+    }
+
+    w->raw_len = (size_t)(p - w->raw);
+    w->index = op->index;
+    w->size = op->size;
+    w->thread = op->thread;
+    w->header.num_ops++;
+    if ((uint32_t)op->thread >= w->header.num_threads)
+        w->header.num_threads = (uint32_t)op->thread + 1;
+
+    if (++w->block_ops == TF_BLOCK_OPS)
+        return flush_block(w);
+    return true;
+}
+
+bool tf_writer_close(tf_writer_t *w)
+{
+    bool ok = flush_block(w);
+
+    if (ok)
+        ok = fseek(w->out, 0, SEEK_SET) == 0 &&
+             fwrite(&w->header, sizeof(w->header), 1, w->out) == 1;
+    free(w->raw);
+    free(w->packed);
+    w->raw = w->packed = NULL;
+    return ok && !ferror(w->out);
+}
+
+const tf_header_t *tf_check(const void *map, size_t len)
+{
+    const tf_header_t *header = map;
+
+    if (len < sizeof(*header) ||
+        memcmp(header->magic, TF_MAGIC, TF_MAGIC_LEN) != 0)
+        return NULL;
+    if ((header->flags & ~(uint32_t)TF_COMPRESS) != 0 ||
+        header->num_ids > INT_MAX || header->num_ops > INT_MAX ||
+        header->num_threads > INT_MAX)
+        return NULL;
+    return header;
+}
+
+void tf_reader_init(tf_reader_t *r, const void *map, size_t len)
+{
+    memset(r, 0, sizeof(*r));
+    r->start = (const unsigned char *)map + sizeof(tf_header_t);
+    r->limit = (const unsigned char *)map + len;
+    tf_reader_rewind(r);
+}
+
+void tf_reader_rewind(tf_reader_t *r)
+{
+    r->p = r->end = r->next = r->start;
+}
+
+bool tf_read_op(tf_reader_t *r, tf_op_t *op)
+{
+    const unsigned char *p, *end;
+    unsigned char tag;
+    uint64_t v;
+    int64_t index;
+
+    while (r->p == r->end)
+        if (!next_block(r))
+            return false;
+    p = r->p;
+    end = r->end;
+    tag = *p++;
+
+    if (tag & TAG_THREAD)
+    {
+        if (!get_varint(&p, end, &v) || v > INT_MAX)
+            return false;
+        r->thread = (int)v;
+    }
+    if (!get_varint(&p, end, &v))
+        return false;
+    index = r->index + (int64_t)((v >> 1) ^ -(v & 1));
+    /* Only a free(NULL) has no block */
+    if (index < ((tag & TAG_TYPE) == TF_FREE ? -1 : 0) || index > INT_MAX)
+        return false;
+    r->index = (int)index;
+    if (!(tag & TAG_SAME_SIZE))
+    {
+        if (!get_varint(&p, end, &v))
+            return false;
+        r->size = (size_t)v;
+    }
+
+    op->type = tag & TAG_TYPE;
+    op->index = r->index;
+    op->size = r->size;
+    op->thread = r->thread;
+    op->align = 0;
+    if (op->type == TF_MEMALIGN)
+    {
+        if (p == end || *p >= sizeof(size_t) * CHAR_BIT)
+            return false;
+        op->align = (size_t)1 << *p++;
+    }
+    r->p = p;
+    return true;
+}
+
+void tf_reader_free(tf_reader_t *r)
+{
+    free(r->buf);
+    r->buf = NULL;
+}
+
+/* put_varint - Write v 7 bits at a time, low bits first */
+static unsigned char *put_varint(unsigned char *p, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        *p++ = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (unsigned char)v;
+    return p;
+}
+
+/* get_varint - Read a varint at *p, which must end before end */
+static bool get_varint(const unsigned char **p, const unsigned char *end,
+                       uint64_t *v)
+{
+    const unsigned char *q = *p;
+    unsigned shift;
+
+    *v = 0;
+    for (shift = 0; shift < 64 && q < end; shift += 7)
+    {
+        unsigned char b = *q++;
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+        {
+            *p = q;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* flush_block - Write out the block being encoded, compressed if smaller */
+static bool flush_block(tf_writer_t *w)
+{
+    uint32_t lens[2];
+    const unsigned char *data = w->raw;
+
+    if (w->block_ops == 0)
+        return true;
+    lens[0] = lens[1] = (uint32_t)w->raw_len;
+    if (w->packed != NULL)
+    {
+        size_t len = compress(w->raw, w->raw_len, w->packed, w->raw_len - 1);
+        if (len > 0)
+        {
+            lens[1] = (uint32_t)len;
+            data = w->packed;
+        }
+    }
+    if (fwrite(lens, sizeof(lens), 1, w->out) != 1 ||
+        fwrite(data, 1, lens[1], w->out) != lens[1])
+        return false;
+
+    w->raw_len = 0;
+    w->block_ops = 0;
+    w->index = 0;
+    w->size = 0;
+    w->thread = 0;
+    return true;
+}
+
+/* next_block - Move on to the next block, decompressing it if needed */
+static bool next_block(tf_reader_t *r)
+{
+    uint32_t lens[2];
+    const unsigned char *data;
+
+    if ((size_t)(r->limit - r->next) < sizeof(lens))
+        return false;
+    memcpy(lens, r->next, sizeof(lens));
+    data = r->next + sizeof(lens);
+    if (lens[1] > lens[0] || lens[0] > TF_MAX_BLOCK ||
+        lens[1] > (size_t)(r->limit - data))
+        return false;
+    r->next = data + lens[1];
+
+    if (lens[1] == lens[0])
+        r->p = data;
+    else
+    {
+        if (r->buf == NULL && (r->buf = malloc(TF_MAX_BLOCK)) == NULL)
+            return false;
+        if (!decompress(data, lens[1], r->buf, lens[0]))
+            return false;
+        r->p = r->buf;
+    }
+    r->end = r->p + lens[0];
+    r->index = 0;
+    r->size = 0;
+    r->thread = 0;
+    return true;
+}
+
+/* put_sequence - Append literals and a match to dst, if they fit */
+static bool put_sequence(unsigned char **dst, const unsigned char *dst_end,
+                         const unsigned char *lit, size_t lit_len,
+                         size_t offset, size_t match_len)
+{
+    unsigned char *d = *dst;
+    size_t extra = match_len > 0 ? match_len - LZ_MIN_MATCH : 0;
+    size_t need = 1 + lit_len / 255 + 1 + lit_len + 2 + extra / 255 + 1;
+    size_t n;
+
+    if (need > (size_t)(dst_end - d))
+        return false;
+    *d++ = (unsigned char)(((lit_len < 15 ? lit_len : 15) << 4) |
+                           (extra < 15 ? extra : 15));
+    if (lit_len >= 15)
+    {
+        for (n = lit_len - 15; n >= 255; n -= 255)
+            *d++ = 255;
+        *d++ = (unsigned char)n;
+    }
+    memcpy(d, lit, lit_len);
+    d += lit_len;
+    if (match_len > 0)
+    {
+        *d++ = (unsigned char)offset;
+        *d++ = (unsigned char)(offset >> 8);
+        if (extra >= 15)
+        {
+            for (n = extra - 15; n >= 255; n -= 255)
+                *d++ = 255;
+            *d++ = (unsigned char)n;
+        }
+    }
+    *dst = d;
+    return true;
+}
+
+/*
+ * compress - Compress src into at most cap bytes of dst. Returns the
+ *     compressed length, or 0 if it does not fit.
+ */
+static size_t compress(const unsigned char *src, size_t len,
+                       unsigned char *dst, size_t cap)
+{
+    uint32_t table[1 << LZ_HASH_BITS]; /* 1 + last position of each hash */
+    unsigned char *d = dst;
+    size_t i = 0, anchor = 0;
+
+    memset(table, 0, sizeof(table));
+    while (i + LZ_MIN_MATCH <= len)
+    {
+        uint32_t v, w, h;
+        size_t cand, m;
+
+        memcpy(&v, src + i, sizeof(v));
+        h = (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+        cand = table[h];
+        table[h] = (uint32_t)(i + 1);
+        if (cand == 0 || i + 1 - cand > LZ_MAX_OFFSET)
+        {
+            i++;
+            continue;
+        }
+        cand--;
+        memcpy(&w, src + cand, sizeof(w));
+        if (w != v)
+        {
+            i++;
+            continue;
+        }
+
+        for (m = LZ_MIN_MATCH; i + m < len && src[cand + m] == src[i + m]; m++)
+            ;
+        if (!put_sequence(&d, dst + cap, src + anchor, i - anchor, i - cand, m))
+            return 0;
+        i += m;
+        anchor = i;
+    }
+    if (!put_sequence(&d, dst + cap, src + anchor, len - anchor, 0, 0))
+        return 0;
+    return (size_t)(d - dst);
+}
+
+/* get_length - Read the bytes continuing a length of 15 */
+static bool get_length(const unsigned char **src, const unsigned char *end,
+                       size_t *len)
+{
+    unsigned char b;
+
+    do
+    {
+        if (*src == end)
+            return false;
+        b = *(*src)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+/* decompress - Decompress src, which must decode to exactly dst_len bytes */
+static bool decompress(const unsigned char *src, size_t len,
+                       unsigned char *dst, size_t dst_len)
+{
+    const unsigned char *s = src, *s_end = src + len;
+    unsigned char *d = dst, *d_end = dst + dst_len;
+
+    while (s < s_end)
+    {
+        unsigned char token = *s++;
+        size_t lit_len = token >> 4, match_len = token & 15, offset;
+
+        if (lit_len == 15 && !get_length(&s, s_end, &lit_len))
+            return false;
+        if (lit_len > (size_t)(s_end - s) || lit_len > (size_t)(d_end - d))
+            return false;
+        memcpy(d, s, lit_len);
+        s += lit_len;
+        d += lit_len;
+        if (s == s_end)
+            break;
+
+        if (s_end - s < 2)
+            return false;
+        offset = (size_t)s[0] | (size_t)s[1] << 8;
+        s += 2;
+        if (match_len == 15 && !get_length(&s, s_end, &match_len))
+            return false;
+        match_len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(d - dst) ||
+            match_len > (size_t)(d_end - d))
+            return false;
+        /* Byte by byte, since the match may overlap what it copies */
+        for (; match_len > 0; match_len--, d++)
+            *d = *(d - offset);
+    }
+    return d == d_end;
+}
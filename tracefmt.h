@@ -0,0 +1,124 @@
+/*
+ * Binary trace format for the malloc lab drivers
+ *
+ * A binary trace starts with a fixed header (tf_header_t), followed by the
+ * requests in blocks of up to TF_BLOCK_OPS. Each block starts with two
+ * 32-bit lengths, of the block as decoded and as stored; they differ only
+ * if the block is compressed. Uncompressed blocks are decoded straight from
+ * the mapped file, compressed ones into a buffer one block at a time.
+ *
+ * Each request is a tag byte followed by varints (7 bits per byte, low
+ * bits first):
+ *   tag bits 0-1  type: TF_ALLOC, TF_FREE, TF_REALLOC or TF_MEMALIGN
+ *   tag bit 2     the thread changes, and its number follows
+ *   tag bit 3     the size is that of the previous request, and is left out
+ *   then the block index, zigzag encoded as the difference with the
+ *   previous request's, the size, and for TF_MEMALIGN the base-2 logarithm
+ *   of the alignment.
+ * The previous index, size and thread start over at every block, so that
+ * blocks can be decoded on their own.
+ *
+ * Integers in the header and block lengths are in host byte order.
+ */
+#ifndef __TRACEFMT_H_
+#define __TRACEFMT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* First bytes of every binary trace */
+#define TF_MAGIC "MMTRACE1"
+#define TF_MAGIC_LEN 8
+
+/* Requests per block */
+#define TF_BLOCK_OPS 65536
+
+/* Header flag: blocks are compressed when it makes them smaller */
+#define TF_COMPRESS 0x1
+
+/* Request types, in the order of mdriver's */
+enum
+{
+    TF_ALLOC,
+    TF_FREE,
+    TF_REALLOC,
+    TF_MEMALIGN
+};
+
+typedef struct
+{
+    char magic[TF_MAGIC_LEN];
+    uint32_t flags;
+    uint32_t weight;      /* as in the header of a .rep file */
+    uint32_t num_ids;
+    uint32_t num_threads; /* 1 + highest thread number */
+    uint64_t num_ops;
+    uint64_t data_bytes;
+} tf_header_t;
+
+/* One request */
+typedef struct
+{
+    int type;
+    int index;    /* block index, -1 for free(NULL) */
+    size_t size;
+    size_t align; /* TF_MEMALIGN only */
+    int thread;
+} tf_op_t;
+
+/* Encodes requests into a binary trace file */
+typedef struct
+{
+    FILE *out;
+    tf_header_t header;    /* the caller fills in weight, num_ids and
+                              data_bytes before tf_writer_close */
+    unsigned char *raw;    /* the block being encoded */
+    size_t raw_len;
+    int block_ops;
+    unsigned char *packed; /* the block compressed */
+    int index;             /* previous request */
+    size_t size;
+    int thread;
+} tf_writer_t;
+
+/* Decodes the requests of a mapped binary trace */
+typedef struct
+{
+    const unsigned char *start; /* first block */
+    const unsigned char *p;     /* rest of the current block */
+    const unsigned char *end;
+    const unsigned char *next;  /* next block */
+    const unsigned char *limit; /* end of the file */
+    unsigned char *buf;         /* decompressed block */
+    int index;                  /* previous request */
+    size_t size;
+    int thread;
+} tf_reader_t;
+
+/* Start a binary trace in out; compress blocks if compress is set */
+bool tf_writer_open(tf_writer_t *w, FILE *out, bool compress);
+
+/* Append a request */
+bool tf_write_op(tf_writer_t *w, const tf_op_t *op);
+
+/* Write out the last block and the header */
+bool tf_writer_close(tf_writer_t *w);
+
+/* Return the header of a mapped binary trace, or NULL if it is not one */
+const tf_header_t *tf_check(const void *map, size_t len);
+
+/* Start decoding a mapped binary trace, checked with tf_check */
+void tf_reader_init(tf_reader_t *r, const void *map, size_t len);
+
+/* Go back to the first request */
+void tf_reader_rewind(tf_reader_t *r);
+
+/* Decode the next request into op; false at the end or on bad data */
+bool tf_read_op(tf_reader_t *r, tf_op_t *op);
+
+/* Release the decompression buffer */
+void tf_reader_free(tf_reader_t *r);
+
+#endif /* __TRACEFMT_H_ */